@@ -27,6 +27,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "usage.h"
 #include "field.h"
 #include "expect.h"
+#include "metrics.h"
+#include "trace.h"
+#include "smp.h"
 
 #include <unistd.h>
 #include <signal.h>
@@ -125,6 +128,8 @@ static int enqueue_packet_to_queuenum(struct sk_buff *skb,
 	pq->id = queueid++;
 
 	list_add_tail(&pq->list, &nfsim_queue);
+	trace_packet(TRACE_QUEUE, skb->seq, skb, skb->dev, NULL, NULL, 0,
+		     NF_QUEUE, pq->id);
 	log_packet(skb, "queue:added%s", describe_packet(skb));
 
 	return 0;
@@ -143,6 +148,13 @@ static int enqueue_packet(struct sk_buff *skb, struct nf_info *info,void *data)
 }
 #endif
 
+void (*hook_timer)(const struct nf_hook_ops *ops, unsigned int hooknum,
+		   uint64_t ns);
+void (*hook_enter)(const struct nf_hook_ops *ops, unsigned int hooknum);
+void (*hook_exit)(const struct nf_hook_ops *ops, unsigned int hooknum);
+
+static unsigned long hook_verdicts[NF_MAX_HOOKS][NF_MAX_VERDICT+1];
+
 /* We want logging for every hook */
 unsigned int call_elem_hook(struct nf_hook_ops *ops,
 			    unsigned int hooknum,
@@ -151,18 +163,37 @@ unsigned int call_elem_hook(struct nf_hook_ops *ops,
 			    const struct net_device *out,
 			    int (*okfn)(struct sk_buff *))
 {
-	unsigned int ret;
-	char *hookname = talloc_asprintf(NULL, "%s:%i", __func__, hooknum);
+	unsigned int ret, seq = (*skb)->seq;
+	uint64_t start;
 
 	nfsim_check_packet(*skb);
 
-	if (should_i_fail(hookname)) {
+	if (!suppress_failtest) {
+		char *hookname;
+
+		hookname = talloc_asprintf(NULL, "%s:%i", __func__, hooknum);
+		if (should_i_fail(hookname)) {
+			talloc_free(hookname);
+			return NF_DROP;
+		}
 		talloc_free(hookname);
-		return NF_DROP;
 	}
-	talloc_free(hookname);
 
-	ret = ops->hook(hooknum, skb, in, out, okfn);
+	if (hook_enter)
+		hook_enter(ops, hooknum);
+	if (hook_timer) {
+		start = time_ns();
+		ret = ops->hook(hooknum, skb, in, out, okfn);
+		hook_timer(ops, hooknum, time_ns() - start);
+	} else
+		ret = ops->hook(hooknum, skb, in, out, okfn);
+	if (hook_exit)
+		hook_exit(ops, hooknum);
+	if ((ret & NF_VERDICT_MASK) <= NF_MAX_VERDICT)
+		hook_verdicts[hooknum][ret & NF_VERDICT_MASK]++;
+	trace_packet(TRACE_HOOK, seq, ret == NF_STOLEN ? NULL : *skb,
+		     in ? in : out, ops->owner ? ops->owner->name : "nfsim",
+		     ops->hook, hooknum, ret & NF_VERDICT_MASK, ret >> NF_VERDICT_BITS);
 	if (ret == NF_STOLEN)
 		nfsim_log(LOG_HOOK, "hook:%s %s %s",
 			  nf_hooknames[PF_INET][hooknum],
@@ -176,6 +207,61 @@ unsigned int call_elem_hook(struct nf_hook_ops *ops,
 	return ret;
 }
 
+static void collect_hook_verdicts(struct metric_sink *sink)
+{
+	unsigned int h, v;
+
+	for (h = 0; h < NF_MAX_HOOKS; h++)
+		for (v = 0; v <= NF_MAX_VERDICT; v++)
+			if (hook_verdicts[h][v])
+				metric_value(sink, hook_verdicts[h][v],
+					     "hook=\"%s\",verdict=\"%s\"",
+					     nf_hooknames[PF_INET][h],
+					     nf_retval(v));
+}
+
+static struct metric hook_verdicts_metric = {
+	.name = "nfsim_hook_verdicts_total",
+	.type = "counter",
+	.help = "Verdicts returned by netfilter hook functions.",
+	.collect = collect_hook_verdicts,
+};
+
+#define DEVICE_METRIC(_field, _name, _help)				\
+static void collect_device_##_field(struct metric_sink *sink)		\
+{									\
+	struct net_device *dev;						\
+									\
+	list_for_each_entry(dev, &interfaces, entry)			\
+		metric_value(sink, dev->stats._field,			\
+			     "dev=\"%s\"", dev->name);			\
+}									\
+static struct metric device_##_field##_metric = {			\
+	.name = "nfsim_device_" _name "_total",				\
+	.type = "counter",						\
+	.help = _help,							\
+	.collect = collect_device_##_field,				\
+}
+
+DEVICE_METRIC(rxpackets, "rx_packets",
+	      "Packets received on each interface.");
+DEVICE_METRIC(rxbytes, "rx_bytes",
+	      "Bytes received on each interface.");
+DEVICE_METRIC(txpackets, "tx_packets",
+	      "Packets sent from each interface.");
+DEVICE_METRIC(txbytes, "tx_bytes",
+	      "Bytes sent from each interface.");
+
+static void core_metrics_init(void)
+{
+	metric_register(&device_rxpackets_metric);
+	metric_register(&device_rxbytes_metric);
+	metric_register(&device_txpackets_metric);
+	metric_register(&device_txbytes_metric);
+	metric_register(&hook_verdicts_metric);
+}
+
+init_call(core_metrics_init);
 
 static void run_inits(void)
 {
@@ -375,16 +461,20 @@ void check_allocations(void)
 	}
 }
 
+/* Named builtins are modules: tools/module.c loads them like the others. */
 static void initialize_builtin_modules(void)
 {
 	/* Linker magic creates these to delineate section. */
-	extern initcall_t __start_module_init[], __stop_module_init[];
-	initcall_t *p;
+	extern struct builtin_initcall __start_module_init[],
+		__stop_module_init[];
+	struct builtin_initcall *p;
 	int ret;
 
 	/* Runs in link order. */
 	for (p = __start_module_init; p < __stop_module_init; p++) {
-		ret = (*p)();
+		if (p->name)
+			continue;
+		ret = p->fn();
 		if (ret)
 			nfsim_log(LOG_UI, "Initcall %p failed: %d\n", p, ret);
 	}
@@ -393,12 +483,33 @@ static void initialize_builtin_modules(void)
 void remove_builtin_modules(void)
 {
 	/* Linker magic creates these to delineate section. */
-	extern exitcall_t __start_module_exit[], __stop_module_exit[];
-	exitcall_t *p;
+	extern struct builtin_exitcall __start_module_exit[],
+		__stop_module_exit[];
+	struct builtin_exitcall *p;
 
 	/* Stop them in reverse order. */
 	for (p = __stop_module_exit-1; p >= __start_module_exit; p--)
-		(*p)();
+		if (!p->name)
+			p->fn();
+}
+
+/* Run the script, then make sure it cleaned up after itself. */
+void run_script(int input_fd)
+{
+	tui_run(input_fd);
+	shard_report();
+
+	/* Everyone loves a good error haiku! */
+	if (expects_remaining())
+		barf("Expectations still / "
+		     "unfulfilled remaining. / "
+		     "Testing blossoms fail.");
+
+	message_cleanup();
+	if (unload_all_modules()) {
+		remove_builtin_modules();
+		check_allocations();
+	}
 }
 
 int main(int argc, char **argv)
@@ -420,7 +531,10 @@ int main(int argc, char **argv)
 		copt->parse(&copt->opt);
 	}
 
-	if (optind < argc) {
+	if (zygote_mode()) {
+		if (optind == argc)
+			barf("--zygote needs scripts to run");
+	} else if (optind < argc) {
 		input_fd = open(argv[optind], O_RDONLY);
 		if (input_fd < 0)
 			barf_perror("Opening %s", argv[optind]);
@@ -490,22 +604,15 @@ int main(int argc, char **argv)
 	nfsim_log(LOG_UI, "initialisation done");
 
 	message_init();
+	run_setup_script();
 	suppress_failtest--;
 
-	tui_run(input_fd);
-
-	/* Everyone loves a good error haiku! */
-	if (expects_remaining())
-		barf("Expectations still / "
-		     "unfulfilled remaining. / "
-		     "Testing blossoms fail.");
-
-	message_cleanup();
-	if (unload_all_modules()) {
-		remove_builtin_modules();
-		check_allocations();
-	}
+	if (zygote_mode())
+		return zygote_run(argc - optind, argv + optind);
+	if (shard_mode())
+		return shard_run(input_fd);
 
+	run_script(input_fd);
 	return 0;
 }
 
@@ -517,6 +624,10 @@ const char *describe_packet(struct sk_buff *skb)
 
 	*ptr = '\0';
 
+	/* Not going to be printed: don't waste time on it. */
+	if (suppress_logging)
+		return pbuf;
+
 	if (!log_describe_packets())
 		return pbuf;
 
@@ -542,20 +653,83 @@ const char *describe_packet(struct sk_buff *skb)
 	return pbuf;
 }
 
+/* There can be thousands of interfaces (eg. VLANs): hash them by name,
+ * and keep an array indexed by ifindex. */
+#define INTERFACE_HASH_SIZE	1024
+static struct net_device *interface_hash[INTERFACE_HASH_SIZE];
+static struct net_device **interface_index;
+static int interface_index_size;
+
+static unsigned int interface_hashfn(const char *name)
+{
+	return jhash((void *)name, strnlen(name, IFNAMSIZ), 0)
+		& (INTERFACE_HASH_SIZE - 1);
+}
+
 struct net_device *interface_by_name(const char *name)
 {
 	struct net_device *dev;
 
-	list_for_each_entry(dev, &interfaces, entry)
+	for (dev = interface_hash[interface_hashfn(name)]; dev;
+	     dev = dev->name_next)
 		if (!strncmp(dev->name, name, IFNAMSIZ))
 			return dev;
 
-
 	return NULL;
 }
 
+struct net_device *interface_by_index(int ifindex)
+{
+	if (ifindex <= 0 || ifindex >= interface_index_size)
+		return NULL;
+	return interface_index[ifindex];
+}
+
+static int destroy_interface(void *d)
+{
+	struct net_device *dev = d, **p;
+
+	for (p = &interface_hash[interface_hashfn(dev->name)]; *p;
+	     p = &(*p)->name_next) {
+		if (*p == dev) {
+			*p = dev->name_next;
+			break;
+		}
+	}
+	if (interface_by_index(dev->ifindex) == dev)
+		interface_index[dev->ifindex] = NULL;
+	list_del(&dev->entry);
+	return 0;
+}
+
+void register_interface(struct net_device *dev)
+{
+	unsigned int h = interface_hashfn(dev->name);
+
+	if (dev->ifindex >= interface_index_size) {
+		int i, size = (dev->ifindex + 1) * 2;
+
+		interface_index = talloc_realloc(NULL, interface_index,
+						 struct net_device *, size);
+		for (i = interface_index_size; i < size; i++)
+			interface_index[i] = NULL;
+		interface_index_size = size;
+	}
+	interface_index[dev->ifindex] = dev;
+
+	dev->name_next = interface_hash[h];
+	interface_hash[h] = dev;
+	list_add_tail(&dev->entry, &interfaces);
+	talloc_set_destructor(dev, destroy_interface);
+}
+
+void (*send_observer)(struct sk_buff *skb, const struct net_device *dev);
+
 int nf_send_local(struct sk_buff *skb)
 {
+	if (send_observer)
+		send_observer(skb, NULL);
+	trace_packet(TRACE_SEND, skb->seq, skb, NULL, NULL, NULL, 0, 0, 0);
 	log_packet(skb, "send:LOCAL%s", describe_packet(skb));
 	kfree_skb(skb);
 	return 0;
@@ -565,6 +739,9 @@ int nf_send(struct sk_buff *skb)
 {
 	skb->dev->stats.txpackets++;
 	skb->dev->stats.txbytes += skb->len;
+	if (send_observer)
+		send_observer(skb, skb->dev);
+	trace_packet(TRACE_SEND, skb->seq, skb, skb->dev, NULL, NULL, 0, 0, 0);
 
 	log_packet(skb, "send:%s%s", skb->dev->name,
 		describe_packet(skb));
@@ -574,14 +751,28 @@ int nf_send(struct sk_buff *skb)
 
 int nf_rcv(struct sk_buff *skb)
 {
+	unsigned int cpu = nfsim_cpu;
+	int ret;
+
+	metrics_packet();
+	smp_packet(skb);
 	/* change for protocol... */
-	return ip_rcv(skb);
+	ret = ip_rcv(skb);
+	nfsim_cpu = cpu;
+	return ret;
 }
 
 int nf_rcv_local(struct sk_buff *skb)
 {
+	unsigned int cpu = nfsim_cpu;
+	int ret;
+
+	metrics_packet();
+	smp_packet(skb);
 	/* change for protocol... */
-	return ip_rcv_local(skb);
+	ret = ip_rcv_local(skb);
+	nfsim_cpu = cpu;
+	return ret;
 }
 
 /* Don't do should_i_fail() here: it doesn't actually ever fail. */
@@ -37,6 +37,10 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 struct list_head interfaces;
 
 struct net_device *interface_by_name(const char *name);
+struct net_device *interface_by_index(int ifindex);
+
+/* Put dev on the interfaces list and lookup tables (until it's freed). */
+void register_interface(struct net_device *dev);
 
 /* This should be enough to fool you all.  Bwahahahahah! */
 extern struct net_device *loopback_dev_p;
@@ -48,6 +52,10 @@ extern struct net_device *loopback_dev_p;
 int nf_send(struct sk_buff *skb);
 int nf_send_local(struct sk_buff *skb);
 
+/* If set, called with every packet sent (dev NULL for local delivery). */
+extern void (*send_observer)(struct sk_buff *skb,
+			     const struct net_device *dev);
+
 int nf_rcv(struct sk_buff *skb);
 int nf_rcv_local(struct sk_buff *skb);
 
@@ -254,6 +262,14 @@ unsigned int call_elem_hook(struct nf_hook_ops *ops,
 			    const struct net_device *out,
 			    int (*okfn)(struct sk_buff *));
 
+/* If set, called with the time each hook function took (see bench). */
+extern void (*hook_timer)(const struct nf_hook_ops *ops, unsigned int hooknum,
+			  uint64_t ns);
+
+/* If set, called before and after each hook function (see profile). */
+extern void (*hook_enter)(const struct nf_hook_ops *ops, unsigned int hooknum);
+extern void (*hook_exit)(const struct nf_hook_ops *ops, unsigned int hooknum);
+
 /* netlink sockets */
 
 int netlink_register_notifier(struct notifier_block *nb);
@@ -296,6 +312,24 @@ extern void *nfsim_tallocs;
 extern const char *nfsim_testname;
 
 extern char *module_path;
+
+/* Run a script to the end, and check for leaks. */
+void run_script(int input_fd);
+
+/* Setup script, run once initialization is done (see zygote.c). */
+void run_setup_script(void);
+
+/* Zygote mode: fork after setup to run each script.  Returns exit code. */
+bool zygote_mode(void);
+int zygote_run(int num, char *scripts[]);
+
+/* Shard mode: fork after setup, each copy handling some of the flows
+ * (see shard.c).  Returns exit code. */
+bool shard_mode(void);
+int shard_run(int input_fd);
+/* Should this shard send the flow's packets?  Ports in host order. */
+bool shard_flow(u32 saddr, u32 daddr, u8 protocol, u16 sport, u16 dport);
+void shard_report(void);
 enum exitcodes
 {
 	/* EXIT_SUCCESS, EXIT_FAILURE is in stdlib.h */
@@ -307,7 +341,7 @@ enum exitcodes
 typedef void (*nfsim_initcall_t)(void);
 #define init_call(fn) \
 	static nfsim_initcall_t __initcall_##fn \
-	__attribute__((__unused__)) \
+	__attribute__((__used__)) \
 	__attribute__((__section__("nfsim_init_call"))) = &fn
 
 /* distributed command line options */
@@ -320,7 +354,7 @@ struct cmdline_option
 
 #define cmdline_opt(_name, _has_arg, _c, _fn)                                \
        static struct cmdline_option __cat(__cmdlnopt_,__unique_id(_fn))      \
-       __attribute__((__unused__))                                           \
+       __attribute__((__used__))                                             \
        __attribute__((__section__("cmdline")))                               \
        = { .opt = { .name = _name, .has_arg = _has_arg, .val = _c },         \
 	   .parse = _fn }
@@ -0,0 +1,401 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Running `commands` for scripts.  By default each one is a popen(), but
+ * extensions can be declared persistent (started once, then fed requests
+ * over a pipe) and/or cached (same command line, same output). */
+
+#include <tui.h>
+#include <log.h>
+#include <extension.h>
+#include <kernelenv.h>
+#include "utils.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#define EXTENSION_MAX_OUTPUT	(1024*1024)
+
+/* If cached output grows past this, we throw it all away. */
+#define EXTENSION_CACHE_MAX	(16*1024*1024)
+#define EXTENSION_CACHE_HASH	1024
+
+struct extension {
+	struct list_head list;
+	char *name;
+	bool persistent, cached;
+
+	/* Coprocess, once started. */
+	pid_t pid;
+	FILE *to, *from;
+
+	unsigned long runs, hits;
+};
+
+struct cached_output {
+	struct cached_output *next;
+	char *cmd;
+	char *output;
+	size_t len;
+};
+
+static LIST_HEAD(extensions);
+static struct cached_output *cache[EXTENSION_CACHE_HASH];
+static size_t cache_size;
+
+static struct extension *find_extension(const char *name, size_t len)
+{
+	struct extension *ext;
+
+	list_for_each_entry(ext, &extensions, list)
+		if (strlen(ext->name) == len && strncmp(ext->name, name, len) == 0)
+			return ext;
+	return NULL;
+}
+
+static unsigned int cache_hashfn(const char *cmd, size_t cmdlen)
+{
+	return jhash((void *)cmd, cmdlen, 0) & (EXTENSION_CACHE_HASH - 1);
+}
+
+static struct cached_output *find_cached(const char *cmd, size_t cmdlen)
+{
+	struct cached_output *c;
+
+	for (c = cache[cache_hashfn(cmd, cmdlen)]; c; c = c->next)
+		if (strlen(c->cmd) == cmdlen && memcmp(c->cmd, cmd, cmdlen) == 0)
+			return c;
+	return NULL;
+}
+
+static void flush_cache(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < EXTENSION_CACHE_HASH; i++) {
+		while (cache[i]) {
+			struct cached_output *c = cache[i];
+
+			cache[i] = c->next;
+			talloc_free(c);
+		}
+	}
+	cache_size = 0;
+}
+
+static void add_cached(const char *cmd, size_t cmdlen,
+		       const char *output, size_t len)
+{
+	struct cached_output *c;
+	unsigned int hash;
+
+	if (cache_size + len > EXTENSION_CACHE_MAX)
+		flush_cache();
+
+	c = talloc(NULL, struct cached_output);
+	c->cmd = talloc_strndup(c, cmd, cmdlen);
+	c->output = talloc_memdup(c, output, len);
+	c->len = len;
+
+	hash = cache_hashfn(cmd, cmdlen);
+	c->next = cache[hash];
+	cache[hash] = c;
+	cache_size += len;
+}
+
+static char *run_popen(const char *cmd, size_t cmdlen, const void *ctx,
+		       size_t *used)
+{
+	char *cmdstr, *str;
+	FILE *cmdfile;
+	size_t len, i;
+	int status;
+
+	cmdstr = talloc_asprintf(ctx, "PATH=%s; %.*s",
+				 extension_path, (int)cmdlen, cmd);
+	cmdfile = popen(cmdstr, "r");
+	if (!cmdfile)
+		script_fail("failed to popen '%s': %s\n",
+			    cmdstr, strerror(errno));
+
+	/* Read command output. */
+	*used = 0;
+	len = 1024;
+	str = talloc_array(ctx, char, len);
+
+	while ((i = fread(str + *used, 1, len - *used, cmdfile)) != 0) {
+		*used += i;
+		if (*used == len) {
+			if (len > EXTENSION_MAX_OUTPUT)
+				script_fail("command '%s' output too long\n",
+					    cmdstr);
+			len *= 2;
+			str = talloc_realloc(ctx, str, char, len);
+		}
+	}
+	status = pclose(cmdfile);
+	if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		script_fail("command '%s' failed\n", cmdstr);
+
+	talloc_free(cmdstr);
+	return str;
+}
+
+static void start_coprocess(struct extension *ext)
+{
+	int to[2], from[2];
+	char *cmdstr;
+
+	if (pipe(to) != 0 || pipe(from) != 0)
+		barf_perror("extension pipe");
+
+	/* Programs we start later shouldn't hold these open. */
+	fcntl(to[1], F_SETFD, FD_CLOEXEC);
+	fcntl(from[0], F_SETFD, FD_CLOEXEC);
+
+	fflush(stdout);
+	nfsim_log_flush();
+	ext->pid = fork();
+	switch (ext->pid) {
+	case -1:
+		barf_perror("extension fork");
+	case 0:
+		dup2(to[0], STDIN_FILENO);
+		dup2(from[1], STDOUT_FILENO);
+		close(to[0]);
+		close(from[1]);
+		setenv("NFSIM_EXTENSION_PROTOCOL", "1", 1);
+		cmdstr = talloc_asprintf(NULL, "PATH=%s; exec %s",
+					 extension_path, ext->name);
+		execl("/bin/sh", "sh", "-c", cmdstr, NULL);
+		fprintf(stderr, "Could not exec %s!\n", ext->name);
+		exit(EXIT_FAILURE);
+	}
+
+	close(to[0]);
+	close(from[1]);
+	ext->to = fdopen(to[1], "w");
+	ext->from = fdopen(from[0], "r");
+	if (!ext->to || !ext->from)
+		barf_perror("extension fdopen");
+}
+
+static void stop_coprocess(struct extension *ext)
+{
+	if (!ext->to)
+		return;
+
+	/* It sees end of file, and exits. */
+	fclose(ext->to);
+	fclose(ext->from);
+	waitpid(ext->pid, NULL, 0);
+	ext->to = ext->from = NULL;
+}
+
+void extension_cleanup(void)
+{
+	struct extension *ext;
+
+	list_for_each_entry(ext, &extensions, list)
+		stop_coprocess(ext);
+}
+
+void extension_forked(void)
+{
+	struct extension *ext;
+
+	/* Our parent is still talking to them: don't wait, just let go. */
+	list_for_each_entry(ext, &extensions, list) {
+		if (!ext->to)
+			continue;
+		fclose(ext->to);
+		fclose(ext->from);
+		ext->to = ext->from = NULL;
+	}
+}
+
+/* Request is "<length>\n<arguments>", reply "<status> <length>\n<output>" */
+static char *coprocess_request(struct extension *ext,
+			       const char *args, size_t argslen,
+			       const void *ctx, size_t *len)
+{
+	char header[64], *str;
+	int status;
+
+	if (!ext->to)
+		start_coprocess(ext);
+
+	fprintf(ext->to, "%zu\n", argslen);
+	fwrite(args, 1, argslen, ext->to);
+	if (fflush(ext->to) != 0)
+		script_fail("extension '%s' died", ext->name);
+
+	if (!fgets(header, sizeof(header), ext->from))
+		script_fail("extension '%s' died", ext->name);
+	if (sscanf(header, "%d %zu", &status, len) != 2)
+		script_fail("extension '%s' bad reply '%s'", ext->name, header);
+	if (*len > EXTENSION_MAX_OUTPUT)
+		script_fail("extension '%s' output too long", ext->name);
+
+	str = talloc_array(ctx, char, *len + 1);
+	if (fread(str, 1, *len, ext->from) != *len)
+		script_fail("extension '%s' died", ext->name);
+
+	if (status != 0)
+		script_fail("command '%s %.*s' failed",
+			    ext->name, (int)argslen, args);
+	return str;
+}
+
+char *extension_run(const char *cmd, size_t cmdlen, const void *ctx,
+		    size_t *len)
+{
+	struct extension *ext;
+	struct cached_output *c;
+	size_t namelen, skip;
+	char *str;
+
+	skip = 0;
+	while (skip < cmdlen && isspace(cmd[skip]))
+		skip++;
+	for (namelen = 0; skip + namelen < cmdlen; namelen++)
+		if (isspace(cmd[skip + namelen]))
+			break;
+
+	ext = find_extension(cmd + skip, namelen);
+	if (!ext)
+		return run_popen(cmd, cmdlen, ctx, len);
+
+	if (ext->cached && (c = find_cached(cmd, cmdlen))) {
+		ext->hits++;
+		*len = c->len;
+		return talloc_memdup(ctx, c->output, c->len);
+	}
+
+	ext->runs++;
+	if (ext->persistent) {
+		skip += namelen;
+		while (skip < cmdlen && isspace(cmd[skip]))
+			skip++;
+		str = coprocess_request(ext, cmd + skip, cmdlen - skip,
+					ctx, len);
+	} else
+		str = run_popen(cmd, cmdlen, ctx, len);
+
+	if (ext->cached)
+		add_cached(cmd, cmdlen, str, *len);
+	return str;
+}
+
+static bool extension_cmd(int argc, char **argv)
+{
+	struct extension *ext;
+	bool persistent = false, cached = false;
+	int i;
+
+	if (argc == 1) {
+		list_for_each_entry(ext, &extensions, list)
+			nfsim_log(LOG_ALWAYS, "%s:%s%s runs %lu cache hits %lu",
+				  ext->name,
+				  ext->persistent ? " persistent" : "",
+				  ext->cached ? " cached" : "",
+				  ext->runs, ext->hits);
+		return true;
+	}
+
+	for (i = 2; i < argc; i++) {
+		if (streq(argv[i], "persistent"))
+			persistent = true;
+		else if (streq(argv[i], "cached"))
+			cached = true;
+		else {
+			nfsim_log(LOG_ALWAYS, "extension: unknown flag '%s'",
+				  argv[i]);
+			return false;
+		}
+	}
+
+	ext = find_extension(argv[1], strlen(argv[1]));
+	if (!ext) {
+		ext = talloc_zero(NULL, struct extension);
+		ext->name = talloc_strdup(ext, argv[1]);
+		list_add_tail(&ext->list, &extensions);
+	}
+
+	if (!persistent)
+		stop_coprocess(ext);
+	ext->persistent = persistent;
+	ext->cached = cached;
+
+	/* Back to plain popen. */
+	if (!persistent && !cached) {
+		list_del(&ext->list);
+		talloc_free(ext);
+	}
+	return true;
+}
+
+static void extension_help(int argc, char **argv)
+{
+#include "extension-help:extension"
+/*** XML Help:
+    <section id="c:extension">
+     <title><command>extension</command></title>
+     <para>Declare how a backquoted extension is run</para>
+     <cmdsynopsis>
+      <command>extension</command>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>extension</command>
+      <arg choice="req"><replaceable>name</replaceable></arg>
+      <arg choice="opt">persistent</arg>
+      <arg choice="opt">cached</arg>
+     </cmdsynopsis>
+     <para>Normally each <userinput>`command`</userinput> in a script
+      runs a new shell.  <command>extension</command> changes that for
+      commands starting with <replaceable>name</replaceable>; with no
+      flags, it goes back to the normal behaviour.  With no arguments,
+      it lists the declared extensions, how many times each has been run,
+      and how many results came from the cache.</para>
+     <para>A <option>persistent</option> extension is started once, with
+      NFSIM_EXTENSION_PROTOCOL set in its environment, and answers
+      requests on its standard input.  Each request is the length of the
+      arguments in decimal and a newline, followed by the arguments (the
+      rest of the backquoted command) without a newline.  The reply is the
+      exit status and length of output in decimal, separated by a space
+      and followed by a newline, then the output itself.  A non-zero
+      status fails the script like a failing command.  The extension should
+      exit when its standard input is closed.</para>
+     <para>A <option>cached</option> extension must always give the same
+      output for the same command line: each distinct command line is only
+      run once.</para>
+    </section>
+*/
+}
+
+static void init(void)
+{
+	tui_register_command("extension", extension_cmd, extension_help);
+}
+
+init_call(init);
@@ -0,0 +1,40 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __HAVE_EXTENSION_H
+#define __HAVE_EXTENSION_H
+
+#include <stddef.h>
+
+/* Run the `command` (cmdlen chars at cmd) for a script: returns its output
+ * (not nul-terminated, length in *len), talloced off ctx.  Fails the
+ * script if the command fails. */
+char *extension_run(const char *cmd, size_t cmdlen, const void *ctx,
+		    size_t *len);
+
+/* Stop any persistent extensions, and wait for them to exit. */
+void extension_cleanup(void);
+
+/* We're a forked copy of the simulator: leave our parent's persistent
+ * extensions alone, and start our own when needed. */
+void extension_forked(void);
+
+#endif /* __HAVE_EXTENSION_H */
@@ -23,6 +23,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <kernelenv.h>
 #include <utils.h>
 #include <tui.h>
+#include <metrics.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -245,6 +246,47 @@ bool should_i_fail_once(const char *location)
 	return false;
 }
 
+static void collect_failpoints(struct metric_sink *sink)
+{
+	metric_value(sink, failpoints, NULL);
+}
+
+static void collect_failures(struct metric_sink *sink)
+{
+	metric_value(sink, fails, NULL);
+}
+
+static void collect_decisions(struct metric_sink *sink)
+{
+	struct fail_decision *i;
+	unsigned long num = 0;
+
+	list_for_each_entry(i, &decisions, list)
+		num++;
+	metric_value(sink, num, NULL);
+}
+
+static struct metric failtest_metrics[] = {
+	{ .name = "nfsim_failtest_points_total", .type = "counter",
+	  .help = "Calls to should_i_fail().",
+	  .collect = collect_failpoints },
+	{ .name = "nfsim_failtest_failures_total", .type = "counter",
+	  .help = "Failures injected on the path to this process.",
+	  .collect = collect_failures },
+	{ .name = "nfsim_failtest_decisions", .type = "gauge",
+	  .help = "Failure decisions forked so far (the failpath length).",
+	  .collect = collect_decisions },
+};
+
+static void failtest_metrics_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(failtest_metrics); i++)
+		metric_register(&failtest_metrics[i]);
+}
+init_call(failtest_metrics_init);
+
 /* Should I fail at this point? */
 bool should_i_fail(const char *func)
 {
@@ -276,6 +318,7 @@ bool should_i_fail(const char *func)
 	list_add_tail(&dec->list, &decisions);
 
 	fflush(stdout);
+	nfsim_log_flush();
 	child = fork();
 	if (child == -1)
 		barf_perror("fork failed for failtest!");
@@ -288,6 +331,8 @@ bool should_i_fail(const char *func)
 			fails++;
 		/* If we're talking to iptables, it has to fork too. */
 		fork_other_program();
+		/* Our failure path's numbers would overwrite the parent's. */
+		metrics_stats_file_close();
 		return true;
 	}
 
@@ -34,6 +34,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <stdlib.h>
 #include <stdarg.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 
 #include <dlfcn.h>
 
@@ -52,6 +53,17 @@ static int (*__close)(int);
 
 static int sd;
 static void *handle;
+
+/* For fork server mode: we run main() ourselves, once per command. */
+typedef int (*main_fn)(int, char **, char **);
+static int (*__libc_start_main_real)(main_fn, int, char **, void (*)(void),
+				     void (*)(void), void (*)(void), void *);
+static main_fn real_main;
+extern char **environ;
+
+/* Region the simulator copies through, once it has sent it. */
+static void *shm;
+static unsigned long shm_size;
 static char *proc_prefix = "/tmp/nfsim/proc";
 
 #undef DEBUG
@@ -103,6 +115,12 @@ void _init(void)
 	sym(handle, fopen);
 	sym(handle, close);
 
+	__libc_start_main_real = dlsym(handle, "__libc_start_main");
+	if (!__libc_start_main_real) {
+		fprintf(stderr, "%s\n", dlerror());
+		exit(EXIT_FAILURE);
+	}
+
 	dlclose(handle);
 
 	if (!(fdstr = getenv("NFSIM_FAKESOCK_FD"))) {
@@ -156,6 +174,24 @@ static int recv_fd(int from_fd)
 	return *((int*)CMSG_DATA(cmsg));
 }
 
+/* Tell the simulator the program has exited, as a message through its
+ * socket, since it isn't the program's parent. */
+static void report_exit(int msg_fd, int status)
+{
+	struct nf_userspace_message msg;
+
+	msg.type = UM_SYSCALL;
+	msg.opcode = SYS_EXIT;
+	msg.args[0] = status;
+	msg.args[1] = 0;
+	msg.args[2] = 0;
+	msg.args[3] = 0;
+	msg.len = 0;
+	msg.retval = 0;
+
+	write(msg_fd, &msg, sizeof(msg));
+}
+
 static void do_fork(void)
 {
 	int pid, out_fd, msg_fd;
@@ -176,7 +212,6 @@ static void do_fork(void)
 		close(sd);
 		sd = msg_fd;
 	} else {
-		struct nf_userspace_message msg;
 		int status;
 
 		/* Wait for kid.  We write its exit status as a
@@ -184,21 +219,28 @@ static void do_fork(void)
 		waitpid(pid, &status, 0);
 
 		fprintf(stderr, "Child exited %i\n", status);
-		msg.type = UM_SYSCALL;
-		msg.opcode = SYS_EXIT;
-		msg.args[0] = status;
-		msg.args[1] = 0;
-		msg.args[2] = 0;
-		msg.args[3] = 0;
-		msg.len = 0;
-		msg.retval = 0;
-
-		write(msg_fd, &msg, sizeof(msg));
+		report_exit(msg_fd, status);
 		close(msg_fd);
 		close(out_fd);
 	}
 }
 
+static int map_shm(unsigned long size)
+{
+	int fd = recv_fd(sd);
+
+	if (shm)
+		munmap(shm, shm_size);
+	shm = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	(*__close)(fd);
+	if (shm == MAP_FAILED) {
+		shm = NULL;
+		return -errno;
+	}
+	shm_size = size;
+	return 0;
+}
+
 static void handle_kernelop(int fd, struct nf_userspace_message *msg)
 {
 	struct nf_userspace_message *reply;
@@ -222,6 +264,18 @@ static void handle_kernelop(int fd, struct nf_userspace_message *msg)
 				(char *)msg->args[1], msg->args[2]);
 		reply->len = msg->args[2];
 
+		break;
+	case KOP_COPY_TO_USER_SHM:
+		memcpy((char *)(msg->args[0]), shm, msg->args[2]);
+		reply = msg;
+		break;
+	case KOP_COPY_FROM_USER_SHM:
+		memcpy(shm, (char *)msg->args[1], msg->args[2]);
+		reply = msg;
+		break;
+	case KOP_SHM_SETUP:
+		reply = msg;
+		reply->retval = map_shm(msg->args[0]);
 		break;
 	case KOP_FORK:
 		do_fork();
@@ -299,6 +353,114 @@ static int fake_syscall(struct nf_userspace_message *msg)
 
 }
 
+static bool read_all(int fd, void *buf, unsigned long len)
+{
+	unsigned long done = 0;
+	int ret;
+
+	while (done < len) {
+		ret = read(fd, (char *)buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		done += ret;
+	}
+	return true;
+}
+
+/* One KOP_SPAWN request: arguments follow the header, nul-separated, then
+ * the output and message fds for this command.  The child runs main(). */
+static void serve_spawn(void)
+{
+	struct nf_userspace_message msg;
+	int pid, out_fd, msg_fd, status, ret, i;
+	char *args, **argv;
+
+	ret = read(sd, &msg, sizeof(msg));
+	/* Simulator has finished with us. */
+	if (ret == 0)
+		exit(EXIT_SUCCESS);
+	if (ret < 0 && errno == EINTR)
+		return;
+	if (ret <= 0
+	    || !read_all(sd, (char *)&msg + ret, sizeof(msg) - ret)) {
+		perror("fork server read");
+		exit(EXIT_FAILURE);
+	}
+	if (msg.type != UM_KERNELOP || msg.opcode != KOP_SPAWN) {
+		fprintf(stderr, "Invalid fork server request %d\n", msg.opcode);
+		exit(EXIT_FAILURE);
+	}
+
+	args = malloc(msg.len);
+	argv = malloc((msg.args[0] + 1) * sizeof(char *));
+	if (!args || !argv || !read_all(sd, args, msg.len)) {
+		perror("fork server arguments");
+		exit(EXIT_FAILURE);
+	}
+	out_fd = recv_fd(sd);
+	msg_fd = recv_fd(sd);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0) {
+		dup2(out_fd, STDOUT_FILENO);
+		dup2(out_fd, STDERR_FILENO);
+		(*__close)(out_fd);
+		(*__close)(sd);
+		sd = msg_fd;
+
+		for (i = 0, ret = 0; i < msg.args[0]; i++) {
+			argv[i] = args + ret;
+			ret += strlen(argv[i]) + 1;
+		}
+		argv[i] = NULL;
+		exit(real_main(msg.args[0], argv, environ));
+	}
+
+	free(args);
+	free(argv);
+	(*__close)(out_fd);
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			status = -1;
+			break;
+		}
+	}
+	report_exit(msg_fd, status);
+	(*__close)(msg_fd);
+}
+
+static int fork_server_main(int argc, char **argv, char **envp)
+{
+	/* Things the program runs (eg. modprobe) are ordinary programs. */
+	if (!getenv("NFSIM_FORKSERVER"))
+		return real_main(argc, argv, envp);
+	unsetenv("NFSIM_FORKSERVER");
+
+	for (;;)
+		serve_spawn();
+}
+
+/* Called by the program's startup code: with NFSIM_FORKSERVER set, we get
+ * this far (exec, linking, _init) once, then fork for each command. */
+int __libc_start_main(main_fn main, int argc, char **argv,
+		      void (*init)(void), void (*fini)(void),
+		      void (*rtld_fini)(void), void *stack_end);
+int __libc_start_main(main_fn main, int argc, char **argv,
+		      void (*init)(void), void (*fini)(void),
+		      void (*rtld_fini)(void), void *stack_end)
+{
+	real_main = main;
+	return __libc_start_main_real(fork_server_main, argc, argv, init,
+				      fini, rtld_fini, stack_end);
+}
+
 int getsockopt(int s, int level, int optname, void *optval,
 		socklen_t *optlen)
 {
@@ -23,6 +23,8 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "utils.h"
 #include <core.h>
 #include <field.h>
+#include <metrics.h>
+#include <trace.h>
 
 #include <linux/netfilter_ipv4.h>
 
@@ -56,6 +58,18 @@ void add_route_for_device(struct in_device *indev)
 	list_add_tail(&route->entry, &routes);
 }
 
+/* The routing cache is kept most recently used first.  Entries nobody
+ * holds (see dst_hold) expire once unused for a while, and when it's
+ * full the least recently used of those makes way for a new one. */
+#define RCACHE_DEFAULT_MAX 4096
+#define RCACHE_EXPIRE (300 * HZ)
+#define RCACHE_GC_INTERVAL (60 * HZ)
+
+static unsigned int rcache_max = RCACHE_DEFAULT_MAX;
+static unsigned long rcache_entries, rcache_next_gc;
+static unsigned long rcache_hits, rcache_misses;
+static unsigned long rcache_expired, rcache_evicted;
+
 static int destroy_rtable(void *r)
 {
 	struct rtable *rt = r, **p;
@@ -64,24 +78,155 @@ static int destroy_rtable(void *r)
 	for (p = &rcache; *p; p = &(*p)->u.rt_next) {
 		if (*p == rt) {
 			*p = rt->u.rt_next;
+			rcache_entries--;
 			break;
 		}
 	}
 	return 0;
 }
 
+/* We know where it is: don't make the destructor look for it. */
+static void rcache_free(struct rtable **p)
+{
+	struct rtable *rt = *p;
+
+	*p = rt->u.rt_next;
+	rcache_entries--;
+	talloc_set_destructor(rt, NULL);
+	talloc_free(rt);
+}
+
+static bool rcache_unused(const struct rtable *rt)
+{
+	return atomic_read(&rt->u.dst.__refcnt) <= 0;
+}
+
+/* Every RCACHE_GC_INTERVAL of simulated time, expire old entries; and
+ * if the cache is full, make room for one more. */
+static void rcache_gc(void)
+{
+	struct rtable **p, **lru = NULL;
+	bool expire = time_after_eq(jiffies, rcache_next_gc);
+
+	if (!expire && rcache_entries < rcache_max)
+		return;
+	if (expire)
+		rcache_next_gc = jiffies + RCACHE_GC_INTERVAL;
+
+	for (p = &rcache; *p; ) {
+		if (!rcache_unused(*p)) {
+			p = &(*p)->u.rt_next;
+			continue;
+		}
+		if (expire && time_after_eq(jiffies, (*p)->u.dst.lastuse
+					    + RCACHE_EXPIRE)) {
+			rcache_free(p);
+			rcache_expired++;
+			continue;
+		}
+		lru = p;
+		p = &(*p)->u.rt_next;
+	}
+
+	if (rcache_entries >= rcache_max && lru) {
+		rcache_free(lru);
+		rcache_evicted++;
+	}
+}
+
+/* A new entry, held by the caller. */
+static void rcache_add(struct rtable *rt)
+{
+	rcache_gc();
+	atomic_set(&rt->u.dst.__refcnt, 1);
+	rt->u.dst.lastuse = jiffies;
+	rt->u.rt_next = rcache;
+	rcache = rt;
+	rcache_entries++;
+}
+
+/* Found *p in the cache: move it to the front, and hold it. */
+static struct rtable *rcache_hit(struct rtable **p)
+{
+	struct rtable *rt = *p;
+
+	*p = rt->u.rt_next;
+	rt->u.rt_next = rcache;
+	rcache = rt;
+	rt->u.dst.lastuse = jiffies;
+	dst_hold(&rt->u.dst);
+	rcache_hits++;
+	return rt;
+}
+
+/*** XML Argument:
+    <section id="a:rcache-max">
+     <title><option>--rcache-max
+      <replaceable>entries</replaceable></option></title>
+     <subtitle>Limit the size of the routing cache</subtitle>
+     <para>The routing cache holds an entry for each source, destination,
+     TOS and interface seen, most recently used first.  Once it has
+     <replaceable>entries</replaceable> entries (default 4096), the
+     least recently used entry which no packet is using is dropped to
+     make room for a new one.  Unused entries are also dropped after
+     300 seconds of simulated time.  <command>stats</command> shows
+     the hits, misses and evictions.</para>
+    </section>
+*/
+static void cmdline_rcache_max(struct option *opt)
+{
+	extern char *optarg;
+	char *end;
+
+	if (!optarg)
+		barf("rcache-max option requires an argument");
+	rcache_max = strtoul(optarg, &end, 0);
+	if (*end || rcache_max == 0)
+		barf("rcache-max must be a positive number");
+}
+cmdline_opt("rcache-max", 1, 0, cmdline_rcache_max);
+
+static void collect_rcache_lookups(struct metric_sink *sink)
+{
+	metric_value(sink, rcache_hits, "result=\"hit\"");
+	metric_value(sink, rcache_misses, "result=\"miss\"");
+}
+
+static void collect_rcache_evictions(struct metric_sink *sink)
+{
+	metric_value(sink, rcache_expired, "reason=\"expired\"");
+	metric_value(sink, rcache_evicted, "reason=\"full\"");
+}
+
+static struct metric rcache_metrics[] = {
+	{ .name = "nfsim_rcache_entries", .type = "gauge",
+	  .help = "Entries in the routing cache.",
+	  .value = &rcache_entries },
+	{ .name = "nfsim_rcache_lookups_total", .type = "counter",
+	  .help = "Routing cache lookups, by whether an entry was found.",
+	  .collect = collect_rcache_lookups },
+	{ .name = "nfsim_rcache_evictions_total", .type = "counter",
+	  .help = "Routing cache entries dropped, by reason.",
+	  .collect = collect_rcache_evictions },
+};
+
 /* need the following:
     - interfaces
     - routes
  */
 static void init(void)
 {
+	unsigned int i;
+
 	/* name our hooks */
 	nf_hooknames[PF_INET][0] = "NF_IP_PRE_ROUTING";
 	nf_hooknames[PF_INET][1] = "NF_IP_LOCAL_IN";
 	nf_hooknames[PF_INET][2] = "NF_IP_FORWARD";
 	nf_hooknames[PF_INET][3] = "NF_IP_LOCAL_OUT";
 	nf_hooknames[PF_INET][4] = "NF_IP_POST_ROUTING";
+
+	for (i = 0; i < ARRAY_SIZE(rcache_metrics); i++)
+		metric_register(&rcache_metrics[i]);
 }
 
 init_call(init);
@@ -96,10 +241,62 @@ int unregister_inetaddr_notifier(struct notifier_block *nb)
 	return notifier_chain_unregister(&inetaddr_chain, nb);
 }
 
+/* Local addresses, hashed, so we don't walk every interface per packet.
+ * First one added wins, as it did when we walked the interface list. */
+#define LOCAL_ADDR_HASH_SIZE	1024
+static struct in_ifaddr *local_addr_hash[LOCAL_ADDR_HASH_SIZE];
+
+static unsigned int local_addr_hashfn(u32 addr)
+{
+	return jhash_1word(addr, 0) & (LOCAL_ADDR_HASH_SIZE - 1);
+}
+
+static struct in_ifaddr *find_local_addr(u32 addr)
+{
+	struct in_ifaddr *ifa;
+
+	for (ifa = local_addr_hash[local_addr_hashfn(addr)]; ifa;
+	     ifa = ifa->local_next)
+		if (ifa->ifa_local == addr)
+			return ifa;
+	return NULL;
+}
+
+static int del_local_addr(void *i)
+{
+	struct in_ifaddr *ifa = i, **p;
+
+	for (p = &local_addr_hash[local_addr_hashfn(ifa->ifa_local)]; *p;
+	     p = &(*p)->local_next) {
+		if (*p == ifa) {
+			*p = ifa->local_next;
+			break;
+		}
+	}
+	return 0;
+}
+
+static void add_local_addr(struct in_ifaddr *ifa)
+{
+	struct in_ifaddr **p;
+
+	del_local_addr(ifa);
+	for (p = &local_addr_hash[local_addr_hashfn(ifa->ifa_local)]; *p;
+	     p = &(*p)->local_next);
+	*p = ifa;
+	ifa->local_next = NULL;
+	talloc_set_destructor(ifa, del_local_addr);
+}
+
 int __call_inetaddr_notifier(unsigned long val, struct in_ifaddr *ifa)
 {
 	struct notifier_block *nb = inetaddr_chain;
 
+	if (val == NETDEV_UP)
+		add_local_addr(ifa);
+	else if (val == NETDEV_DOWN)
+		del_local_addr(ifa);
+
 	return notifier_call_chain(&nb, val, ifa);
 }
 
@@ -124,6 +321,7 @@ int ip_rcv(struct sk_buff *skb)
 	skb_pull(skb, skb->nh.raw - skb->data);
 
 	log_packet(skb, "rcv:%s", skb->dev->name);
+	trace_packet(TRACE_RCV, skb->seq, skb, skb->dev, NULL, NULL, 0, 0, 0);
 
 	return NF_HOOK(PF_INET, NF_IP_PRE_ROUTING, skb, skb->dev, NULL,
 	               ip_rcv_finish);
@@ -161,7 +359,6 @@ int ip_rcv_local(struct sk_buff *skb)
 	}
 
 	skb->dst = (struct dst_entry *)rt;
-	dst_hold(skb_dst);
 routed:
 	skb->dev = skb->dst->dev;
 	return NF_HOOK(PF_INET, NF_IP_LOCAL_OUT, skb, NULL, skb->dev, dst_output);
@@ -202,15 +399,16 @@ unsigned short ip_compute_csum(unsigned char * buff, int len)
 
 static int __ip_route_output_key(struct rtable **rp, struct flowi *flp)
 {
-	struct rtable *rth;
+	struct rtable *rth, **p;
 	struct net_device *dev;
+	struct in_ifaddr *ifaddr;
 	struct ipv4_route *route;
 
 	if (should_i_fail(__func__))
 		return -ENOMEM;
 
 	/* check for a cached route */
-	for (rth = rcache; rth; rth = rth->u.rt_next) {
+	for (p = &rcache; (rth = *p); p = &rth->u.rt_next) {
 		if (rth->fl.fl4_dst == flp->fl4_dst &&
 		    rth->fl.fl4_src == flp->fl4_src &&
 		    rth->fl.iif     == 0 &&
@@ -219,51 +417,38 @@ static int __ip_route_output_key(struct rtable **rp, struct flowi *flp)
 		    rth->fl.fl4_fwmark == flp->fl4_fwmark &&
 #endif
 		    rth->fl.fl4_tos == flp->fl4_tos) {
-			dst_hold(&rth->u.dst)
-			*rp = rth;
+			*rp = rcache_hit(p);
 			return 0;
 		}
 	}
+	rcache_misses++;
 
-	list_for_each_entry(dev, &interfaces, entry) {
-		struct in_ifaddr *ifaddr;
-
-		if (!dev->ip_ptr)
-			continue;
+	ifaddr = find_local_addr(flp->fl4_dst);
+	if (ifaddr) {
+		dev = ifaddr->ifa_dev->dev;
+		rth = talloc_zero(dev->ip_ptr, struct rtable);
+		talloc_set_destructor(rth, destroy_rtable);
 
-		ifaddr = ((struct in_device *)(dev->ip_ptr))->ifa_list;
-		while (ifaddr) {
-			if (flp->fl4_dst == ifaddr->ifa_local) {
-				rth = talloc_zero(dev->ip_ptr, struct rtable);
-				talloc_set_destructor(rth, destroy_rtable);
-
-				rth->u.dst.output = ip_output;
-				rth->u.dst.input  = ip_local_deliver;
-				rth->u.dst.dev    = &loopback_dev;
+		rth->u.dst.output = ip_output;
+		rth->u.dst.input  = ip_local_deliver;
+		rth->u.dst.dev    = &loopback_dev;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,5,0)
-				rth->u.dst.pmtu	  = 1500;
+		rth->u.dst.pmtu	  = 1500;
 #endif
-				rth->rt_src       = rth->fl.fl4_src
-				                  = flp->fl4_src;
-				rth->rt_dst       = rth->fl.fl4_dst
-				                  = flp->fl4_dst;
-				rth->rt_gateway   = flp->fl4_dst;
-				rth->rt_iif       = rth->fl.iif = flp->iif;
-
-				rth->fl.fl4_tos	= flp->fl4_tos;
+		rth->rt_src       = rth->fl.fl4_src = flp->fl4_src;
+		rth->rt_dst       = rth->fl.fl4_dst = flp->fl4_dst;
+		rth->rt_gateway   = flp->fl4_dst;
+		rth->rt_iif       = rth->fl.iif = flp->iif;
+
+		rth->fl.fl4_tos	= flp->fl4_tos;
 #ifdef CONFIG_IP_ROUTE_FWMARK
-				rth->fl.fl4_fwmark = flp->fl4_fwmark;
+		rth->fl.fl4_fwmark = flp->fl4_fwmark;
 #endif
 
-				rth->u.rt_next = rcache;
-				rcache = rth;
-
-				*rp = rth;
-				return 0;
-			}
-			ifaddr = ifaddr->ifa_next;
-		}
+		rcache_add(rth);
 
+		*rp = rth;
+		return 0;
 	}
 
 	/* otherwise, find the appropriate route & create an rcache entry */
@@ -293,9 +478,7 @@ static int __ip_route_output_key(struct rtable **rp, struct flowi *flp)
 #ifdef CONFIG_IP_ROUTE_FWMARK
 			rth->fl.fl4_fwmark = flp->fl4_fwmark;
 #endif
-			/* add to rcache list */
-			rth->u.rt_next = rcache;
-			rcache = rth;
+			rcache_add(rth);
 
 			*rp = rth;
 
@@ -335,8 +518,14 @@ int xfrm_lookup(struct dst_entry **dst_p, struct flowi *fl,
 		struct sock *sk, int flags)
 {
 	struct rtable **rp = (void *)dst_p;
-
-	return __ip_route_output_key(rp, fl);
+	struct dst_entry *old = *dst_p;
+	int ret;
+
+	/* Like the real one, we replace the route we were given. */
+	ret = __ip_route_output_key(rp, fl);
+	if (ret == 0)
+		dst_release(old);
+	return ret;
 }
 
 static int ip_forward(struct sk_buff *skb)
@@ -367,11 +556,12 @@ static int ip_forward(struct sk_buff *skb)
 int ip_route_input(struct sk_buff *skb, u32 daddr, u32 saddr,
 		   u8 tos, struct net_device *dev)
 {
-	struct rtable *rth;
+	struct rtable *rth, **p;
 	struct ipv4_route *route;
+	struct in_ifaddr *ifaddr;
 	int iif = dev->ifindex;
 
-	for (rth = rcache; rth; rth = rth->u.rt_next) {
+	for (p = &rcache; (rth = *p); p = &rth->u.rt_next) {
 		if (rth->fl.fl4_dst == daddr &&
 		    rth->fl.fl4_src == saddr &&
 		    rth->fl.iif == iif &&
@@ -380,50 +570,39 @@ int ip_route_input(struct sk_buff *skb, u32 daddr, u32 saddr,
 		    rth->fl.fl4_fwmark == skb->nfmark &&
 #endif
 		    rth->fl.fl4_tos == tos) {
-			dst_hold(&rth->u.dst);
-			skb->dst = (struct dst_entry*)rth;
+			skb->dst = (struct dst_entry *)rcache_hit(p);
 			return 0;
 		}
 	}
+	rcache_misses++;
 
 	/* is this a local packet ? */
-	list_for_each_entry(dev, &interfaces, entry) {
-		struct in_ifaddr *ifaddr;
-
-		if (!dev->ip_ptr)
-			continue;
-
-		ifaddr = ((struct in_device *)(dev->ip_ptr))->ifa_list;
-		while (ifaddr) {
-			if (skb->nh.iph->daddr == ifaddr->ifa_local) {
-				log_route(skb,
-					"route:local packet (%s)",
-					dev->name);
-				rth = talloc_zero(dev->ip_ptr, struct rtable);
-				talloc_set_destructor(rth, destroy_rtable);
-
-				rth->u.dst.output = NULL;
-				rth->u.dst.input  = ip_local_deliver;
-				rth->u.dst.dev    = &loopback_dev;
-				rth->rt_src       = rth->fl.fl4_src = saddr;
-				rth->rt_dst       = rth->fl.fl4_dst = daddr;
-				rth->rt_gateway   = daddr;
-				rth->rt_iif       = rth->fl.iif = dev->ifindex;
-
-				rth->fl.fl4_tos	= tos;
+	ifaddr = find_local_addr(skb->nh.iph->daddr);
+	if (ifaddr) {
+		dev = ifaddr->ifa_dev->dev;
+		log_route(skb, "route:local packet (%s)", dev->name);
+		rth = talloc_zero(dev->ip_ptr, struct rtable);
+		talloc_set_destructor(rth, destroy_rtable);
+
+		rth->u.dst.output = NULL;
+		rth->u.dst.input  = ip_local_deliver;
+		rth->u.dst.dev    = &loopback_dev;
+		rth->rt_src       = rth->fl.fl4_src = saddr;
+		rth->rt_dst       = rth->fl.fl4_dst = daddr;
+		rth->rt_gateway   = daddr;
+		rth->rt_iif       = rth->fl.iif = iif;
+
+		rth->fl.fl4_tos	= tos;
 #ifdef CONFIG_IP_ROUTE_FWMARK
-				rth->fl.fl4_fwmark = skb->nfmark;
+		rth->fl.fl4_fwmark = skb->nfmark;
 #endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,5,0)
-				rth->u.dst.pmtu	  = 1500;
+		rth->u.dst.pmtu	  = 1500;
 #endif
-				skb->dst = &rth->u.dst;
-
-				return 0;
-			}
-			ifaddr = ifaddr->ifa_next;
-		}
+		rcache_add(rth);
+		skb->dst = &rth->u.dst;
 
+		return 0;
 	}
 
 	/* otherwise, find the appropriate route & create an rcache entry */
@@ -440,8 +619,7 @@ int ip_route_input(struct sk_buff *skb, u32 daddr, u32 saddr,
 			rth->rt_src       = rth->fl.fl4_src = saddr;
 			rth->rt_dst       = rth->fl.fl4_dst = daddr;
 			rth->rt_gateway   = route->gateway;
-			rth->rt_iif       = rth->fl.iif =
-						route->interface->ifindex;
+			rth->rt_iif       = rth->fl.iif = iif;
 			rth->fl.oif = 0;
 			rth->fl.fl4_tos	= tos;
 #ifdef CONFIG_IP_ROUTE_FWMARK
@@ -450,10 +628,7 @@ int ip_route_input(struct sk_buff *skb, u32 daddr, u32 saddr,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,5,0)
 			rth->u.dst.pmtu	  = 1500;
 #endif
-			/* add to rcache list */
-			rth->u.rt_next = rcache;
-			rcache = rth;
-
+			rcache_add(rth);
 			skb->dst = &rth->u.dst;
 
 			return 0;
@@ -871,25 +1046,13 @@ unsigned int csum_sub(unsigned int csum, unsigned int addend)
 
 unsigned inet_addr_type(u32 addr)
 {
-	struct net_device *dev;
-
 	if (ZERONET(addr) || BADCLASS(addr))
 		return RTN_BROADCAST;
 	if (MULTICAST(addr))
 		return RTN_MULTICAST;
 
-
-	list_for_each_entry(dev, &interfaces, entry) {
-		struct in_ifaddr *ifaddr;
-
-		if (!dev->ip_ptr)
-			continue;
-
-		for (ifaddr = ((struct in_device *)(dev->ip_ptr))->ifa_list;
-				ifaddr; ifaddr = ifaddr->ifa_next)
-			if (ifaddr->ifa_local == addr)
-				return RTN_LOCAL;
-	}
+	if (find_local_addr(addr))
+		return RTN_LOCAL;
 
 	return RTN_UNICAST;
 
@@ -639,6 +639,7 @@ struct rtable *rcache;
 /* address data attached to a device */
 struct in_ifaddr {
 	struct in_ifaddr	*ifa_next;
+	struct in_ifaddr	*local_next;
 
 	struct in_device	*ifa_dev;
 
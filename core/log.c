@@ -26,6 +26,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "utils.h"
 
 #include <list.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 static struct {
 	enum log_type	type;
@@ -44,22 +47,124 @@ static struct {
 static FILE *logstream;
 static int typemask = 0;
 static int describe_packets;
+unsigned int suppress_logging;
 
 #define PRINTK_BUFSIZ 4096
 /* Rusty says: only hippies need two pointers. */
 static char printk_buf[PRINTK_BUFSIZ];
 
+/* With --log-file, lines collect here and are written out a buffer at
+ * a time, rather than a write() per line. */
+#define LOG_FILE_BUFSIZ (1024 * 1024)
+static const char *log_filename;
+static int log_fd = -1;
+static char *log_buf;
+static unsigned int log_len;
+
 int log_describe_packets(void)
 {
 	return describe_packets;
 }
 
+static void log_write(const char *buf, unsigned int len)
+{
+	unsigned int done = 0;
+	int ret;
+
+	while (done < len) {
+		ret = write(log_fd, buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			fprintf(stderr, "Writing %s: %s\n", log_filename,
+				ret < 0 ? strerror(errno) : "short write");
+			break;
+		}
+		done += ret;
+	}
+}
+
+void nfsim_log_flush(void)
+{
+	log_write(log_buf, log_len);
+	log_len = 0;
+}
+
+/* Stop writing to --log-file: log to stdout as if it wasn't given. */
+void nfsim_log_file_close(void)
+{
+	if (!log_buf)
+		return;
+	nfsim_log_flush();
+	close(log_fd);
+	log_fd = -1;
+	talloc_free(log_buf);
+	log_buf = NULL;
+}
+
+/* Format straight into the file buffer: returns NULL if it won't fit. */
+static char *log_buffer_line(const char *format, va_list ap)
+{
+	va_list aq;
+	int len;
+
+	va_copy(aq, ap);
+	len = vsnprintf(log_buf + log_len, LOG_FILE_BUFSIZ - log_len,
+			format, aq);
+	va_end(aq);
+	if (len >= 0 && log_len + len < LOG_FILE_BUFSIZ)
+		return log_buf + log_len;
+
+	nfsim_log_flush();
+	if (len < 0 || len >= LOG_FILE_BUFSIZ)
+		return NULL;
+	vsnprintf(log_buf, LOG_FILE_BUFSIZ, format, ap);
+	return log_buf;
+}
+
+static bool nfsim_log_buffered(enum log_type type, const char *format,
+			       va_list ap)
+{
+	char *line;
+	bool ret;
+
+	line = log_buffer_line(format, ap);
+	if (!line) {
+		line = talloc_vasprintf(NULL, format, ap);
+		ret = expect_log_hook(line);
+		if (!type || (type & typemask)) {
+			line = talloc_asprintf_append(line, "\n");
+			log_write(line, strlen(line));
+		}
+		talloc_free(line);
+		return ret;
+	}
+
+	/* Match before the line is ended: it's still nul-terminated. */
+	ret = expect_log_hook(line);
+	if (!type || (type & typemask)) {
+		log_len += strlen(line);
+		log_buf[log_len++] = '\n';
+	}
+	return ret;
+}
+
 bool nfsim_log(enum log_type type, const char *format, ...)
 {
 	va_list ap;
 	char *line;
 	bool ret;
 
+	if (suppress_logging)
+		return false;
+
+	if (log_buf) {
+		va_start(ap, format);
+		ret = nfsim_log_buffered(type, format, ap);
+		va_end(ap);
+		return ret;
+	}
+
 	va_start(ap, format);
 	line = talloc_vasprintf(NULL, format, ap);
 	va_end(ap);
@@ -268,9 +373,41 @@ static void log_admin_help(int agc, char **argv)
 */
 }
 
+/*** XML Argument:
+    <section id="a:log-file">
+     <title><option>--log-file
+      <replaceable>file</replaceable></option></title>
+     <subtitle>Write log messages to a file</subtitle>
+     <para>Sends log messages to <replaceable>file</replaceable>
+     instead of standard output.  They are kept in a large buffer and
+     written out when it fills, before the simulator forks, after each
+     line typed interactively, and when the simulator exits, so this is
+     much faster than standard output with the <literal>packet</literal>
+     and <literal>hook</literal> types turned on.  <command>expect</command>
+     sees each message as it is logged, just as before.</para>
+    </section>
+*/
+static void cmdline_log_file(struct option *opt)
+{
+	extern char *optarg;
+	if (!optarg)
+		barf("log-file option requires an argument");
+	log_filename = optarg;
+}
+cmdline_opt("log-file", 1, 0, cmdline_log_file);
+
 static void log_init(void)
 {
 	logstream = stdout;
+	if (log_filename) {
+		log_fd = open(log_filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (log_fd < 0)
+			barf_perror("Opening %s", log_filename);
+		/* Not under nfsim_tallocs: it's not the kernel's memory. */
+		log_buf = talloc_named_const(NULL, LOG_FILE_BUFSIZ,
+					     "log buffer");
+		atexit(nfsim_log_flush);
+	}
 	if (!tui_quiet)
 		typemask = -1;
 	describe_packets = 1;
@@ -42,6 +42,15 @@ void nfsim_log_partial(enum log_type type, char *buf, unsigned bufsize,
 
 int log_describe_packets(void);
 
+/* Write out anything buffered for --log-file (eg. before forking). */
+void nfsim_log_flush(void);
+
+/* Forget the --log-file (eg. in a forked copy which shouldn't write it). */
+void nfsim_log_file_close(void);
+
+/* While non-zero, nfsim_log() does nothing (eg. while benchmarking). */
+extern unsigned int suppress_logging;
+
 #if 0
 #define printk(...) log(LOG_KERNEL, ##__VA_ARGS__)
 #endif
@@ -20,6 +20,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
 #include "message.h"
+#include "extension.h"
 #include "utils.h"
 
 #include <signal.h>
@@ -29,13 +30,47 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 
 static int msg_fd; /* socket for messages. */
 static int io_fd; /* pipe to read child's stdout/stderr */
 static int pid = -1; /* pid of child if we forked it ourselves */
+static bool program_running; /* is a program attached to msg_fd? */
+
+/* Programs started once, which fork a child for each command instead of us
+ * exec'ing the binary every time. */
+struct fork_server {
+	struct fork_server *next;
+	char *name;
+	int fd;
+	int pid;
+};
+static struct fork_server *fork_servers;
+static bool use_fork_server;
+
+/* Region shared with the program for user copies: saves pushing the data
+ * through the socket.  The program maps it when we send the fd. */
+#define SHM_MIN_SIZE (1024*1024)
+#define SHM_MAX_SIZE (256*1024*1024)
+static int shm_fd = -1;
+static void *shm;
+static unsigned long shm_size;
+static bool shm_broken; /* memfd unsupported: don't keep trying. */
+static bool shm_sent; /* has this program got the current region? */
+static int shm_setup_ret;
+
+/* Sockopts from inside the simulator itself pass pointers to our memory. */
+static bool local_copies;
+
+void set_local_user_copies(bool local)
+{
+	local_copies = local;
+}
 
 static void send_userspace_message(struct nf_userspace_message *msg);
+static bool handle_userspace_message(int *status);
 
 static void send_fd(int dest_fd, int fd)
 {
@@ -74,51 +109,260 @@ void message_init(void)
 	sigprocmask(SIG_BLOCK, &ss, NULL);
 }
 
+static void stop_fork_server(struct fork_server *server, bool wait)
+{
+	/* It exits when it sees end of file. */
+	close(server->fd);
+	if (wait)
+		waitpid(server->pid, NULL, 0);
+	talloc_free(server);
+}
+
+static void stop_fork_servers(bool wait)
+{
+	while (fork_servers) {
+		struct fork_server *server = fork_servers;
+
+		fork_servers = server->next;
+		stop_fork_server(server, wait);
+	}
+}
+
 void message_cleanup(void)
 {
 	sigset_t ss;
 
+	stop_fork_servers(true);
+	extension_cleanup();
+
 	sigemptyset(&ss);
 	sigaddset(&ss, SIGPIPE);
 	sigprocmask(SIG_UNBLOCK, &ss, NULL);
 }
 
-void start_program(const char *name, int argc, char *argv[])
+static int create_shm_fd(void)
+{
+#ifdef __NR_memfd_create
+	return syscall(__NR_memfd_create, "nfsim", 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void release_shm(void)
+{
+	if (shm)
+		munmap(shm, shm_size);
+	if (shm_fd != -1)
+		close(shm_fd);
+	shm = NULL;
+	shm_fd = -1;
+	shm_size = 0;
+	shm_sent = false;
+}
+
+/* We're a fresh copy of the simulator (a shard): the fork servers and
+ * shared region are our parent's, so start our own when needed. */
+void message_forked(void)
+{
+	while (fork_servers) {
+		struct fork_server *server = fork_servers;
+
+		fork_servers = server->next;
+		close(server->fd);
+		talloc_free(server);
+	}
+	release_shm();
+	extension_forked();
+}
+
+/* Make sure the program has a shared region of at least n bytes. */
+static bool shm_reserve(unsigned long n)
+{
+	struct nf_userspace_message msg;
+
+	if (shm_broken || n > SHM_MAX_SIZE)
+		return false;
+
+	if (n > shm_size) {
+		unsigned long size = SHM_MIN_SIZE;
+
+		while (size < n)
+			size *= 2;
+		release_shm();
+		shm_fd = create_shm_fd();
+		if (shm_fd < 0 || ftruncate(shm_fd, size) != 0) {
+			release_shm();
+			shm_broken = true;
+			return false;
+		}
+		shm = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			   shm_fd, 0);
+		if (shm == MAP_FAILED) {
+			shm = NULL;
+			release_shm();
+			shm_broken = true;
+			return false;
+		}
+		shm_size = size;
+	}
+
+	if (!shm_sent) {
+		memset(&msg, 0, sizeof(msg));
+		msg.type = UM_KERNELOP;
+		msg.opcode = KOP_SHM_SETUP;
+		msg.args[0] = shm_size;
+		if (write(msg_fd, &msg, sizeof(msg)) != sizeof(msg))
+			return false;
+		send_fd(msg_fd, shm_fd);
+		/* They tell us if they managed to map it. */
+		if (!handle_userspace_message(NULL) || shm_setup_ret != 0) {
+			shm_broken = true;
+			return false;
+		}
+		shm_sent = true;
+	}
+	return true;
+}
+
+static void exec_program(const char *name, char *argv[], int fd)
 {
-	int iofds[2];
-	int msgfds[2];
 	char *fdstr;
 
-	if (pipe(iofds) != 0)
-		barf_perror("%s pipe", name);
+	if (setenv("LD_PRELOAD", "fakesockopt.so.1.0", 1))
+		barf("putenv failed");
+	fdstr = talloc_asprintf(NULL, "%d", fd);
+	setenv("NFSIM_FAKESOCK_FD", fdstr, 1);
+	talloc_free(fdstr);
+	execvp(name, argv);
+	fprintf(stderr, "Could not exec %s!\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static struct fork_server *get_fork_server(const char *name)
+{
+	struct fork_server *server;
+	char *argv[2] = { (char *)name, NULL };
+	int msgfds[2];
+
+	for (server = fork_servers; server; server = server->next)
+		if (streq(server->name, name))
+			return server;
 
 	if (socketpair(PF_UNIX, SOCK_STREAM, PF_UNSPEC, msgfds))
 		barf_perror("socket");
 
 	fflush(stdout);
-	pid = fork();
-	switch (pid) {
+	nfsim_log_flush();
+	server = talloc(NULL, struct fork_server);
+	server->pid = fork();
+	switch (server->pid) {
 	case -1:
-		barf_perror("iptables fork");
+		barf_perror("fork server fork");
 	case 0:
-		dup2(iofds[1], STDOUT_FILENO);
-		dup2(iofds[1], STDERR_FILENO);
-		close(iofds[0]);
 		close(msgfds[0]);
-		if (setenv("LD_PRELOAD", "fakesockopt.so.1.0", 1))
-			barf("putenv failed");
-		fdstr = talloc_asprintf(NULL, "%d", msgfds[1]);
-		setenv("NFSIM_FAKESOCK_FD", fdstr, 1);
-		talloc_free(fdstr);
-		execvp(name, argv);
-		fprintf(stderr, "Could not exec %s!\n", name);
-		exit(EXIT_FAILURE);
+		setenv("NFSIM_FORKSERVER", "1", 1);
+		exec_program(name, argv, msgfds[1]);
+	}
+
+	close(msgfds[1]);
+	fcntl(msgfds[0], F_SETFD, FD_CLOEXEC);
+	server->fd = msgfds[0];
+	server->name = talloc_strdup(server, name);
+	server->next = fork_servers;
+	fork_servers = server;
+	return server;
+}
+
+/* Ask the fork server to run the command, with output to io_fd and
+ * messages on msg_fd.  False if it has gone away. */
+static bool spawn_program(struct fork_server *server, int argc, char *argv[],
+			  int io_fd, int msg_fd)
+{
+	struct nf_userspace_message *msg;
+	unsigned int len = 0, off = 0;
+	bool ok;
+	int i;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+
+	msg = talloc_zero_size(NULL, sizeof(*msg) + len);
+	msg->type = UM_KERNELOP;
+	msg->opcode = KOP_SPAWN;
+	msg->len = len;
+	msg->args[0] = argc;
+	for (i = 0; i < argc; i++) {
+		strcpy((char *)(msg + 1) + off, argv[i]);
+		off += strlen(argv[i]) + 1;
+	}
+
+	ok = (write(server->fd, msg, sizeof(*msg) + len)
+	      == sizeof(*msg) + len);
+	talloc_free(msg);
+	if (!ok)
+		return false;
+
+	send_fd(server->fd, io_fd);
+	send_fd(server->fd, msg_fd);
+	return true;
+}
+
+void start_program(const char *name, int argc, char *argv[])
+{
+	int iofds[2];
+	int msgfds[2];
+
+	if (pipe(iofds) != 0)
+		barf_perror("%s pipe", name);
+
+	if (socketpair(PF_UNIX, SOCK_STREAM, PF_UNSPEC, msgfds))
+		barf_perror("socket");
+
+	if (use_fork_server) {
+		struct fork_server *server;
+
+		/* Fork servers we start must not hold this command's fds. */
+		fcntl(iofds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(iofds[1], F_SETFD, FD_CLOEXEC);
+		fcntl(msgfds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(msgfds[1], F_SETFD, FD_CLOEXEC);
+
+		server = get_fork_server(name);
+
+		/* If it died, start another: still dead means exec failed. */
+		if (!spawn_program(server, argc, argv, iofds[1], msgfds[1])) {
+			fork_servers = server->next;
+			stop_fork_server(server, true);
+			server = get_fork_server(name);
+			if (!spawn_program(server, argc, argv,
+					   iofds[1], msgfds[1]))
+				barf("fork server for %s failed", name);
+		}
+		pid = -1;
+	} else {
+		fflush(stdout);
+		nfsim_log_flush();
+		pid = fork();
+		switch (pid) {
+		case -1:
+			barf_perror("iptables fork");
+		case 0:
+			dup2(iofds[1], STDOUT_FILENO);
+			dup2(iofds[1], STDERR_FILENO);
+			close(iofds[0]);
+			close(msgfds[0]);
+			exec_program(name, argv, msgfds[1]);
+		}
 	}
 
 	close(iofds[1]);
 	close(msgfds[1]);
 	io_fd = iofds[0];
 	msg_fd = msgfds[0];
+	shm_sent = false;
+	program_running = true;
 }
 
 static const char *protofamily(int pf)
@@ -264,8 +508,15 @@ static bool handle_userspace_message(int *status)
 				barf_perror("read");
 			break;
 		case KOP_COPY_TO_USER:
+		case KOP_COPY_TO_USER_SHM:
 			/* copying has been done */
 			break;
+		case KOP_COPY_FROM_USER_SHM:
+			memcpy((char *)msg.args[0], shm, msg.args[2]);
+			break;
+		case KOP_SHM_SETUP:
+			shm_setup_ret = msg.retval;
+			break;
 
 		default:
 			barf("Invalid kernelop opcode %d\n", msg.opcode);
@@ -296,6 +547,29 @@ int copy_to_user(void *to, const void *from, unsigned long n)
 		return n;
 	}
 
+	if (strace)
+		nfsim_log(LOG_USERSPACE, "        copy_to_user(%p,%i)",
+			  to, n);
+
+	if (local_copies) {
+		memcpy(to, from, n);
+		return 0;
+	}
+
+	if (shm_reserve(n)) {
+		struct nf_userspace_message doorbell;
+
+		memset(&doorbell, 0, sizeof(doorbell));
+		doorbell.type = UM_KERNELOP;
+		doorbell.opcode = KOP_COPY_TO_USER_SHM;
+		doorbell.args[0] = (unsigned long)to;
+		doorbell.args[1] = (unsigned long)from;
+		doorbell.args[2] = (unsigned long)n;
+		memcpy(shm, from, n);
+		send_userspace_message(&doorbell);
+		return 0;
+	}
+
 	msg = _talloc_zero(NULL,
 		sizeof(struct nf_userspace_message) + n, "copy_to_user");
 
@@ -310,9 +584,6 @@ int copy_to_user(void *to, const void *from, unsigned long n)
 	msg->args[3] = 0;
 	msg->retval = 0;
 
-	if (strace)
-		nfsim_log(LOG_USERSPACE, "        copy_to_user(%p,%i)",
-			  to, n);
 	memcpy((char *)msg + sizeof(struct nf_userspace_message), from, n);
 
 	send_userspace_message(msg);
@@ -333,10 +604,20 @@ int copy_from_user(void *to, const void *from, unsigned long n)
 		return n;
 	}
 
+	if (local_copies) {
+		if (strace)
+			nfsim_log(LOG_USERSPACE,
+				  "        copy_from_user(%p,%i)",
+				  to, n);
+		memcpy(to, from, n);
+		return 0;
+	}
+
 	memset(&msg, 0, sizeof(struct nf_userspace_message));
 
 	msg.type = UM_KERNELOP;
-	msg.opcode = KOP_COPY_FROM_USER;
+	msg.opcode = shm_reserve(n) ? KOP_COPY_FROM_USER_SHM
+		: KOP_COPY_FROM_USER;
 	msg.len = 0;
 	msg.args[0] = (unsigned long)to;
 	msg.args[1] = (unsigned long)from;
@@ -361,8 +642,14 @@ void fork_other_program(void)
 	struct nf_userspace_message msg;
 	int iofds[2], msgfds[2];
 
+	/* Our parent's fork servers are busy with its programs: we start our
+	 * own if we need them. */
+	stop_fork_servers(false);
+	/* Nor can we share its extensions' pipes. */
+	extension_forked();
+
 	/* Nothing to do if no program attached. */
-	if (pid == -1)
+	if (!program_running)
 		return;
 
 	if (socketpair(PF_UNIX, SOCK_STREAM, PF_UNSPEC, msgfds))
@@ -390,6 +677,9 @@ void fork_other_program(void)
 	/* Use the new socket pair. */
 	msg_fd = msgfds[0];
 	io_fd = iofds[0];
+
+	/* Don't share a region with our parent: new one on demand. */
+	release_shm();
 }
 
 /* Loop accepting messages from fakesockopt.  If child talks, return. */
@@ -438,9 +728,30 @@ char *wait_for_output(int *status)
 	}
 
 	/* If other end didn't tell us status, maybe direct child? */
-	if (*status == -1)
+	if (*status == -1 && pid != -1)
 		if (waitpid(pid, status, 0) == -1)
 			*status = -1;
 	pid = -1;
+	program_running = false;
 	return NULL;
 }
+
+/*** XML Argument:
+    <section id="a:fork-server">
+     <title><option>--fork-server</option></title>
+     <subtitle>Keep programs such as iptables running between commands</subtitle>
+     <para>Instead of starting <command>iptables</command> (and similar
+     programs) afresh for each command, start each binary once and have it
+     fork a copy of itself to run each command.  This saves the cost of
+     exec, dynamic linking and loading <filename>fakesockopt.so</filename>
+     every time, which dominates scripts with many
+     <command>iptables</command> commands.  It has no effect on statically
+     linked programs, which cannot use <filename>fakesockopt.so</filename>
+     anyway.</para>
+    </section>
+*/
+static void cmdline_fork_server(struct option *opt)
+{
+	use_fork_server = true;
+}
+cmdline_opt("fork-server", 0, 0, cmdline_fork_server);
@@ -27,10 +27,15 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 void message_init(void);
 void message_cleanup(void);
+void message_forked(void);
 
 int copy_to_user(void *to, const void *from, unsigned long n);
 int copy_from_user(void *to, const void *from, unsigned long n);
 
+/* Set while the simulator makes sockopt calls itself: user pointers are
+ * then our own memory. */
+void set_local_user_copies(bool local);
+
 /* Returns talloced output of child (if running). */
 char *wait_for_output(int *status);
 
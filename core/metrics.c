@@ -0,0 +1,307 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "core.h"
+#include "tui.h"
+#include "utils.h"
+#include "metrics.h"
+#include <log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Publish the stats file this often while packets are flowing. */
+#define METRICS_PACKET_INTERVAL 1024
+#define METRICS_INITIAL_CAPACITY 64
+
+static LIST_HEAD(metrics);
+
+/* Where metric_value() sends each value. */
+struct metric_sink {
+	const struct metric *metric;
+	void (*value)(struct metric_sink *sink, const char *name,
+		      unsigned long long value);
+	FILE *file;
+	unsigned int count;
+};
+
+static const char *stats_filename;
+static int stats_fd = -1;
+static struct metrics_file_header *stats_map;
+/* How much we mapped: the header's copy is shared, so not to be trusted. */
+static unsigned int stats_capacity;
+static unsigned int packets;
+
+void metric_register(struct metric *m)
+{
+	list_add_tail(&m->list, &metrics);
+}
+
+void metric_value(struct metric_sink *sink, unsigned long long value,
+		  const char *labels, ...)
+{
+	char name[METRICS_NAME_LEN * 2];
+	unsigned int len;
+	va_list ap;
+
+	len = snprintf(name, sizeof(name), "%s", sink->metric->name);
+	if (labels && len < sizeof(name) - 1) {
+		name[len++] = '{';
+		va_start(ap, labels);
+		len += vsnprintf(name + len, sizeof(name) - len, labels, ap);
+		va_end(ap);
+		if (len < sizeof(name) - 1)
+			strcpy(name + len, "}");
+	}
+	sink->value(sink, name, value);
+	sink->count++;
+}
+
+static void collect_all(struct metric_sink *sink, bool describe)
+{
+	struct metric *m;
+
+	list_for_each_entry(m, &metrics, list) {
+		sink->metric = m;
+		if (describe)
+			fprintf(sink->file, "# HELP %s %s\n# TYPE %s %s\n",
+				m->name, m->help, m->name, m->type);
+		if (m->collect)
+			m->collect(sink);
+		else
+			metric_value(sink, *m->value, NULL);
+	}
+}
+
+static void text_value(struct metric_sink *sink, const char *name,
+		       unsigned long long value)
+{
+	fprintf(sink->file, "%s %llu\n", name, value);
+}
+
+void metrics_write_text(FILE *file)
+{
+	struct metric_sink sink = { .value = text_value, .file = file };
+
+	collect_all(&sink, true);
+}
+
+static void log_value(struct metric_sink *sink, const char *name,
+		      unsigned long long value)
+{
+	nfsim_log(LOG_UI, "%s %llu", name, value);
+}
+
+static size_t stats_file_size(unsigned int capacity)
+{
+	return sizeof(struct metrics_file_header)
+		+ capacity * sizeof(struct metrics_file_entry);
+}
+
+/* The contents survive the remap: it's a shared mapping of the file. */
+static void map_stats_file(unsigned int capacity)
+{
+	size_t size = stats_file_size(capacity);
+
+	if (stats_map)
+		munmap(stats_map, stats_file_size(stats_capacity));
+	if (ftruncate(stats_fd, size) != 0)
+		barf_perror("Growing stats file %s", stats_filename);
+	stats_map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			 stats_fd, 0);
+	if (stats_map == MAP_FAILED)
+		barf_perror("Mapping stats file %s", stats_filename);
+	stats_map->capacity = stats_capacity = capacity;
+}
+
+static void file_value(struct metric_sink *sink, const char *name,
+		       unsigned long long value)
+{
+	struct metrics_file_entry *e;
+
+	if (sink->count == stats_capacity)
+		map_stats_file(stats_capacity * 2);
+
+	e = (struct metrics_file_entry *)(stats_map + 1) + sink->count;
+	strncpy(e->name, name, sizeof(e->name) - 1);
+	e->name[sizeof(e->name) - 1] = '\0';
+	e->value = value;
+}
+
+void metrics_publish(void)
+{
+	struct metric_sink sink = { .value = file_value };
+
+	if (!stats_map)
+		return;
+
+	/* Odd generation tells readers we're halfway through. */
+	stats_map->generation++;
+	__sync_synchronize();
+	collect_all(&sink, false);
+	stats_map->count = sink.count;
+	stats_map->jiffies = jiffies;
+	__sync_synchronize();
+	stats_map->generation++;
+}
+
+void metrics_stats_file_close(void)
+{
+	if (!stats_map)
+		return;
+	munmap(stats_map, stats_file_size(stats_capacity));
+	close(stats_fd);
+	stats_map = NULL;
+	stats_fd = -1;
+}
+
+void metrics_packet(void)
+{
+	if (stats_map && ++packets % METRICS_PACKET_INTERVAL == 0)
+		metrics_publish();
+}
+
+static bool publish_after_command(const char *command)
+{
+	metrics_publish();
+	return true;
+}
+
+static void open_stats_file(void)
+{
+	stats_fd = open(stats_filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (stats_fd < 0)
+		barf_perror("Opening stats file %s", stats_filename);
+
+	map_stats_file(METRICS_INITIAL_CAPACITY);
+	memcpy(stats_map->magic, METRICS_FILE_MAGIC, sizeof(stats_map->magic));
+	stats_map->version = METRICS_FILE_VERSION;
+	stats_map->entry_size = sizeof(struct metrics_file_entry);
+	stats_map->pid = getpid();
+	metrics_publish();
+}
+
+/*** XML Argument:
+    <section id="a:stats-file">
+     <title><option>--stats-file
+      <replaceable>file</replaceable></option></title>
+     <subtitle>Publish live statistics in a shared file</subtitle>
+     <para>Keeps the values shown by <command>stats</command> in
+     <replaceable>file</replaceable>, updated after every command and
+     every 1024 packets, so that a viewer can <function>mmap</function>
+     it and watch a long run.  The layout is described in
+     <filename>core/metrics.h</filename>.</para>
+    </section>
+*/
+static void cmdline_stats_file(struct option *opt)
+{
+	extern char *optarg;
+	if (!optarg)
+		barf("stats-file option requires an argument");
+	stats_filename = optarg;
+}
+cmdline_opt("stats-file", 1, 0, cmdline_stats_file);
+
+static bool stats(int argc, char **argv)
+{
+	struct metric_sink sink = { .value = log_value };
+	FILE *file;
+	bool ok;
+
+	if (argc == 1) {
+		collect_all(&sink, false);
+		return true;
+	}
+
+	if (argc != 3 || !streq(argv[1], "dump")) {
+		nfsim_log(LOG_ALWAYS, "Usage: stats [dump <file>]");
+		return false;
+	}
+
+	file = fopen(argv[2], "w");
+	if (!file) {
+		nfsim_log(LOG_ALWAYS, "stats: cannot open %s: %s",
+			  argv[2], strerror(errno));
+		return false;
+	}
+	metrics_write_text(file);
+	ok = !ferror(file);
+	if (fclose(file) != 0)
+		ok = false;
+	if (!ok)
+		nfsim_log(LOG_ALWAYS, "stats: error writing %s: %s",
+			  argv[2], strerror(errno));
+	return ok;
+}
+
+static void stats_help(int argc, char **argv)
+{
+#include "metrics-help:stats"
+/*** XML Help:
+    <section id="c:stats">
+     <title><command>stats</command></title>
+     <para>Show or save the simulator's statistics</para>
+     <cmdsynopsis>
+      <command>stats</command>
+      <group choice="opt">
+       <arg choice="plain">dump</arg>
+       <arg choice="req"><replaceable>file</replaceable></arg>
+      </group>
+     </cmdsynopsis>
+     <para>Without arguments, prints every statistic, one per line:
+     interface packet and byte counts, hook verdicts, skbs and kmallocs
+     outstanding, timers, routing cache entries and failtest
+     progress.</para>
+     <para><command>stats dump</command> writes them to
+     <replaceable>file</replaceable> in the Prometheus text exposition
+     format, with a <literal># HELP</literal> and
+     <literal># TYPE</literal> line for each.</para>
+     <para>See also <option>--stats-file</option>, which keeps them
+     up to date in a file while the simulator runs.</para>
+    </section>
+*/
+}
+
+static void collect_talloc_allocs(struct metric_sink *sink)
+{
+	metric_value(sink, talloc_total_allocs(), NULL);
+}
+
+static struct metric talloc_allocs_metric = {
+	.name = "nfsim_talloc_allocs_total",
+	.type = "counter",
+	.help = "Memory allocations made by the simulator and kernel code.",
+	.collect = collect_talloc_allocs,
+};
+
+static void metrics_init(void)
+{
+	metric_register(&talloc_allocs_metric);
+
+	tui_register_command("stats", stats, stats_help);
+	tui_register_pre_post_hook(NULL, publish_after_command);
+	if (stats_filename)
+		open_stats_file();
+}
+
+init_call(metrics_init);
@@ -0,0 +1,88 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __HAVE_METRICS_H
+#define __HAVE_METRICS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <list.h>
+
+struct metric_sink;
+
+/* A family of values, eg. nfsim_device_rx_packets_total, which may
+ * have one value per label set (dev="eth0"). */
+struct metric {
+	struct list_head list;
+	const char *name;
+	const char *type;	/* "counter" or "gauge" */
+	const char *help;
+	/* Either a single value... */
+	const unsigned long *value;
+	/* ... or a function which calls metric_value() for each one. */
+	void (*collect)(struct metric_sink *sink);
+};
+
+/* Call from an init_call function: m must not go away. */
+void metric_register(struct metric *m);
+
+/* From collect(): labels is a printf format (NULL for no labels). */
+void metric_value(struct metric_sink *sink, unsigned long long value,
+		  const char *labels, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* Prometheus text format snapshot. */
+void metrics_write_text(FILE *file);
+
+/* Update the --stats-file (if any).  Cheap enough to call often. */
+void metrics_publish(void);
+
+/* Stop updating the --stats-file (it's left as it is). */
+void metrics_stats_file_close(void);
+
+/* Called for every packet received: publishes every so often. */
+void metrics_packet(void);
+
+/* The --stats-file layout, for external viewers.  The file is
+ * rewritten in place: generation is odd while an update is in
+ * progress, so copy the header and entries, and retry if generation
+ * was odd or changed underneath you.  If capacity grows, the file has
+ * grown too: remap it. */
+#define METRICS_FILE_MAGIC "NFSIMST1"
+#define METRICS_FILE_VERSION 1
+#define METRICS_NAME_LEN 120
+
+struct metrics_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t generation;
+	uint32_t pid;
+	uint64_t jiffies;
+};
+
+struct metrics_file_entry {
+	char name[METRICS_NAME_LEN];	/* name{labels}, nul-terminated */
+	uint64_t value;
+};
+#endif /* __HAVE_METRICS_H */
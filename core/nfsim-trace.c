@@ -0,0 +1,192 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Print a trace written by the simulator's "trace dump" command. */
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static const char *hooknames[] = {
+	"NF_IP_PRE_ROUTING", "NF_IP_LOCAL_IN", "NF_IP_FORWARD",
+	"NF_IP_LOCAL_OUT", "NF_IP_POST_ROUTING"
+};
+
+static const char *verdicts[] = {
+	"NF_DROP", "NF_ACCEPT", "NF_STOLEN", "NF_QUEUE", "NF_REPEAT",
+	"NF_STOP"
+};
+
+static char **strings;
+static unsigned int num_strings;
+
+static void __attribute__((noreturn)) die(const char *msg)
+{
+	fprintf(stderr, "nfsim-trace: %s\n", msg);
+	exit(1);
+}
+
+static const char *string(unsigned int index, const char *none)
+{
+	if (index == 0)
+		return none;
+	if (index > num_strings)
+		return "?";
+	return strings[index];
+}
+
+static const char *name(const char *names[], unsigned int num,
+			unsigned int i)
+{
+	static char buf[16];
+
+	if (i < num)
+		return names[i];
+	sprintf(buf, "%u", i);
+	return buf;
+}
+
+static void print_ip(const uint8_t *h, unsigned int len)
+{
+	unsigned int ihl, proto;
+
+	if (len < 20 || (h[0] >> 4) != 4)
+		return;
+
+	ihl = (h[0] & 0xf) * 4;
+	proto = h[9];
+	printf(" {IPv4 %u.%u.%u.%u %u.%u.%u.%u %u %u",
+	       h[12], h[13], h[14], h[15], h[16], h[17], h[18], h[19],
+	       h[1], proto);
+	if ((proto == 6 || proto == 17) && len >= ihl + 4)
+		printf(" %u %u", (h[ihl] << 8) | h[ihl+1],
+		       (h[ihl+2] << 8) | h[ihl+3]);
+	printf("}");
+}
+
+static void print_event(const struct trace_event *e, uint64_t first_tsc)
+{
+	const char *dev = string(e->dev, "LOCAL");
+
+	printf("%llu +%llu [%03u] ", (unsigned long long)e->jiffies,
+	       (unsigned long long)(e->tsc - first_tsc), e->seq);
+
+	switch (e->type) {
+	case TRACE_RCV:
+		printf("rcv:%s", dev);
+		break;
+	case TRACE_HOOK:
+		printf("hook:%s %s %s %s",
+		       name(hooknames, 5, e->hook), string(e->owner, "nfsim"),
+		       string(e->func, "?"), name(verdicts, 6, e->verdict));
+		if (e->verdict == 3 && e->arg)
+			printf(" %u", e->arg);
+		printf(" %s", string(e->dev, "-"));
+		break;
+	case TRACE_SEND:
+		printf("send:%s", dev);
+		break;
+	case TRACE_QUEUE:
+		printf("queue:added %u", e->arg);
+		break;
+	case TRACE_REINJECT:
+		printf("queue:%s %u", name(verdicts, 6, e->verdict), e->arg);
+		break;
+	case TRACE_FREE:
+		printf("free");
+		break;
+	default:
+		printf("unknown event %u", e->type);
+		break;
+	}
+	if (e->len)
+		printf(" len %u", e->len);
+	print_ip((const uint8_t *)(e + 1), e->caplen);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace_file_header hdr;
+	struct trace_event *e;
+	uint64_t i, first_tsc = 0;
+	unsigned int n, len;
+	FILE *file = stdin;
+	char *buf;
+
+	if (argc > 2 || (argc == 2 && argv[1][0] == '-' && argv[1][1])) {
+		fprintf(stderr, "Usage: nfsim-trace [file]\n");
+		exit(1);
+	}
+	if (argc == 2 && strcmp(argv[1], "-") != 0) {
+		file = fopen(argv[1], "r");
+		if (!file) {
+			fprintf(stderr, "nfsim-trace: %s: %s\n",
+				argv[1], strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1
+	    || memcmp(hdr.magic, TRACE_FILE_MAGIC, sizeof(hdr.magic)) != 0)
+		die("not an nfsim trace");
+	if (hdr.version != TRACE_FILE_VERSION)
+		die("unknown trace version");
+	if (hdr.event_size < sizeof(*e)
+	    || hdr.event_size > sizeof(*e) + TRACE_MAX_SNAPLEN + 8)
+		die("bad event size");
+
+	strings = calloc(hdr.strings + 1, sizeof(char *));
+	buf = malloc(hdr.event_size);
+	if (!strings || !buf)
+		die("out of memory");
+	for (n = 1; n <= hdr.strings; n++) {
+		char name[256];
+		int c;
+
+		for (len = 0; (c = getc(file)) != '\0'; len++) {
+			if (c == EOF)
+				die("truncated string table");
+			if (len < sizeof(name) - 1)
+				name[len] = c;
+		}
+		name[len < sizeof(name) ? len : sizeof(name) - 1] = '\0';
+		strings[n] = strdup(name);
+	}
+	num_strings = hdr.strings;
+
+	if (hdr.lost)
+		printf("(%llu earlier events overwritten)\n",
+		       (unsigned long long)hdr.lost);
+
+	e = (struct trace_event *)buf;
+	for (i = 0; i < hdr.events; i++) {
+		if (fread(buf, hdr.event_size, 1, file) != 1)
+			die("truncated trace");
+		if (e->caplen > hdr.event_size - sizeof(*e))
+			die("bad capture length");
+		if (i == 0)
+			first_tsc = e->tsc;
+		print_event(e, first_tsc);
+	}
+	return 0;
+}
@@ -30,6 +30,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define KOP_COPY_TO_USER   1
 #define KOP_COPY_FROM_USER 2
 #define KOP_FORK 3
+/* Bulk copies through the shared region (fd sent after KOP_SHM_SETUP). */
+#define KOP_SHM_SETUP 4
+#define KOP_COPY_TO_USER_SHM 5
+#define KOP_COPY_FROM_USER_SHM 6
+
+/* To a fork server: run a command (argv follows, then two fds). */
+#define KOP_SPAWN 7
 
 #define MAX_MESSAGE_ARGS 4
 
@@ -0,0 +1,403 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "core.h"
+#include "tui.h"
+#include "utils.h"
+#include "symbol.h"
+#include <log.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+/* Commands nest (for, repeat...) and so can hooks. */
+#define PROFILE_MAX_DEPTH 64
+
+enum profile_counter {
+	PROFILE_CYCLES,
+	PROFILE_INSTRUCTIONS,
+	PROFILE_CACHE_MISSES,
+	PROFILE_BRANCH_MISSES,
+	PROFILE_COUNTERS
+};
+
+static const char *counter_names[PROFILE_COUNTERS] = {
+	"cycles", "instructions", "cache-misses", "branch-misses"
+};
+
+struct profile_sample {
+	uint64_t wall, cpu;
+	uint64_t counter[PROFILE_COUNTERS];
+};
+
+struct profile_stat {
+	struct list_head list;
+	const char *kind;	/* "cmd" or "hook" */
+	const void *func;	/* hook function, or NULL for commands */
+	char *name;
+	unsigned long calls;
+	struct profile_sample total;
+};
+
+static bool profiling;
+static void *profile_ctx;
+static LIST_HEAD(profile_stats);
+static struct profile_sample stack[PROFILE_MAX_DEPTH];
+static unsigned int depth;
+
+/* Hardware counters, in one group so they're read together. */
+static int counter_fd[PROFILE_COUNTERS] = { -1, -1, -1, -1 };
+static int group_fd = -1;
+static unsigned int num_counters;
+static enum profile_counter group_order[PROFILE_COUNTERS];
+/* Which we managed to open for this profile (still valid after off). */
+static unsigned int counters_used;
+static const char *counter_error;
+
+#ifdef __NR_perf_event_open
+/* The original (version 0) perf_event_attr, so we don't need kernel
+ * headers which agree with the ones we simulate. */
+struct perf_attr {
+	uint32_t type;
+	uint32_t size;
+	uint64_t config;
+	uint64_t sample_period;
+	uint64_t sample_type;
+	uint64_t read_format;
+	uint64_t flags;
+	uint32_t wakeup_events;
+	uint32_t bp_type;
+	uint64_t bp_addr;
+};
+
+#define PERF_TYPE_HW		0
+#define PERF_FORMAT_GRP		(1 << 3)
+#define PERF_FLAG_EXCL_KERNEL	(1 << 5)
+#define PERF_FLAG_EXCL_HV	(1 << 6)
+
+static const uint64_t counter_config[PROFILE_COUNTERS] = {
+	0,	/* PERF_COUNT_HW_CPU_CYCLES */
+	1,	/* PERF_COUNT_HW_INSTRUCTIONS */
+	3,	/* PERF_COUNT_HW_CACHE_MISSES */
+	5,	/* PERF_COUNT_HW_BRANCH_MISSES */
+};
+
+static int open_counter(enum profile_counter c)
+{
+	struct perf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW;
+	attr.size = sizeof(attr);
+	attr.config = counter_config[c];
+	attr.read_format = PERF_FORMAT_GRP;
+	/* Only count us: works even when perf_event_paranoid says no. */
+	attr.flags = PERF_FLAG_EXCL_KERNEL | PERF_FLAG_EXCL_HV;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#else
+static int open_counter(enum profile_counter c)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+static void close_counters(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < PROFILE_COUNTERS; i++) {
+		if (counter_fd[i] >= 0)
+			close(counter_fd[i]);
+		counter_fd[i] = -1;
+	}
+	group_fd = -1;
+	num_counters = 0;
+}
+
+/* Whatever we can get: none at all is fine, we just report times. */
+static void open_counters(void)
+{
+	unsigned int i;
+
+	close_counters();
+	counters_used = 0;
+	counter_error = NULL;
+	for (i = 0; i < PROFILE_COUNTERS; i++) {
+		counter_fd[i] = open_counter(i);
+		if (counter_fd[i] < 0) {
+			if (!counter_error)
+				counter_error = strerror(errno);
+			continue;
+		}
+		if (group_fd < 0)
+			group_fd = counter_fd[i];
+		group_order[num_counters++] = i;
+		counters_used |= (1 << i);
+	}
+}
+
+static void take_sample(struct profile_sample *s)
+{
+	struct timespec ts;
+	uint64_t buf[1 + PROFILE_COUNTERS];
+	unsigned int i;
+
+	s->wall = time_ns();
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	s->cpu = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	memset(s->counter, 0, sizeof(s->counter));
+	if (num_counters == 0)
+		return;
+	/* Group read: number of counters, then their values. */
+	if (read(group_fd, buf, sizeof(buf)) < (int)sizeof(uint64_t))
+		return;
+	for (i = 0; i < buf[0] && i < num_counters; i++)
+		s->counter[group_order[i]] = buf[i + 1];
+}
+
+static struct profile_stat *find_stat(const char *command,
+				      const struct nf_hook_ops *ops)
+{
+	struct profile_stat *stat;
+
+	list_for_each_entry(stat, &profile_stats, list) {
+		if (ops ? stat->func == ops->hook
+		    : !stat->func && streq(stat->name, command))
+			return stat;
+	}
+
+	stat = talloc_zero(profile_ctx, struct profile_stat);
+	if (ops) {
+		stat->kind = "hook";
+		stat->func = ops->hook;
+		stat->name = talloc_asprintf(stat, "%s %s",
+					     symbolize(ops->hook),
+					     ops->owner ? ops->owner->name
+					     : "nfsim");
+	} else {
+		stat->kind = "cmd";
+		stat->name = talloc_strdup(stat, command);
+	}
+	list_add_tail(&stat->list, &profile_stats);
+	return stat;
+}
+
+static void push(void)
+{
+	if (depth < PROFILE_MAX_DEPTH)
+		take_sample(&stack[depth]);
+	depth++;
+}
+
+static void pop(const char *command, const struct nf_hook_ops *ops)
+{
+	struct profile_sample now;
+	struct profile_stat *stat;
+	unsigned int i;
+
+	depth--;
+	if (!profiling || depth >= PROFILE_MAX_DEPTH)
+		return;
+
+	take_sample(&now);
+	stat = find_stat(command, ops);
+	stat->calls++;
+	stat->total.wall += now.wall - stack[depth].wall;
+	stat->total.cpu += now.cpu - stack[depth].cpu;
+	for (i = 0; i < PROFILE_COUNTERS; i++)
+		stat->total.counter[i] += now.counter[i]
+			- stack[depth].counter[i];
+}
+
+static void profile_hook_enter(const struct nf_hook_ops *ops,
+			       unsigned int hooknum)
+{
+	push();
+}
+
+static void profile_hook_exit(const struct nf_hook_ops *ops,
+			      unsigned int hooknum)
+{
+	if (depth)
+		pop(NULL, ops);
+}
+
+static void profile_pre(const char *command)
+{
+	if (profiling)
+		push();
+}
+
+static bool profile_post(const char *command)
+{
+	/* "profile on" wasn't pushed; "profile off" is popped unrecorded. */
+	if (depth)
+		pop(command, NULL);
+	return true;
+}
+
+static void profile_start(void)
+{
+	talloc_free(profile_ctx);
+	profile_ctx = talloc_named_const(NULL, 1, "profile");
+	INIT_LIST_HEAD(&profile_stats);
+	depth = 0;
+	open_counters();
+	hook_enter = profile_hook_enter;
+	hook_exit = profile_hook_exit;
+	profiling = true;
+}
+
+static void profile_stop(void)
+{
+	profiling = false;
+	hook_enter = NULL;
+	hook_exit = NULL;
+	close_counters();
+}
+
+static int stat_cmp(const void *a, const void *b)
+{
+	const struct profile_stat *sa = *(const struct profile_stat **)a;
+	const struct profile_stat *sb = *(const struct profile_stat **)b;
+
+	if (sa->total.wall != sb->total.wall)
+		return sa->total.wall < sb->total.wall ? 1 : -1;
+	return strcmp(sa->name, sb->name);
+}
+
+static void profile_report(void)
+{
+	struct profile_stat *stat, **sorted;
+	unsigned int i, j, num = 0;
+	char line[256], name[64];
+	int len;
+
+	if (!profile_ctx) {
+		nfsim_log(LOG_ALWAYS, "profile: nothing recorded");
+		return;
+	}
+	if (counter_error)
+		nfsim_log(LOG_UI, "profile: some hardware counters"
+			  " unavailable: %s", counter_error);
+
+	list_for_each_entry(stat, &profile_stats, list)
+		num++;
+	sorted = talloc_array(profile_ctx, struct profile_stat *, num);
+	i = 0;
+	list_for_each_entry(stat, &profile_stats, list)
+		sorted[i++] = stat;
+	qsort(sorted, num, sizeof(sorted[0]), stat_cmp);
+
+	len = sprintf(line, "%-40s %8s %10s %10s", "name", "calls",
+		      "wall-us", "cpu-us");
+	for (j = 0; j < PROFILE_COUNTERS; j++)
+		len += sprintf(line + len, " %13s", counter_names[j]);
+	nfsim_log(LOG_UI, "%s", line);
+
+	for (i = 0; i < num; i++) {
+		stat = sorted[i];
+		snprintf(name, sizeof(name), "%s:%s", stat->kind, stat->name);
+		len = sprintf(line, "%-40.40s %8lu %10llu %10llu", name,
+			      stat->calls,
+			      (unsigned long long)stat->total.wall / 1000,
+			      (unsigned long long)stat->total.cpu / 1000);
+		for (j = 0; j < PROFILE_COUNTERS; j++) {
+			if (!(counters_used & (1 << j)))
+				len += sprintf(line + len, " %13s", "-");
+			else
+				len += sprintf(line + len, " %13llu",
+					       (unsigned long long)
+					       stat->total.counter[j]);
+		}
+		nfsim_log(LOG_UI, "%s", line);
+	}
+	talloc_free(sorted);
+}
+
+static bool profile(int argc, char **argv)
+{
+	if (argc == 1) {
+		nfsim_log(LOG_UI, "profile: %s, %u hardware counters",
+			  profiling ? "on" : "off", num_counters);
+		return true;
+	}
+
+	if (argc == 2 && streq(argv[1], "on")) {
+		profile_start();
+		return true;
+	}
+	if (argc == 2 && streq(argv[1], "off")) {
+		profile_stop();
+		return true;
+	}
+	if (argc == 2 && streq(argv[1], "report")) {
+		profile_report();
+		return true;
+	}
+
+	nfsim_log(LOG_ALWAYS, "Usage: profile [on | off | report]");
+	return false;
+}
+
+static void profile_help(int argc, char **argv)
+{
+#include "profile-help:profile"
+/*** XML Help:
+    <section id="c:profile">
+     <title><command>profile</command></title>
+     <para>Find out which commands and hooks are expensive</para>
+     <cmdsynopsis>
+      <command>profile</command>
+      <group choice="opt">
+       <arg choice="plain">on</arg>
+       <arg choice="plain">off</arg>
+       <arg choice="plain">report</arg>
+      </group>
+     </cmdsynopsis>
+     <para><command>profile on</command> throws away any previous
+     profile and starts measuring each command (by command name) and
+     each hook function (by function name and owning module).  For each it adds up the
+     number of calls, the wall clock and CPU time taken, and where the
+     kernel allows it, the CPU cycles, instructions, cache misses and
+     branch misses counted by <function>perf_event_open</function>.
+     Counters which can't be opened are shown as
+     <literal>-</literal>.</para>
+     <para>Times are inclusive: a <command>for</command> loop includes
+     the commands inside it, and a command includes the hooks it
+     causes to run.</para>
+     <para><command>profile off</command> stops measuring, and
+     <command>profile report</command> shows the results, most
+     expensive (by wall clock time) first.</para>
+    </section>
+*/
+}
+
+static void profile_init(void)
+{
+	tui_register_command("profile", profile, profile_help);
+	tui_register_pre_post_hook(profile_pre, profile_post);
+}
+
+init_call(profile_init);
@@ -0,0 +1,652 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Script variables and loops, so load tests don't need a generated script
+ * with a line per packet. */
+
+#include <tui.h>
+#include <log.h>
+#include <script.h>
+#include <kernelenv.h>
+#include "utils.h"
+
+struct variable {
+	struct list_head list;
+	char *name;
+	char *value;
+};
+
+static LIST_HEAD(variables);
+
+struct script_line {
+	struct list_head list;
+	int linenum;
+	char *text;
+};
+
+struct loop {
+	/* Variable to set each time around, or NULL for repeat. */
+	char *var;
+
+	/* Either a list of words, or a numeric range. */
+	char **words;
+	unsigned int num_words;
+	long long from, to;
+	bool ip;
+
+	/* Nested for/repeat lines seen while recording. */
+	unsigned int depth;
+	struct list_head lines;
+};
+
+static struct loop *recording;
+
+/* Deep enough for sane variables-referring-to-variables, shallow enough to
+ * catch set a a. */
+#define SCRIPT_MAX_DEPTH 32
+
+static bool valid_name_char(char c, bool first)
+{
+	return c == '_' || isalpha(c) || (!first && isdigit(c));
+}
+
+static bool valid_name(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; name[i]; i++)
+		if (!valid_name_char(name[i], i == 0))
+			return false;
+	return i != 0;
+}
+
+static struct variable *find_var(const char *name, unsigned int len)
+{
+	struct variable *v;
+
+	list_for_each_entry(v, &variables, list)
+		if (strlen(v->name) == len && strncmp(v->name, name, len) == 0)
+			return v;
+	return NULL;
+}
+
+const char *script_get_var(const char *name)
+{
+	struct variable *v = find_var(name, strlen(name));
+
+	return v ? v->value : NULL;
+}
+
+void script_set_var(const char *name, const char *value)
+{
+	struct variable *v = find_var(name, strlen(name));
+
+	if (!v) {
+		v = talloc(NULL, struct variable);
+		v->name = talloc_strdup(v, name);
+		v->value = NULL;
+		list_add(&v->list, &variables);
+	}
+	talloc_free(v->value);
+	v->value = talloc_strdup(v, value);
+}
+
+/* Integer arithmetic for $[expr] and let.  Values which came from dotted
+ * quads stay addresses through + and -, so $[base + i] is an address. */
+struct value {
+	long long n;
+	bool ip;
+};
+
+struct parser {
+	const char *expr;
+	const char *p;
+	unsigned int depth;
+};
+
+static struct value parse_expr(struct parser *ps);
+
+static void __attribute__((noreturn)) parse_fail(struct parser *ps,
+						 const char *why)
+{
+	script_fail("%s at '%s' in expression '%s'", why, ps->p, ps->expr);
+}
+
+static void skip_space(struct parser *ps)
+{
+	while (isspace(*ps->p))
+		ps->p++;
+}
+
+static struct value number(struct parser *ps)
+{
+	struct value v = { 0, false };
+	unsigned int i;
+	unsigned long part;
+	char *end;
+
+	part = strtoul(ps->p, &end, 0);
+	if (*end != '.') {
+		v.n = part;
+		ps->p = end;
+		return v;
+	}
+
+	/* Dotted quad. */
+	v.ip = true;
+	for (i = 0; i < 4; i++) {
+		if (!isdigit(*ps->p))
+			parse_fail(ps, "bad address");
+		part = strtoul(ps->p, &end, 10);
+		if (part > 255 || (i < 3 && *end != '.'))
+			parse_fail(ps, "bad address");
+		v.n = (v.n << 8) | part;
+		ps->p = end + (i < 3);
+	}
+	return v;
+}
+
+static struct value evaluate(const char *expr, unsigned int depth);
+
+static struct value variable(struct parser *ps, const char *name,
+			     unsigned int len)
+{
+	struct variable *v = find_var(name, len);
+
+	if (!v)
+		script_fail("variable '%.*s' not set", (int)len, name);
+	return evaluate(v->value, ps->depth + 1);
+}
+
+static struct value call(struct parser *ps, const char *name, unsigned int len)
+{
+	struct value v;
+
+	ps->p++;
+	v = parse_expr(ps);
+	skip_space(ps);
+	if (*ps->p != ')')
+		parse_fail(ps, "expected ')'");
+	ps->p++;
+
+	if (len == 2 && strncmp(name, "ip", len) == 0) {
+		v.n &= 0xFFFFFFFF;
+		v.ip = true;
+	} else if (len == 4 && strncmp(name, "port", len) == 0) {
+		/* Wraps from 65535 back around to 1. */
+		v.n = ((v.n - 1) % 65535 + 65535) % 65535 + 1;
+		v.ip = false;
+	} else
+		script_fail("unknown function '%.*s'", (int)len, name);
+	return v;
+}
+
+static struct value primary(struct parser *ps)
+{
+	struct value v;
+	const char *name;
+
+	skip_space(ps);
+	if (*ps->p == '(') {
+		ps->p++;
+		v = parse_expr(ps);
+		skip_space(ps);
+		if (*ps->p != ')')
+			parse_fail(ps, "expected ')'");
+		ps->p++;
+		return v;
+	}
+	if (*ps->p == '-') {
+		ps->p++;
+		v = primary(ps);
+		v.n = -v.n;
+		return v;
+	}
+	if (isdigit(*ps->p))
+		return number(ps);
+
+	if (*ps->p == '$')
+		ps->p++;
+	if (!valid_name_char(*ps->p, true))
+		parse_fail(ps, "expected a value");
+
+	name = ps->p;
+	while (valid_name_char(*ps->p, false))
+		ps->p++;
+	if (*ps->p == '(')
+		return call(ps, name, ps->p - name);
+	return variable(ps, name, ps->p - name);
+}
+
+static struct value term(struct parser *ps)
+{
+	struct value v, rhs;
+	char op;
+
+	v = primary(ps);
+	for (;;) {
+		skip_space(ps);
+		op = *ps->p;
+		if (op != '*' && op != '/' && op != '%')
+			return v;
+		ps->p++;
+		rhs = primary(ps);
+		if (op != '*' && rhs.n == 0)
+			script_fail("division by zero in expression '%s'",
+				    ps->expr);
+		if (op == '*')
+			v.n *= rhs.n;
+		else if (op == '/')
+			v.n /= rhs.n;
+		else
+			v.n %= rhs.n;
+		v.ip = false;
+	}
+}
+
+static struct value parse_expr(struct parser *ps)
+{
+	struct value v, rhs;
+	char op;
+
+	v = term(ps);
+	for (;;) {
+		skip_space(ps);
+		op = *ps->p;
+		if (op != '+' && op != '-')
+			return v;
+		ps->p++;
+		rhs = term(ps);
+		v.n = (op == '+') ? v.n + rhs.n : v.n - rhs.n;
+		/* address +/- offset is an address, address - address isn't */
+		v.ip = (v.ip != rhs.ip);
+	}
+}
+
+static struct value evaluate(const char *expr, unsigned int depth)
+{
+	struct parser ps = { .expr = expr, .p = expr, .depth = depth };
+	struct value v;
+
+	if (depth > SCRIPT_MAX_DEPTH)
+		script_fail("variables nested too deeply in '%s'", expr);
+
+	v = parse_expr(&ps);
+	skip_space(&ps);
+	if (*ps.p)
+		parse_fail(&ps, "trailing garbage");
+	return v;
+}
+
+static char *format_value(const void *ctx, struct value v)
+{
+	if (v.ip)
+		return talloc_asprintf(ctx, "%u.%u.%u.%u",
+				       (unsigned int)(v.n >> 24) & 0xFF,
+				       (unsigned int)(v.n >> 16) & 0xFF,
+				       (unsigned int)(v.n >> 8) & 0xFF,
+				       (unsigned int)v.n & 0xFF);
+	return talloc_asprintf(ctx, "%lld", v.n);
+}
+
+char *script_expand(const char *line, unsigned int *off, const void *ctx)
+{
+	const char *start = line + *off + 1, *end;
+	struct variable *v;
+	unsigned int len;
+
+	if (*start == '[') {
+		char *expr, *ret;
+
+		end = strchr(start, ']');
+		if (!end)
+			script_fail("no matching \"]\" found");
+		expr = talloc_strndup(ctx, start + 1, end - (start + 1));
+		ret = format_value(ctx, evaluate(expr, 0));
+		talloc_free(expr);
+		*off = end - line;
+		return ret;
+	}
+
+	if (*start == '{') {
+		start++;
+		end = strchr(start, '}');
+		if (!end)
+			script_fail("no matching \"}\" found");
+		len = end - start;
+	} else {
+		if (!valid_name_char(*start, true))
+			return NULL;
+		for (end = start; valid_name_char(*end, false); end++);
+		len = end - start;
+		end--;
+	}
+
+	v = find_var(start, len);
+	if (!v)
+		script_fail("variable '%.*s' not set", (int)len, start);
+	*off = end - line;
+	return talloc_strdup(ctx, v->value);
+}
+
+static bool set_cmd(int argc, char **argv)
+{
+	struct variable *v;
+	char *value;
+	int i;
+
+	if (argc == 1) {
+		list_for_each_entry_reverse(v, &variables, list)
+			nfsim_log(LOG_ALWAYS, "%s=%s", v->name, v->value);
+		return true;
+	}
+
+	if (!valid_name(argv[1])) {
+		nfsim_log(LOG_ALWAYS, "set: invalid variable name '%s'",
+			  argv[1]);
+		return false;
+	}
+
+	value = talloc_strdup(argv, "");
+	for (i = 2; i < argc; i++)
+		value = talloc_asprintf_append(value, "%s%s",
+					       i == 2 ? "" : " ", argv[i]);
+	script_set_var(argv[1], value);
+	return true;
+}
+
+static bool let_cmd(int argc, char **argv)
+{
+	char *expr;
+	int i;
+
+	if (argc < 3 || !valid_name(argv[1])) {
+		nfsim_log(LOG_ALWAYS, "let: usage: let <variable> <expression>");
+		return false;
+	}
+
+	expr = talloc_strdup(argv, "");
+	for (i = 2; i < argc; i++)
+		expr = talloc_asprintf_append(expr, " %s", argv[i]);
+	script_set_var(argv[1], format_value(argv, evaluate(expr, 0)));
+	return true;
+}
+
+/* Returns the first word of line if it's one which opens or closes a loop. */
+static const char *loop_word(const char *line)
+{
+	static const char *words[] = { "for", "repeat", "done" };
+	unsigned int i, len;
+
+	line += strspn(line, " \t");
+	len = strcspn(line, " \t");
+	for (i = 0; i < ARRAY_SIZE(words); i++)
+		if (strlen(words[i]) == len && strncmp(line, words[i], len) == 0)
+			return words[i];
+	return NULL;
+}
+
+bool script_recording(void)
+{
+	return recording != NULL;
+}
+
+bool script_record_line(const char *line)
+{
+	struct script_line *l;
+	const char *word;
+
+	if (!recording)
+		return false;
+
+	word = loop_word(line);
+	if (word && streq(word, "done")) {
+		/* Ours: let the done command run the loop. */
+		if (recording->depth == 0)
+			return false;
+		recording->depth--;
+	} else if (word)
+		recording->depth++;
+
+	l = talloc(recording, struct script_line);
+	l->linenum = tui_linenum;
+	l->text = talloc_strdup(l, line);
+	list_add_tail(&l->list, &recording->lines);
+	return true;
+}
+
+static struct loop *new_loop(void)
+{
+	struct loop *loop;
+
+	if (recording)
+		barf("Loop started while recording a loop body");
+
+	loop = talloc_zero(NULL, struct loop);
+	INIT_LIST_HEAD(&loop->lines);
+	return loop;
+}
+
+static bool for_cmd(int argc, char **argv)
+{
+	struct loop *loop;
+	char *dots;
+
+	if (argc < 4 || !streq(argv[2], "in") || !valid_name(argv[1])) {
+		nfsim_log(LOG_ALWAYS, "for: usage: for <variable> in <words>");
+		return false;
+	}
+
+	loop = new_loop();
+	loop->var = talloc_strdup(loop, argv[1]);
+
+	dots = strstr(argv[3], "..");
+	if (argc == 4 && dots) {
+		struct value from, to;
+
+		*dots = '\0';
+		from = evaluate(argv[3], 0);
+		to = evaluate(dots + 2, 0);
+		loop->from = from.n;
+		loop->to = to.n;
+		loop->ip = from.ip;
+		loop->num_words = 0;
+	} else {
+		int i;
+
+		loop->num_words = argc - 3;
+		loop->words = talloc_array(loop, char *, loop->num_words);
+		for (i = 3; i < argc; i++)
+			loop->words[i-3] = talloc_strdup(loop->words, argv[i]);
+	}
+	recording = loop;
+	return true;
+}
+
+static bool repeat_cmd(int argc, char **argv)
+{
+	struct value count;
+
+	if (argc != 2) {
+		nfsim_log(LOG_ALWAYS, "repeat: usage: repeat <count>");
+		return false;
+	}
+
+	count = evaluate(argv[1], 0);
+	if (count.n < 0) {
+		nfsim_log(LOG_ALWAYS, "repeat: negative count %lld", count.n);
+		return false;
+	}
+
+	recording = new_loop();
+	recording->from = 1;
+	recording->to = count.n;
+	return true;
+}
+
+static void run_body(struct loop *loop)
+{
+	struct script_line *l;
+
+	list_for_each_entry(l, &loop->lines, list) {
+		char *line = talloc_strdup(loop, l->text);
+
+		tui_linenum = l->linenum;
+		tui_process_line(line, 0);
+		talloc_free(line);
+	}
+}
+
+static bool done_cmd(int argc, char **argv)
+{
+	struct loop *loop = recording;
+	int done_line = tui_linenum;
+	long long i, step;
+
+	if (!loop) {
+		nfsim_log(LOG_ALWAYS, "done: not in a for or repeat loop");
+		return false;
+	}
+	recording = NULL;
+
+	if (loop->num_words) {
+		unsigned int w;
+
+		for (w = 0; w < loop->num_words; w++) {
+			script_set_var(loop->var, loop->words[w]);
+			run_body(loop);
+		}
+	} else {
+		step = loop->from <= loop->to ? 1 : -1;
+		/* repeat 0 runs nothing. */
+		if (!loop->var && loop->to < loop->from)
+			step = 0;
+
+		for (i = loop->from; step; i += step) {
+			if (loop->var) {
+				struct value v = { i, loop->ip };
+				char *val = format_value(loop, v);
+
+				script_set_var(loop->var, val);
+				talloc_free(val);
+			}
+			run_body(loop);
+			if (i == loop->to)
+				break;
+		}
+	}
+
+	talloc_free(loop);
+	tui_linenum = done_line;
+	return true;
+}
+
+static void set_help(int argc, char **argv)
+{
+#include "script-help:set"
+/*** XML Help:
+    <section id="c:set">
+     <title><command>set</command>, <command>let</command></title>
+     <para>Set script variables</para>
+     <cmdsynopsis>
+      <command>set</command>
+      <arg choice="opt"><replaceable>variable</replaceable>
+       <arg choice="opt" rep="repeat"><replaceable>word</replaceable></arg>
+      </arg>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>let</command>
+      <arg choice="req"><replaceable>variable</replaceable></arg>
+      <arg choice="req"><replaceable>expression</replaceable></arg>
+     </cmdsynopsis>
+     <para><command>set</command> sets a variable to the given words
+      (separated by single spaces), or lists all variables if given no
+      arguments.  <command>let</command> sets a variable to the value of
+      an integer expression.</para>
+     <para>Anywhere in a command line, <userinput>$name</userinput> or
+      <userinput>${name}</userinput> is replaced by the variable's value,
+      and <userinput>$[expression]</userinput> by the value of the
+      expression.  It is an error to use a variable which is not set.</para>
+     <para>Expressions can use <userinput>+ - * / %</userinput>,
+      parentheses, numbers, variables (with or without the $) and
+      dotted-quad addresses.  Adding to or subtracting from an address gives
+      an address, so <userinput>$[10.0.0.255 + 1]</userinput> is
+      <userinput>10.0.1.0</userinput>.  <userinput>ip(expr)</userinput>
+      turns a number into an address, and
+      <userinput>port(expr)</userinput> wraps a number into the range 1 to
+      65535.</para>
+    </section>
+*/
+}
+
+static void for_help(int argc, char **argv)
+{
+#include "script-help:for"
+/*** XML Help:
+    <section id="c:for">
+     <title><command>for</command>, <command>repeat</command>,
+      <command>done</command></title>
+     <para>Loop over a block of commands</para>
+     <cmdsynopsis>
+      <command>for</command>
+      <arg choice="req"><replaceable>variable</replaceable></arg>
+      <arg choice="plain">in</arg>
+      <arg choice="req"><replaceable>from</replaceable>..<replaceable>to</replaceable></arg>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>for</command>
+      <arg choice="req"><replaceable>variable</replaceable></arg>
+      <arg choice="plain">in</arg>
+      <arg choice="req" rep="repeat"><replaceable>word</replaceable></arg>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>repeat</command>
+      <arg choice="req"><replaceable>count</replaceable></arg>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>done</command>
+     </cmdsynopsis>
+     <para>The lines up to the matching <command>done</command> are run
+      repeatedly: for <command>for</command>, once with the variable set to
+      each word, or to each value from <replaceable>from</replaceable> to
+      <replaceable>to</replaceable> inclusive (which may be expressions, and
+      may count down); for <command>repeat</command>,
+      <replaceable>count</replaceable> times.  If
+      <replaceable>from</replaceable> is an address, the variable is set to
+      addresses.  Loops can be nested.</para>
+     <para>Variables are expanded when each line of the loop is run, not when
+      it is read, so <userinput>$i</userinput> inside the loop sees each
+      value in turn.  Line numbers in messages refer to the line in the
+      script.</para>
+    </section>
+*/
+}
+
+static void init(void)
+{
+	tui_register_command("set", set_cmd, set_help);
+	tui_register_command("let", let_cmd, set_help);
+	tui_register_command("for", for_cmd, for_help);
+	tui_register_command("repeat", repeat_cmd, for_help);
+	tui_register_command("done", done_cmd, for_help);
+}
+
+init_call(init);
@@ -0,0 +1,41 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __HAVE_SCRIPT_H
+#define __HAVE_SCRIPT_H
+
+#include <stdbool.h>
+
+/* Expand the $NAME, ${NAME} or $[expr] at line[*off], leaving *off on its
+ * last character.  Returns NULL (and leaves *off alone) if it isn't one. */
+char *script_expand(const char *line, unsigned int *off, const void *ctx);
+
+/* If a for/repeat body is being recorded, swallow this line into it. */
+bool script_record_line(const char *line);
+
+/* Is there a for/repeat still waiting for its done? */
+bool script_recording(void);
+
+/* Variable access, for commands which want to set or read them. */
+const char *script_get_var(const char *name);
+void script_set_var(const char *name, const char *value);
+
+#endif /* __HAVE_SCRIPT_H */
@@ -0,0 +1,302 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/* Shards: copies of the simulator, forked once setup is done, each of
+ * which runs the whole script but only sends its share of the flows.
+ * They share nothing, so they can use a core each. */
+#include "core.h"
+#include "tui.h"
+#include "log.h"
+#include "message.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define MAX_SHARDS 1024
+/* Different from the --cpus hash, so shards aren't one CPU each. */
+#define SHARD_HASH_SEED 0x5ba4d5
+
+static unsigned int shards;
+/* In a shard: which one we are, and where our statistics go. */
+static unsigned int shard;
+static int report_fd = -1;
+
+struct shard {
+	pid_t pid;
+	int fd;
+	int status;
+	struct rusage usage;
+};
+
+/* Statistics from all the shards, added together. */
+struct shard_total {
+	char *name;
+	unsigned long long value;
+};
+
+/*** XML Argument:
+    <section id="a:shards">
+     <title><option>--shards
+      <replaceable>n</replaceable></option></title>
+     <subtitle>Split the flows between several simulators</subtitle>
+     <para>Once initialization and any <option>--setup</option> script
+     are done, forks <replaceable>n</replaceable> copies of the
+     simulator.  Each runs the whole script, but the packet generators
+     (<command>gen_ip</command>, <command>template</command>,
+     <command>tcpsession</command> and <command>gen_traffic</command>)
+     only send the packets of the flows which hash to it (by addresses,
+     protocol and ports or ICMP id, in either direction; fragments by
+     addresses alone).  The others are skipped as if they had been
+     delivered, so commands don't fail because another shard sent their
+     packet.  A <command>tcpsession</command> or
+     <command>gen_traffic</command> flow goes wholly to one shard, even
+     if NAT changes its replies.  They share nothing, so a run with a
+     very large number of flows can use <replaceable>n</replaceable>
+     cores and <replaceable>n</replaceable> heaps.</para>
+     <para>Only the first shard's output is shown (and written to any
+     <option>--log-file</option> and <option>--stats-file</option>), and
+     <command>expect</command> only works for things every shard
+     sees.  At the end, the CPU time each shard used is printed, then
+     the statistics of all the shards added together (as shown by
+     <command>stats</command>, taken when each reached the end of the
+     script).  Packet, byte and hook verdict counts add up to what one
+     simulator would have seen, but work every shard repeats is counted
+     once per shard: memory allocations
+     (<literal>nfsim_talloc_allocs_total</literal>), and packets sent by
+     the setup script or by <command>bench</command>.  The exit status
+     is non-zero if any failed.  A script file must be given: it can't
+     be typed in.</para>
+    </section>
+*/
+static void cmdline_shards(struct option *opt)
+{
+	extern char *optarg;
+	char *end;
+
+	if (!optarg)
+		barf("shards option requires an argument");
+	shards = strtoul(optarg, &end, 0);
+	if (*end || shards == 0 || shards > MAX_SHARDS)
+		barf("shards must be between 1 and %u", MAX_SHARDS);
+}
+cmdline_opt("shards", 1, 0, cmdline_shards);
+
+bool shard_mode(void)
+{
+	return shards > 1;
+}
+
+bool shard_flow(u32 saddr, u32 daddr, u8 protocol, u16 sport, u16 dport)
+{
+	u32 ports;
+
+	if (report_fd < 0)
+		return true;
+
+	/* Replies must go to the same shard, for connection tracking:
+	 * put each pair in order so both directions look the same. */
+	if (saddr > daddr) {
+		u32 addr = saddr;
+		saddr = daddr;
+		daddr = addr;
+	}
+	if (sport > dport)
+		ports = ((u32)dport << 16) | sport;
+	else
+		ports = ((u32)sport << 16) | dport;
+
+	return jhash_3words(saddr, daddr, ports ^ protocol, SHARD_HASH_SEED)
+		% shards == shard;
+}
+
+/* Called at the end of the script, before modules are unloaded. */
+void shard_report(void)
+{
+	FILE *file;
+
+	if (report_fd < 0)
+		return;
+
+	file = fdopen(report_fd, "w");
+	if (!file)
+		barf_perror("shard %u report", shard);
+	metrics_write_text(file);
+	fclose(file);
+	report_fd = -1;
+}
+
+static void run_shard(int input_fd, int fd)
+{
+	int null;
+
+	report_fd = fd;
+	message_forked();
+
+	/* The others would only say the same thing again, and would
+	 * write over the first one's --log-file and --stats-file. */
+	if (shard != 0) {
+		null = open("/dev/null", O_WRONLY);
+		if (null < 0)
+			barf_perror("Opening /dev/null");
+		dup2(null, STDOUT_FILENO);
+		close(null);
+		nfsim_log_file_close();
+		metrics_stats_file_close();
+	}
+
+	run_script(input_fd);
+	exit(EXIT_SUCCESS);
+}
+
+static void add_total(struct shard_total **totals, unsigned int *num,
+		      unsigned int line, char *name,
+		      unsigned long long value)
+{
+	unsigned int i;
+
+	/* Every shard ran the same script: usually in the same order. */
+	if (line < *num && streq((*totals)[line].name, name)) {
+		(*totals)[line].value += value;
+		return;
+	}
+	for (i = 0; i < *num; i++) {
+		if (streq((*totals)[i].name, name)) {
+			(*totals)[i].value += value;
+			return;
+		}
+	}
+
+	*totals = talloc_realloc(NULL, *totals, struct shard_total, *num + 1);
+	(*totals)[*num].name = talloc_strdup(*totals, name);
+	(*totals)[*num].value = value;
+	(*num)++;
+}
+
+/* Add in one shard's statistics: "name{labels} value" lines. */
+static void read_report(struct shard *s, struct shard_total **totals,
+			unsigned int *num)
+{
+	unsigned long size;
+	unsigned int line = 0;
+	char *report, *p, *nl, *space;
+
+	report = grab_file(s->fd, &size);
+	close(s->fd);
+	if (!report)
+		return;
+
+	for (p = report; (nl = strchr(p, '\n')); p = nl + 1) {
+		*nl = '\0';
+		if (p[0] == '#' || !(space = strrchr(p, ' ')))
+			continue;
+		*space = '\0';
+		add_total(totals, num, line++, p, strtoull(space + 1, NULL, 10));
+	}
+	release_file(report, size);
+}
+
+static double cpu_time(const struct rusage *usage)
+{
+	return usage->ru_utime.tv_sec + usage->ru_stime.tv_sec
+		+ (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec)
+		/ 1000000.0;
+}
+
+int shard_run(int input_fd)
+{
+	struct shard *s;
+	struct shard_total *totals = NULL;
+	struct timeval start, now;
+	unsigned int i, j, num = 0, failed = 0;
+	int fds[2];
+
+	if (input_fd == STDIN_FILENO)
+		barf("Not clever enough to use --shards interactively");
+	if (get_failtest())
+		barf("--shards and --failtest can't be used together");
+
+	s = talloc_array(NULL, struct shard, shards);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < shards; i++) {
+		if (pipe(fds) != 0)
+			barf_perror("shard pipe");
+
+		fflush(stdout);
+		fflush(stderr);
+		nfsim_log_flush();
+		s[i].pid = fork();
+		if (s[i].pid < 0)
+			barf_perror("shard fork");
+		if (s[i].pid == 0) {
+			for (j = 0; j < i; j++)
+				close(s[j].fd);
+			close(fds[0]);
+			shard = i;
+			run_shard(input_fd, fds[1]);
+		}
+		close(fds[1]);
+		s[i].fd = fds[0];
+	}
+
+	for (i = 0; i < shards; i++) {
+		read_report(&s[i], &totals, &num);
+		while (wait4(s[i].pid, &s[i].status, 0, &s[i].usage) < 0)
+			if (errno != EINTR)
+				barf_perror("shard wait4");
+	}
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < shards; i++) {
+		if (WIFEXITED(s[i].status) && WEXITSTATUS(s[i].status) == 0) {
+			nfsim_log(LOG_ALWAYS, "shard %u: PASS (%.3fs cpu)", i,
+				  cpu_time(&s[i].usage));
+			continue;
+		}
+		failed++;
+		if (WIFSIGNALED(s[i].status))
+			nfsim_log(LOG_ALWAYS, "shard %u: FAIL (signal %i,"
+				  " %.3fs cpu)", i, WTERMSIG(s[i].status),
+				  cpu_time(&s[i].usage));
+		else
+			nfsim_log(LOG_ALWAYS, "shard %u: FAIL (exit %i,"
+				  " %.3fs cpu)", i, WEXITSTATUS(s[i].status),
+				  cpu_time(&s[i].usage));
+	}
+	nfsim_log(LOG_ALWAYS, "%u shards, %u failed (%.3fs)", shards, failed,
+		  (now.tv_sec - start.tv_sec)
+		  + (now.tv_usec - start.tv_usec) / 1000000.0);
+
+	for (i = 0; i < num; i++)
+		nfsim_log(LOG_UI, "%s %llu", totals[i].name, totals[i].value);
+
+	talloc_free(totals);
+	talloc_free(s);
+	/* Shards checked for leaks: we just stop any programs. */
+	message_cleanup();
+	return failed ? EXIT_SCRIPTFAIL : EXIT_SUCCESS;
+}
@@ -0,0 +1,302 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "core.h"
+#include "tui.h"
+#include "utils.h"
+#include "metrics.h"
+#include "smp.h"
+#include <log.h>
+
+#define LOCK_STAT_HASH_SIZE 1024
+
+unsigned int nfsim_cpus = 1, nfsim_cpu;
+
+/* How received packets are spread over the CPUs. */
+static enum { CPU_POLICY_HASH, CPU_POLICY_RR } cpu_policy;
+static unsigned int next_cpu;
+
+/* Kernel-style per-CPU data, so the testsuite checks per_cpu() too. */
+static DEFINE_PER_CPU(unsigned long, cpu_packets);
+
+/* One per lock (by address), named for where it was first taken.  We
+ * run one CPU at a time, so locks are never really contended: instead
+ * we count how often a lock is taken on a different CPU from last time,
+ * which on real hardware moves its cache line between them. */
+struct lock_stat {
+	struct lock_stat *next;
+	const void *lock;
+	char *location;
+	unsigned long reads, writes, bounces;
+	unsigned int last_cpu;
+};
+
+static void *lock_stat_ctx;
+static struct lock_stat *lock_stats[LOCK_STAT_HASH_SIZE];
+static unsigned long lock_acquisitions, lock_bounces;
+
+/*** XML Argument:
+    <section id="a:cpus">
+     <title><option>--cpus
+      <replaceable>n</replaceable></option></title>
+     <subtitle>Simulate more than one CPU</subtitle>
+     <para>Simulates <replaceable>n</replaceable> CPUs (default 1, at
+     most 256).  Each has its own copy of per-CPU data, and each packet
+     received is handled by one of them (see
+     <option>--cpu-policy</option>), so per-CPU data such as the
+     ip_tables rule counters are spread between them.  Commands and
+     timers run on CPU 0.  Packets are still processed one at a time:
+     see <command>lockstat</command> for which locks would be shared
+     between CPUs.</para>
+     <para>Kernel code sizes its per-CPU tables by the number of CPUs,
+     so <command>stats</command> (the
+     <literal>nfsim_kernel_memory_bytes</literal> values) shows what they
+     cost at a given CPU count, and <command>profile</command> shows
+     the cost of adding up per-CPU counters (eg. in
+     <command>iptables -L -v</command>).</para>
+    </section>
+*/
+static void cmdline_cpus(struct option *opt)
+{
+	extern char *optarg;
+	char *end;
+
+	if (!optarg)
+		barf("cpus option requires an argument");
+	nfsim_cpus = strtoul(optarg, &end, 0);
+	if (*end || nfsim_cpus == 0 || nfsim_cpus > NR_CPUS)
+		barf("cpus must be between 1 and %u", NR_CPUS);
+}
+cmdline_opt("cpus", 1, 0, cmdline_cpus);
+
+/*** XML Argument:
+    <section id="a:cpu-policy">
+     <title><option>--cpu-policy
+      <replaceable>policy</replaceable></option></title>
+     <subtitle>Choose how packets are spread over CPUs</subtitle>
+     <para>With <option>--cpus</option>, chooses which CPU handles
+     each packet received.  <literal>hash</literal> (the default) uses
+     the CPU its flow (addresses, protocol and ports) hashes to, as
+     network cards with receive side scaling do, so every packet of a
+     connection is handled by the same CPU.  <literal>rr</literal> gives
+     each packet to the next CPU in turn, so even a single flow is
+     spread over all of them.  Both give the same CPUs every
+     run.</para>
+    </section>
+*/
+static void cmdline_cpu_policy(struct option *opt)
+{
+	extern char *optarg;
+	if (!optarg)
+		barf("cpu-policy option requires an argument");
+	if (streq(optarg, "hash"))
+		cpu_policy = CPU_POLICY_HASH;
+	else if (streq(optarg, "rr"))
+		cpu_policy = CPU_POLICY_RR;
+	else
+		barf("cpu-policy must be hash or rr");
+}
+cmdline_opt("cpu-policy", 1, 0, cmdline_cpu_policy);
+
+u32 smp_flow_hash(const struct sk_buff *skb, u32 initval)
+{
+	struct iphdr iph;
+	u32 ports = 0;
+	int off = skb->nh.raw ? skb->nh.raw - skb->data : 0;
+
+	if (off < 0 || skb_copy_bits(skb, off, &iph, sizeof(iph)) != 0
+	    || iph.version != 4)
+		return jhash_1word(skb->dev ? skb->dev->ifindex : 0, initval);
+
+	/* Fragments only have the addresses, so use them for all of them. */
+	if ((iph.protocol == IPPROTO_TCP || iph.protocol == IPPROTO_UDP)
+	    && !(iph.frag_off & htons(IP_MF|IP_OFFSET)))
+		skb_copy_bits(skb, off + iph.ihl * 4, &ports, sizeof(ports));
+
+	return jhash_3words(iph.saddr, iph.daddr, ports ^ iph.protocol,
+			    initval);
+}
+
+void smp_packet(const struct sk_buff *skb)
+{
+	if (nfsim_cpus > 1) {
+		if (cpu_policy == CPU_POLICY_RR)
+			nfsim_cpu = next_cpu++ % nfsim_cpus;
+		else
+			nfsim_cpu = smp_flow_hash(skb, 0) % nfsim_cpus;
+	}
+	__get_cpu_var(cpu_packets)++;
+}
+
+void smp_lock_taken(const void *lock, const char *location, bool write)
+{
+	unsigned int h = ((unsigned long)lock >> 3) % LOCK_STAT_HASH_SIZE;
+	struct lock_stat *ls;
+
+	for (ls = lock_stats[h]; ls; ls = ls->next)
+		if (ls->lock == lock)
+			break;
+
+	if (!ls) {
+		/* Not under nfsim_tallocs: it's not the kernel's memory. */
+		if (!lock_stat_ctx)
+			lock_stat_ctx = talloc_named_const(NULL, 1,
+							   "lock stats");
+		ls = talloc_zero(lock_stat_ctx, struct lock_stat);
+		ls->lock = lock;
+		ls->location = talloc_strdup(ls, location);
+		ls->last_cpu = nfsim_cpu;
+		ls->next = lock_stats[h];
+		lock_stats[h] = ls;
+	}
+
+	if (write)
+		ls->writes++;
+	else
+		ls->reads++;
+	lock_acquisitions++;
+	if (ls->last_cpu != nfsim_cpu) {
+		ls->bounces++;
+		lock_bounces++;
+		ls->last_cpu = nfsim_cpu;
+	}
+}
+
+static int lock_stat_cmp(const void *a, const void *b)
+{
+	const struct lock_stat *la = *(const struct lock_stat **)a;
+	const struct lock_stat *lb = *(const struct lock_stat **)b;
+
+	if (la->bounces != lb->bounces)
+		return la->bounces < lb->bounces ? 1 : -1;
+	if (la->reads + la->writes != lb->reads + lb->writes)
+		return la->reads + la->writes < lb->reads + lb->writes
+			? 1 : -1;
+	return strcmp(la->location, lb->location);
+}
+
+static void lockstat_report(void)
+{
+	struct lock_stat *ls, **sorted;
+	unsigned int i, num = 0;
+
+	for (i = 0; i < LOCK_STAT_HASH_SIZE; i++)
+		for (ls = lock_stats[i]; ls; ls = ls->next)
+			num++;
+	if (!num) {
+		nfsim_log(LOG_UI, "lockstat: no locks taken");
+		return;
+	}
+
+	sorted = talloc_array(lock_stat_ctx, struct lock_stat *, num);
+	num = 0;
+	for (i = 0; i < LOCK_STAT_HASH_SIZE; i++)
+		for (ls = lock_stats[i]; ls; ls = ls->next)
+			sorted[num++] = ls;
+	qsort(sorted, num, sizeof(sorted[0]), lock_stat_cmp);
+
+	nfsim_log(LOG_UI, "%-40s %10s %10s %10s", "lock (first taken at)",
+		  "reads", "writes", "bounces");
+	for (i = 0; i < num; i++)
+		nfsim_log(LOG_UI, "%-40.40s %10lu %10lu %10lu",
+			  sorted[i]->location, sorted[i]->reads,
+			  sorted[i]->writes, sorted[i]->bounces);
+	talloc_free(sorted);
+}
+
+static bool lockstat(int argc, char **argv)
+{
+	unsigned int i;
+
+	if (argc == 1) {
+		lockstat_report();
+		return true;
+	}
+
+	if (argc == 2 && streq(argv[1], "reset")) {
+		talloc_free(lock_stat_ctx);
+		lock_stat_ctx = NULL;
+		memset(lock_stats, 0, sizeof(lock_stats));
+		lock_acquisitions = lock_bounces = 0;
+		for_each_cpu(i)
+			per_cpu(cpu_packets, i) = 0;
+		return true;
+	}
+
+	nfsim_log(LOG_ALWAYS, "Usage: lockstat [reset]");
+	return false;
+}
+
+static void lockstat_help(int argc, char **argv)
+{
+#include "smp-help:lockstat"
+/*** XML Help:
+    <section id="c:lockstat">
+     <title><command>lockstat</command></title>
+     <para>Show which locks are shared between CPUs</para>
+     <cmdsynopsis>
+      <command>lockstat</command>
+      <arg choice="opt">reset</arg>
+     </cmdsynopsis>
+     <para>Lists each lock the kernel code has taken (named by where
+     it was first taken), with how many times it was read and write
+     locked, and how many times it was taken on a different CPU from
+     the time before.  On a real machine each of these moves the lock
+     between CPU caches, so the locks at the top of the list are the
+     ones which will stop the code scaling: run with
+     <option>--cpus</option> to spread packets between CPUs.</para>
+     <para><command>lockstat reset</command> forgets the counts so
+     far.</para>
+    </section>
+*/
+}
+
+static void collect_cpu_packets(struct metric_sink *sink)
+{
+	unsigned int i;
+
+	for (i = 0; i < nfsim_cpus; i++)
+		metric_value(sink, per_cpu(cpu_packets, i), "cpu=\"%u\"", i);
+}
+
+static struct metric smp_metrics[] = {
+	{ .name = "nfsim_cpu_packets_total", .type = "counter",
+	  .help = "Packets received, by the CPU which handled them.",
+	  .collect = collect_cpu_packets },
+	{ .name = "nfsim_lock_acquisitions_total", .type = "counter",
+	  .help = "Spinlocks and rwlocks taken.",
+	  .value = &lock_acquisitions },
+	{ .name = "nfsim_lock_bounces_total", .type = "counter",
+	  .help = "Locks taken on a different CPU from the last time.",
+	  .value = &lock_bounces },
+};
+
+static void smp_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(smp_metrics); i++)
+		metric_register(&smp_metrics[i]);
+	tui_register_command("lockstat", lockstat, lockstat_help);
+}
+
+init_call(smp_init);
@@ -0,0 +1,37 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef __HAVE_SMP_H
+#define __HAVE_SMP_H
+#include <stdbool.h>
+
+struct sk_buff;
+
+/* Hash of the packet's flow: addresses, protocol and (TCP, UDP) ports. */
+u32 smp_flow_hash(const struct sk_buff *skb, u32 initval);
+
+/* Switch to the CPU which handles this packet (by --cpu-policy). */
+void smp_packet(const struct sk_buff *skb);
+
+/* Called by the lock debugging code each time a lock is taken. */
+void smp_lock_taken(const void *lock, const char *location, bool write);
+#endif /* __HAVE_SMP_H */
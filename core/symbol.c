@@ -0,0 +1,256 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
+
+#include "symbol.h"
+#include "utils.h"
+#include "talloc.h"
+
+#define SYMBOL_CACHE_SIZE 256
+
+#if __ELF_NATIVE_CLASS == 64
+#define ELF_NATIVE_CLASS ELFCLASS64
+#define ELF_ST_TYPE(info) ELF64_ST_TYPE(info)
+#else
+#define ELF_NATIVE_CLASS ELFCLASS32
+#define ELF_ST_TYPE(info) ELF32_ST_TYPE(info)
+#endif
+
+struct symbol {
+	unsigned long addr, size;
+	const char *name;
+};
+
+/* Function symbols of one loaded object, sorted by address. */
+struct symbol_file {
+	struct symbol_file *next;
+	const char *filename;
+	unsigned long base;
+	struct symbol *syms;
+	unsigned int num_syms;
+};
+
+/* Addresses we've already looked up. */
+struct symbol_cache {
+	struct symbol_cache *next;
+	const void *addr;
+	const char *name;
+};
+
+static void *symbol_ctx;
+static struct symbol_file *files;
+static struct symbol_cache *cache[SYMBOL_CACHE_SIZE];
+
+static int symbol_cmp(const void *a, const void *b)
+{
+	const struct symbol *sa = a, *sb = b;
+
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+	/* Prefer the sized one (not a label) at the same address. */
+	if (sa->size != sb->size)
+		return sa->size > sb->size ? -1 : 1;
+	return 0;
+}
+
+/* The static symbol table if it's there, otherwise the dynamic one. */
+static const ElfW(Shdr) *find_symtab(const ElfW(Ehdr) *ehdr,
+				     unsigned long size)
+{
+	const ElfW(Shdr) *shdr, *dynsym = NULL;
+	unsigned int i;
+
+	if (ehdr->e_shoff + ehdr->e_shnum * sizeof(*shdr) > size)
+		return NULL;
+
+	shdr = (const void *)ehdr + ehdr->e_shoff;
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (shdr[i].sh_type == SHT_SYMTAB)
+			return &shdr[i];
+		if (shdr[i].sh_type == SHT_DYNSYM)
+			dynsym = &shdr[i];
+	}
+	return dynsym;
+}
+
+static void read_symbols(struct symbol_file *file, const char *filename)
+{
+	const ElfW(Ehdr) *ehdr;
+	const ElfW(Shdr) *symtab, *strtab;
+	const ElfW(Sym) *sym;
+	unsigned long size, i, num;
+	void *data;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return;
+	data = grab_file(fd, &size);
+	close(fd);
+	if (!data)
+		return;
+
+	ehdr = data;
+	if (size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+	    || ehdr->e_ident[EI_CLASS] != ELF_NATIVE_CLASS)
+		goto out;
+
+	symtab = find_symtab(ehdr, size);
+	if (!symtab || symtab->sh_link >= ehdr->e_shnum)
+		goto out;
+	strtab = (const ElfW(Shdr) *)(data + ehdr->e_shoff) + symtab->sh_link;
+	if (symtab->sh_offset + symtab->sh_size > size
+	    || strtab->sh_offset + strtab->sh_size > size)
+		goto out;
+
+	num = symtab->sh_size / sizeof(*sym);
+	file->syms = talloc_array(file, struct symbol, num);
+	sym = data + symtab->sh_offset;
+	for (i = 0; i < num; i++) {
+		struct symbol *s = &file->syms[file->num_syms];
+
+		if (ELF_ST_TYPE(sym[i].st_info) != STT_FUNC
+		    || sym[i].st_shndx == SHN_UNDEF
+		    || sym[i].st_name >= strtab->sh_size)
+			continue;
+
+		/* Shared objects (and PIE) are relative to where they load. */
+		s->addr = sym[i].st_value;
+		if (ehdr->e_type == ET_DYN)
+			s->addr += file->base;
+		s->size = sym[i].st_size;
+		s->name = talloc_strdup(file, data + strtab->sh_offset
+					+ sym[i].st_name);
+		file->num_syms++;
+	}
+	qsort(file->syms, file->num_syms, sizeof(file->syms[0]), symbol_cmp);
+out:
+	release_file(data, size);
+}
+
+static struct symbol_file *get_file(const Dl_info *info)
+{
+	struct symbol_file *file;
+	const char *filename = info->dli_fname;
+
+	for (file = files; file; file = file->next)
+		if (file->base == (unsigned long)info->dli_fbase
+		    && streq(file->filename, filename))
+			return file;
+
+	file = talloc_zero(symbol_ctx, struct symbol_file);
+	file->filename = talloc_strdup(file, filename);
+	file->base = (unsigned long)info->dli_fbase;
+	/* The main program may not know its own name. */
+	if (!filename[0] || access(filename, R_OK) != 0)
+		filename = "/proc/self/exe";
+	read_symbols(file, filename);
+	file->next = files;
+	files = file;
+	return file;
+}
+
+/* Last symbol at or before addr. */
+static const struct symbol *find_symbol(const struct symbol_file *file,
+					unsigned long addr)
+{
+	int lo = 0, hi = (int)file->num_syms - 1, mid;
+	const struct symbol *best = NULL;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (file->syms[mid].addr <= addr) {
+			best = &file->syms[mid];
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	/* Several at that address?  Sorting put the best one first. */
+	while (best && best > file->syms && best[-1].addr == best->addr)
+		best--;
+	if (best && best->size && addr >= best->addr + best->size)
+		return NULL;
+	return best;
+}
+
+static const char *lookup(const void *addr)
+{
+	Dl_info info;
+	const struct symbol *sym = NULL;
+	unsigned long a = (unsigned long)addr;
+
+	if (dladdr(addr, &info) && info.dli_fname) {
+		sym = find_symbol(get_file(&info), a);
+		/* No symbol table: the dynamic symbol will have to do. */
+		if (!sym && info.dli_sname) {
+			if (info.dli_saddr == addr)
+				return talloc_strdup(symbol_ctx,
+						     info.dli_sname);
+			return talloc_asprintf(symbol_ctx, "%s+%#lx",
+					       info.dli_sname,
+					       a - (unsigned long)
+					       info.dli_saddr);
+		}
+	}
+
+	if (!sym)
+		return talloc_asprintf(symbol_ctx, "%p", addr);
+	if (sym->addr == a)
+		return sym->name;
+	return talloc_asprintf(symbol_ctx, "%s+%#lx", sym->name,
+			       a - sym->addr);
+}
+
+const char *symbolize(const void *addr)
+{
+	unsigned int h = ((unsigned long)addr >> 4) % SYMBOL_CACHE_SIZE;
+	struct symbol_cache *c;
+
+	if (!symbol_ctx)
+		symbol_ctx = talloc_named_const(NULL, 1, "symbols");
+
+	for (c = cache[h]; c; c = c->next)
+		if (c->addr == addr)
+			return c->name;
+
+	c = talloc(symbol_ctx, struct symbol_cache);
+	c->addr = addr;
+	c->name = lookup(addr);
+	c->next = cache[h];
+	cache[h] = c;
+	return c->name;
+}
+
+void symbol_flush(void)
+{
+	talloc_free(symbol_ctx);
+	symbol_ctx = NULL;
+	files = NULL;
+	memset(cache, 0, sizeof(cache));
+}
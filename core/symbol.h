@@ -0,0 +1,33 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __HAVE_SYMBOL_H
+#define __HAVE_SYMBOL_H
+
+/* Name of the function at addr, in the simulator or a loaded module:
+ * "ip_conntrack_in", "ip_conntrack_in+0x1c", or just the address if
+ * we can't tell.  Static functions are found too (from the ELF symbol
+ * table).  The string stays valid until symbol_flush(). */
+const char *symbolize(const void *addr);
+
+/* Forget everything: a module has been unloaded. */
+void symbol_flush(void);
+#endif /* __HAVE_SYMBOL_H */
@@ -171,6 +171,9 @@ void *talloc_parent(const void *ptr)
 	return (void *)(tc+1);
 }
 
+/* number of successful allocations ever made, for benchmarks */
+static unsigned long talloc_allocs;
+
 /*
    Allocate a bit of memory as a child of an existing pointer
 */
@@ -189,6 +192,8 @@ void *_talloc(const void *context, size_t size)
 	tc = malloc(sizeof(*tc)+size);
 	if (tc == NULL) return NULL;
 
+	talloc_allocs++;
+
 	tc->size = size;
 	tc->u.magic = TALLOC_MAGIC;
 	tc->destructor = NULL;
@@ -734,6 +739,14 @@ off_t talloc_total_size(const void *ptr)
 	return total;
 }
 
+/*
+  return the number of allocations made so far (not counting reallocs)
+*/
+unsigned long talloc_total_allocs(void)
+{
+	return talloc_allocs;
+}
+
 /*
   return the total number of blocks in a talloc pool (subtree)
 */
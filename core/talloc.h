@@ -111,6 +111,7 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 void *talloc_steal(const void *new_ctx, const void *ptr);
 off_t talloc_total_size(const void *ptr);
 off_t talloc_total_blocks(const void *ptr);
+unsigned long talloc_total_allocs(void);
 void talloc_report_full(const void *ptr, FILE *f);
 void talloc_report(const void *ptr, FILE *f);
 void talloc_enable_null_tracking(void);
@@ -0,0 +1,287 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "core.h"
+#include "tui.h"
+#include "utils.h"
+#include "trace.h"
+#include "symbol.h"
+#include <log.h>
+#include <errno.h>
+
+#define TRACE_DEFAULT_EVENTS 65536
+#define TRACE_DEFAULT_SNAPLEN 40
+#define TRACE_STRING_HASH_SIZE 256
+
+bool tracing;
+
+/* The ring: slots (a power of 2) events of event_size bytes. */
+static char *ring;
+static unsigned int slots, event_size, snaplen;
+static uint64_t recorded;
+
+/* Owner, function and device names, stored once each. */
+struct trace_string {
+	struct trace_string *next;
+	unsigned int index;
+	char name[0];
+};
+static struct trace_string *string_hash[TRACE_STRING_HASH_SIZE];
+static struct trace_string **strings;
+static unsigned int num_strings;
+
+static uint64_t read_tsc(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	uint32_t lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+#else
+	return time_ns();
+#endif
+}
+
+static uint16_t trace_string(const char *name)
+{
+	unsigned int h = jhash((void *)name, strlen(name), 0)
+		& (TRACE_STRING_HASH_SIZE - 1);
+	struct trace_string *s;
+
+	for (s = string_hash[h]; s; s = s->next)
+		if (streq(s->name, name))
+			return s->index;
+
+	/* Index 0 means none. */
+	if (num_strings == 65535)
+		return 0;
+
+	s = talloc_size(ring, sizeof(*s) + strlen(name) + 1);
+	strcpy(s->name, name);
+	s->index = ++num_strings;
+	s->next = string_hash[h];
+	string_hash[h] = s;
+	strings = talloc_realloc(ring, strings, struct trace_string *,
+				 num_strings + 1);
+	strings[s->index] = s;
+	return s->index;
+}
+
+void __trace_packet(enum trace_type type, unsigned int seq,
+		    const struct sk_buff *skb, const struct net_device *dev,
+		    const char *owner, const void *func, unsigned int hook,
+		    unsigned int verdict, uint32_t arg)
+{
+	struct trace_event *e;
+
+	e = (struct trace_event *)(ring + (recorded++ & (slots - 1))
+				   * event_size);
+	e->tsc = read_tsc();
+	e->jiffies = jiffies;
+	e->seq = seq;
+	e->type = type;
+	e->hook = hook;
+	e->verdict = verdict;
+	e->arg = arg;
+	e->owner = owner ? trace_string(owner) : 0;
+	e->func = func ? trace_string(symbolize(func)) : 0;
+	e->dev = dev ? trace_string(dev->name) : 0;
+	e->len = skb ? skb->len : 0;
+	e->caplen = 0;
+
+	if (skb && snaplen) {
+		int off = skb->nh.raw ? skb->nh.raw - skb->data : 0;
+
+		if (off >= 0 && off < skb->len) {
+			e->caplen = min_t(unsigned int, snaplen,
+					  skb->len - off);
+			if (skb_copy_bits(skb, off, e + 1, e->caplen) != 0)
+				e->caplen = 0;
+		}
+	}
+}
+
+static void trace_stop(void)
+{
+	tracing = false;
+	talloc_free(ring);
+	ring = NULL;
+	strings = NULL;
+	num_strings = 0;
+	memset(string_hash, 0, sizeof(string_hash));
+}
+
+static void trace_start(unsigned int events, unsigned int snap)
+{
+	trace_stop();
+
+	for (slots = 1; slots < events; slots <<= 1);
+	snaplen = snap;
+	event_size = (sizeof(struct trace_event) + snaplen + 7) & ~7;
+	recorded = 0;
+
+	/* Not under nfsim_tallocs: it's not the kernel's memory. */
+	ring = talloc_named_const(NULL, slots * event_size, "trace ring");
+	strings = talloc_array(ring, struct trace_string *, 1);
+	tracing = true;
+}
+
+static bool trace_dump(const char *filename)
+{
+	struct trace_file_header hdr;
+	uint64_t first, i;
+	unsigned int n;
+	FILE *file;
+	bool ok;
+
+	if (!ring) {
+		nfsim_log(LOG_ALWAYS, "trace: nothing recorded");
+		return false;
+	}
+
+	file = fopen(filename, "w");
+	if (!file) {
+		nfsim_log(LOG_ALWAYS, "trace: cannot open %s: %s",
+			  filename, strerror(errno));
+		return false;
+	}
+
+	first = recorded > slots ? recorded - slots : 0;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_FILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_FILE_VERSION;
+	hdr.event_size = event_size;
+	hdr.snaplen = snaplen;
+	hdr.strings = num_strings;
+	hdr.events = recorded - first;
+	hdr.lost = first;
+	fwrite(&hdr, sizeof(hdr), 1, file);
+
+	for (n = 1; n <= num_strings; n++)
+		fwrite(strings[n]->name, strlen(strings[n]->name) + 1, 1, file);
+
+	for (i = first; i < recorded; i++)
+		fwrite(ring + (i & (slots - 1)) * event_size, event_size, 1,
+		       file);
+
+	ok = !ferror(file);
+	if (fclose(file) != 0)
+		ok = false;
+	if (!ok)
+		nfsim_log(LOG_ALWAYS, "trace: error writing %s: %s",
+			  filename, strerror(errno));
+	return ok;
+}
+
+static bool trace(int argc, char **argv)
+{
+	unsigned int events = TRACE_DEFAULT_EVENTS;
+	unsigned int snap = TRACE_DEFAULT_SNAPLEN;
+	int i;
+
+	if (argc == 1) {
+		if (!ring)
+			nfsim_log(LOG_UI, "trace: off");
+		else
+			nfsim_log(LOG_UI, "trace: %s, %llu events"
+				  " (%llu overwritten), %u slots, snap %u",
+				  tracing ? "on" : "off",
+				  (unsigned long long)recorded,
+				  (unsigned long long)(recorded > slots
+						       ? recorded - slots : 0),
+				  slots, snaplen);
+		return true;
+	}
+
+	if (streq(argv[1], "on")) {
+		for (i = 2; i < argc; i++) {
+			if (strstarts(argv[i], "EVENTS="))
+				events = strtoul(argv[i] + 7, NULL, 0);
+			else if (strstarts(argv[i], "SNAP="))
+				snap = strtoul(argv[i] + 5, NULL, 0);
+			else
+				goto usage;
+		}
+		if (events == 0 || events > (1U << 24)
+		    || snap > TRACE_MAX_SNAPLEN)
+			goto usage;
+		trace_start(events, snap);
+		return true;
+	}
+
+	if (streq(argv[1], "off") && argc == 2) {
+		tracing = false;
+		return true;
+	}
+
+	if (streq(argv[1], "dump") && argc == 3)
+		return trace_dump(argv[2]);
+
+usage:
+	nfsim_log(LOG_ALWAYS, "Usage: trace [on [EVENTS=n] [SNAP=n] | off"
+		  " | dump <file>]");
+	return false;
+}
+
+static void trace_help(int argc, char **argv)
+{
+#include "trace-help:trace"
+/*** XML Help:
+    <section id="c:trace">
+     <title><command>trace</command></title>
+     <para>Record packet events in a binary trace</para>
+     <cmdsynopsis>
+      <command>trace</command>
+      <arg choice="plain">on</arg>
+      <arg choice="opt">EVENTS=<replaceable>n</replaceable></arg>
+      <arg choice="opt">SNAP=<replaceable>bytes</replaceable></arg>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>trace</command>
+      <group choice="opt">
+       <arg choice="plain">off</arg>
+       <arg choice="plain">dump <replaceable>file</replaceable></arg>
+      </group>
+     </cmdsynopsis>
+     <para><command>trace on</command> starts recording each packet
+     received, each hook verdict, each send, queue, reinject and free
+     into a ring of <replaceable>n</replaceable> events (default 65536,
+     rounded up to a power of 2): once full, the oldest are overwritten.
+     Each records the skb sequence number, hook, hook function and its
+     module, verdict, interface, jiffies, the CPU timestamp counter and
+     the first <replaceable>bytes</replaceable> of the IP header
+     (default 40, at most 128; 0 for none).  This is much cheaper than logging the same
+     information as text.</para>
+     <para><command>trace off</command> stops recording, and
+     <command>trace dump</command> writes the recorded events to
+     <replaceable>file</replaceable>; <command>nfsim-trace</command>
+     prints such a file.  With no arguments, shows how many events have
+     been recorded.</para>
+    </section>
+*/
+}
+
+static void trace_init(void)
+{
+	tui_register_command("trace", trace, trace_help);
+}
+
+init_call(trace_init);
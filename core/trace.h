@@ -0,0 +1,91 @@
+/*
+
+Copyright (c) 2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Binary packet trace: recorded into a ring by the simulator, written
+ * out by "trace dump", read by nfsim-trace.  This header is shared
+ * with nfsim-trace, so only needs the C library. */
+#ifndef __HAVE_TRACE_H
+#define __HAVE_TRACE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+enum trace_type {
+	TRACE_RCV = 1,		/* ip_rcv: dev */
+	TRACE_HOOK,		/* call_elem_hook: hook, owner, func, verdict,
+				   dev; arg is the queue number for NF_QUEUE */
+	TRACE_SEND,		/* nf_send: dev (none for local delivery) */
+	TRACE_QUEUE,		/* queued to userspace: arg is the queue id */
+	TRACE_REINJECT,		/* out of the queue again: verdict, arg */
+	TRACE_FREE,		/* kfree_skb */
+};
+
+/* Followed by caplen bytes of IP header (in a slot snaplen long). */
+struct trace_event {
+	uint64_t tsc;
+	uint64_t jiffies;
+	uint32_t seq;		/* skb->seq */
+	uint32_t len;		/* skb->len */
+	uint32_t arg;
+	uint16_t owner;		/* string index: 0 for none */
+	uint16_t dev;		/* string index: 0 for none */
+	uint8_t type;
+	uint8_t hook;
+	uint8_t verdict;
+	uint8_t caplen;
+	uint16_t func;		/* string index: hook function name */
+	uint16_t pad;
+};
+
+/* A dump is the header, then the strings referred to by events
+ * (nul-terminated, from index 1), then the events, oldest first, each
+ * event_size bytes. */
+#define TRACE_FILE_MAGIC "NFSIMTR1"
+#define TRACE_FILE_VERSION 1
+#define TRACE_MAX_SNAPLEN 128
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+	uint32_t snaplen;
+	uint32_t strings;
+	uint64_t events;
+	uint64_t lost;		/* older events overwritten in the ring */
+};
+
+struct sk_buff;
+struct net_device;
+
+extern bool tracing;
+
+void __trace_packet(enum trace_type type, unsigned int seq,
+		    const struct sk_buff *skb, const struct net_device *dev,
+		    const char *owner, const void *func, unsigned int hook,
+		    unsigned int verdict, uint32_t arg);
+
+/* skb is only used for the length and header snapshot: NULL if gone. */
+#define trace_packet(type, seq, skb, dev, owner, func, hook, verdict, arg) \
+	do {								\
+		if (tracing)						\
+			__trace_packet(type, seq, skb, dev, owner,	\
+				       func, hook, verdict, arg);	\
+	} while (0)
+#endif /* __HAVE_TRACE_H */
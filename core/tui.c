@@ -23,10 +23,11 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "log.h"
 #include "core.h"
 #include "expect.h"
+#include "script.h"
+#include "extension.h"
 #include "utils.h"
 
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <stdio.h>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -42,6 +43,7 @@ static bool stop;
 
 struct command {
 	struct	list_head list;
+	struct	command *hash_next;
 	char	name[TUI_MAX_CMD_LEN+1];
 	bool	(*handler)(int, char **);
 	void	(*helpfn) (int, char **);
@@ -56,6 +58,16 @@ struct pre_post_hook {
 static LIST_HEAD(commands);
 static LIST_HEAD(pre_post_hooks);
 
+/* Commands are looked up once per script line: keep them hashed by name.
+ * The list above is still kept (in registration order) for help. */
+#define TUI_CMD_HASH_SIZE	256
+static struct command *command_hash[TUI_CMD_HASH_SIZE];
+
+static unsigned int command_hashfn(const char *name)
+{
+	return jhash((void *)name, strlen(name), 0) & (TUI_CMD_HASH_SIZE - 1);
+}
+
 static bool tui_exit(int argc, char **argv)
 {
 	stop = true;
@@ -75,8 +87,9 @@ static bool tui_argtest(int argc, char **argv)
 static inline struct command *find_command(const char *name)
 {
 	struct command *cmd;
-	list_for_each_entry(cmd, &commands, list)
-		if (!strcmp(name, cmd->name))
+
+	for (cmd = command_hash[command_hashfn(name)]; cmd; cmd = cmd->hash_next)
+		if (streq(name, cmd->name))
 			return cmd;
 
 	return NULL;
@@ -273,12 +286,10 @@ static char *escape(const char *src, size_t src_len)
 }
 
 /* Process `command`: update off to point to tail backquote */
-static char *backquote(char *line, unsigned int *off)
+static char *backquote(const char *line, unsigned int *off, const void *ctx)
 {
-	char *end, *cmdstr, *str;
-	FILE *cmdfile;
-	size_t used, len, i;
-	int status;
+	char *end, *str, *ret;
+	size_t len, used;
 
 	/* Skip first backquote, look for next one. */
 	(*off)++;
@@ -287,89 +298,106 @@ static char *backquote(char *line, unsigned int *off)
 		script_fail("no matching \"`\" found");
 
 	len = end - (line + *off);
-	cmdstr = talloc_asprintf(line, "PATH=%s; %.*s",
-				 extension_path, (int)len, line + *off);
-	cmdfile = popen(cmdstr, "r");
-	if (!cmdfile)
-		script_fail("failed to popen '%s': %s\n",
-			    cmdstr, strerror(errno));
-
-       /* Jump to backquote. */
-       *off += len;
-
-	/* Read command output. */
-	used = 0;
-	len = 1024;
-	str = talloc_array(line, char, len);
-
-	while ((i = fread(str + used, 1, len - used, cmdfile)) != 0) {
-		used += i;
-		if (used == len) {
-			if (len > 1024*1024)
-				script_fail("command '%s' output too long\n",
-					    cmdstr);
-			len *= 2;
-			str = talloc_realloc(line, str, char, len);
-		}
-	}
-	status = pclose(cmdfile);
-	if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
-		script_fail("command '%s' failed\n", cmdstr);
+	str = extension_run(line + *off, len, ctx, &used);
 
-	return escape(str, used);
+	/* Jump to backquote. */
+	*off += len;
+
+	ret = talloc_steal(ctx, escape(str, used));
+	talloc_free(str);
+	return ret;
 }
 
-static char *append_char(char **argv, unsigned int argc, char c)
+/* Append [start, end) of the line to a token that had to be copied. */
+static char *append_segment(char *arg, const char *start, const char *end)
 {
-	if (!argv[argc])
-		return talloc_asprintf(argv, "%c", c);
-	return talloc_asprintf_append(argv[argc], "%c", c);
+	if (end == start)
+		return arg;
+	return talloc_asprintf_append(arg, "%.*s", (int)(end - start), start);
 }
 
-static char *append_string(char **argv, unsigned int argc, const char *str)
+/* Split line into argv in place: plain arguments are slices of the line
+ * itself, terminated where the following whitespace was.  Only arguments
+ * containing `command` substitutions or $variables are copied. */
+static unsigned int tokenize(char *line, unsigned int off, char **argv)
 {
-	if (!argv[argc])
-		return talloc_asprintf(argv, "%s", str);
-	return talloc_asprintf_append(argv[argc], "%s", str);
+	unsigned int argc = 0, i = off, start;
+	char *arg;
+
+	for (;;) {
+		while (isspace(line[i]))
+			i++;
+		if (!line[i])
+			break;
+
+		/* If it is a comment, stop before we process `` */
+		if (argc == 0 && line[i] == '#')
+			break;
+
+		if (argc == TUI_MAX_ARGS)
+			script_fail("more than %u arguments", TUI_MAX_ARGS);
+
+		arg = NULL;
+		for (start = i; line[i] && !isspace(line[i]); i++) {
+			unsigned int inside_start = i;
+			char *inside;
+
+			if (line[i] == '`')
+				inside = backquote(line, &i, argv);
+			else if (line[i] == '$')
+				inside = script_expand(line, &i, argv);
+			else
+				continue;
+			/* A $ which doesn't introduce a variable is just a $. */
+			if (!inside)
+				continue;
+			if (!arg)
+				arg = talloc_strndup(argv, line + start,
+						     inside_start - start);
+			else
+				arg = append_segment(arg, line + start,
+						     line + inside_start);
+			arg = talloc_asprintf_append(arg, "%s", inside);
+			talloc_free(inside);
+			start = i + 1;
+		}
+
+		if (arg)
+			argv[argc++] = append_segment(arg, line + start, line + i);
+		else
+			argv[argc++] = line + start;
+
+		if (!line[i])
+			break;
+		line[i++] = '\0';
+	}
+	argv[argc] = NULL;
+	return argc;
 }
 
-static void process_line(char *line, unsigned int off)
+void tui_process_line(char *line, unsigned int off)
 {
-	unsigned int argc, i;
+	unsigned int argc;
 	char **argv;
 
+	/* Loop bodies are run (and expanded) when the loop is done. */
+	if (script_record_line(line + off)) {
+		tui_linenum++;
+		return;
+	}
+
 	if (tui_echo_commands)
 		printf("%u:%s\n", tui_linenum, line + off);
 
-	/* Talloc argv off line so commands can use it for auto-cleanup. */
-	argv = talloc_zero_array(line, char *, TUI_MAX_ARGS+1);
-	argc = 0;
-	for (i = off; line[i]; i++) {
-		if (isspace(line[i])) {
-			/* If anything in this arg, move to next. */
-			if (argv[argc])
-				argc++;
-		} else if (line[i] == '`') {
-			char *inside = backquote(line, &i);
-			argv[argc] = append_string(argv, argc, inside);
-		} else {
-			/* If it is a comment, stop before we process `` */
-			if (!argv[0] && line[i] == '#')
-				goto out;
-
-			argv[argc] = append_char(argv, argc, line[i]);
-		}
-	}
-
-	if (argv[0]) {
-		if (argv[argc])
-			argv[++argc] = NULL;
+	/* Commands can hang temporary allocations off argv: it all goes
+	 * once the command is done. */
+	argv = talloc_array(line, char *, TUI_MAX_ARGS+1);
+	argc = tokenize(line, off, argv);
+	if (argc)
 		tui_do_command(argc, argv, tui_abort_on_fail);
-	}
+	talloc_free(argv);
 
-out:
 	tui_linenum++;
-	return;
 }
 
 static void readline_process_line(char *line)
@@ -385,34 +413,103 @@ static void readline_process_line(char *line)
 	/* Readline isn't talloc-aware, so copy string: functions can
 	 * hang temporary variables off this. */
 	talloc_line = talloc_strdup(NULL, line);
-	process_line(talloc_line, 0);
+	tui_process_line(talloc_line, 0);
 	talloc_free(talloc_line);
+	nfsim_log_flush();
 }
 
-static void run_whole_file(int fd)
+/* Scripts can be huge (or endless, from a pipe): read them a chunk at a
+ * time, so only the current line need be in memory. */
+#define TUI_READ_CHUNK 65536
+
+struct script_input {
+	int fd;
+	char *buf;
+	/* Current line starts at start, buffered input ends at used. */
+	size_t size, start, used;
+	/* File offset to read from next, or -1 if we can't seek. */
+	off_t pos;
+};
+
+/* Read some more input: returns false at end of file. */
+static bool read_more(struct script_input *in)
 {
-	char *file, *p;
-	unsigned long size, len;
+	ssize_t r;
+
+	/* Shuffle the partial line down, growing if it fills the buffer. */
+	memmove(in->buf, in->buf + in->start, in->used - in->start);
+	in->used -= in->start;
+	in->start = 0;
+	if (in->used == in->size) {
+		in->size *= 2;
+		in->buf = talloc_realloc(NULL, in->buf, char, in->size + 1);
+	}
 
-	file = grab_file(fd, &size);
-	if (!file)
-		barf_perror("Grabbing file");
+	do {
+		/* failtest children share our file offset: pread doesn't. */
+		if (in->pos >= 0)
+			r = pread(in->fd, in->buf + in->used,
+				  in->size - in->used, in->pos);
+		else
+			r = read(in->fd, in->buf + in->used,
+				 in->size - in->used);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0)
+		barf_perror("Reading script");
+
+	if (in->pos >= 0)
+		in->pos += r;
+	in->used += r;
+	return r != 0;
+}
 
-	for (p = file; p < file + size; p += len+1) {
-		len = strcspn(p, "\n");
-		p[len] = '\0';
-		process_line(file, p - file);
+/* Set *off to the start of the next line, nul-terminated in in->buf. */
+static bool next_line(struct script_input *in, unsigned int *off)
+{
+	char *nl;
+
+	while (!(nl = memchr(in->buf + in->start, '\n',
+			     in->used - in->start))) {
+		if (!read_more(in)) {
+			if (in->start == in->used)
+				return false;
+			/* Last line has no newline: buf has room for a nul. */
+			nl = in->buf + in->used;
+			break;
+		}
 	}
+
+	*nl = '\0';
+	*off = in->start;
+	in->start = min_t(size_t, nl - in->buf + 1, in->used);
+	return true;
 }
 
-void tui_run(int fd)
+static void run_whole_file(int fd)
 {
-	tui_register_command("exit", tui_exit, tui_exit_help);
-	tui_register_command("quit", tui_exit, tui_exit_help);
-	tui_register_command("q", tui_exit, tui_exit_help);
-	tui_register_command("test", tui_argtest, NULL);
-	tui_register_command("help", tui_help, tui_help_help);
+	struct script_input in;
+	unsigned int off;
+
+	in.fd = fd;
+	in.size = TUI_READ_CHUNK;
+	in.buf = talloc_array(NULL, char, in.size + 1);
+	in.start = in.used = 0;
+	in.pos = lseek(fd, 0, SEEK_CUR);
+
+	/* A failtest child would eat the rest of a pipe: slurp it now. */
+	if (in.pos < 0 && get_failtest())
+		while (read_more(&in));
 
+	while (next_line(&in, &off))
+		tui_process_line(in.buf, off);
+	talloc_free(in.buf);
+
+	if (script_recording())
+		script_fail("for or repeat without done");
+}
+
+void tui_run(int fd)
+{
 	if (fd == STDIN_FILENO) {
 		stop = false;
 		rl_callback_handler_install(tui_quiet ? "" : "> ",
@@ -443,6 +540,7 @@ int tui_register_command(const char *command,
 			 void (*helpfn)(int, char **))
 {
 	struct command *cmd;
+	unsigned int hash;
 
 	assert(strlen(command) < TUI_MAX_CMD_LEN);
 
@@ -453,7 +551,21 @@ int tui_register_command(const char *command,
 
 	list_add(&cmd->list, &commands);
 
+	/* Later registrations shadow earlier ones of the same name. */
+	hash = command_hashfn(cmd->name);
+	cmd->hash_next = command_hash[hash];
+	command_hash[hash] = cmd;
+
 	return 0;
 }
 
+static void init(void)
+{
+	tui_register_command("exit", tui_exit, tui_exit_help);
+	tui_register_command("quit", tui_exit, tui_exit_help);
+	tui_register_command("q", tui_exit, tui_exit_help);
+	tui_register_command("test", tui_argtest, NULL);
+	tui_register_command("help", tui_help, tui_help_help);
+}
 
+init_call(init);
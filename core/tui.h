@@ -36,6 +36,10 @@ int tui_register_pre_post_hook(void (*pre)(const char *),
 
 void tui_run(int fd);
 
+/* Run one script line, starting at line + off.  line must be talloced:
+ * commands hang temporary allocations off it. */
+void tui_process_line(char *line, unsigned int off);
+
 bool tui_do_command(int argc, char *argv[], bool abort);
 
 /* Is this a valid command?  Sanity check for expect. */
@@ -46,6 +46,9 @@ void barf_perror(const char *fmt, ...) __attribute__((noreturn));
 void *grab_file(int fd, unsigned long *size);
 void release_file(void *data, unsigned long size);
 
+/* Monotonic clock in nanoseconds, for measuring how long things take. */
+uint64_t time_ns(void);
+
 /* Paste two tokens together. */
 #define ___cat(a,b) a ## b
 #define __cat(a,b) ___cat(a,b)
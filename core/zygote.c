@@ -0,0 +1,166 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Initialization (modules, setup script) is the same for every test: do it
+ * once, then fork a copy of the initialized simulator for each script. */
+
+#include "core.h"
+#include "tui.h"
+#include "log.h"
+#include "message.h"
+#include "utils.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+static bool zygote;
+static const char *setup_script;
+
+/*** XML Argument:
+    <section id="a:zygote">
+     <title><option>--zygote</option></title>
+     <subtitle>Run many scripts, initializing only once</subtitle>
+     <para>Instead of a single script, all the remaining arguments are
+     scripts to run.  nfsim initializes once (loading modules and running
+     any <option>--setup</option> script), then forks a copy of itself to
+     run each script in turn, as if it had been started afresh on that
+     script.  A summary line is printed for each script, and the exit
+     status is non-zero if any failed.</para>
+    </section>
+*/
+static void cmdline_zygote(struct option *opt)
+{
+	zygote = true;
+}
+cmdline_opt("zygote", 0, 0, cmdline_zygote);
+
+/*** XML Argument:
+    <section id="a:setup">
+     <title><option>--setup
+      <replaceable>script</replaceable></option></title>
+     <subtitle>Run a script before the real one</subtitle>
+     <para>Runs <replaceable>script</replaceable> once initialization is
+     complete, before the script (or, with <option>--zygote</option>,
+     scripts) given.  Failures are not inserted into the setup script by
+     <option>--failtest</option>.  Anything it leaves behind must be freed
+     when modules are unloaded, as for any other script.</para>
+    </section>
+*/
+static void cmdline_setup(struct option *opt)
+{
+	extern char *optarg;
+	if (!optarg)
+		barf("setup option requires an argument");
+	setup_script = optarg;
+}
+cmdline_opt("setup", 1, 0, cmdline_setup);
+
+bool zygote_mode(void)
+{
+	return zygote;
+}
+
+void run_setup_script(void)
+{
+	int fd;
+
+	if (!setup_script)
+		return;
+
+	fd = open(setup_script, O_RDONLY);
+	if (fd < 0)
+		barf_perror("Opening %s", setup_script);
+	tui_run(fd);
+	close(fd);
+
+	/* The real script starts at its own line 1. */
+	tui_linenum = 1;
+}
+
+static double elapsed(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec)
+		+ (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Returns true if the script passed. */
+static bool run_child(const char *script)
+{
+	struct timeval start;
+	int status, fd;
+	pid_t child;
+
+	gettimeofday(&start, NULL);
+	fflush(stdout);
+	nfsim_log_flush();
+	fflush(stderr);
+	child = fork();
+	if (child < 0)
+		barf_perror("zygote fork");
+
+	if (child == 0) {
+		fd = open(script, O_RDONLY);
+		if (fd < 0)
+			barf_perror("Opening %s", script);
+		nfsim_testname = script;
+		run_script(fd);
+		exit(EXIT_SUCCESS);
+	}
+
+	while (waitpid(child, &status, 0) < 0)
+		if (errno != EINTR)
+			barf_perror("zygote waitpid for %s", script);
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		nfsim_log(LOG_ALWAYS, "PASS %s (%.3fs)", script,
+			  elapsed(&start));
+		return true;
+	}
+
+	if (WIFSIGNALED(status))
+		nfsim_log(LOG_ALWAYS, "FAIL %s (signal %i, %.3fs)", script,
+			  WTERMSIG(status), elapsed(&start));
+	else
+		nfsim_log(LOG_ALWAYS, "FAIL %s (exit %i, %.3fs)", script,
+			  WEXITSTATUS(status), elapsed(&start));
+	return false;
+}
+
+int zygote_run(int num, char *scripts[])
+{
+	int i, failed = 0;
+
+	for (i = 0; i < num; i++)
+		if (!run_child(scripts[i]))
+			failed++;
+
+	nfsim_log(LOG_ALWAYS, "%i scripts, %i failed", num, failed);
+
+	/* Children checked for leaks: we just stop any programs. */
+	message_cleanup();
+	return failed ? EXIT_SCRIPTFAIL : EXIT_SUCCESS;
+}
@@ -198,17 +198,21 @@ void schedule(void);
 #define sti()
 
 
-#define NR_CPUS 1
-#define num_possible_cpus() 1
-#define for_each_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+/* We simulate nfsim_cpus CPUs (--cpus): packets are spread over them
+ * (--cpu-policy), one at a time, and nfsim_cpu is the one running now. */
+#define NR_CPUS 256
+extern unsigned int nfsim_cpus, nfsim_cpu;
+#define num_possible_cpus() nfsim_cpus
+#define num_online_cpus() nfsim_cpus
+#define for_each_cpu(cpu) for ((cpu) = 0; (cpu) < nfsim_cpus; (cpu)++)
 #define for_each_possible_cpu	for_each_cpu
 #define  SMP_CACHE_BYTES (1<<7)
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,5,0)
-#define cpu_possible(cpu)	((cpu) == 0)
+#define cpu_possible(cpu)	((cpu) < nfsim_cpus)
 #endif
-#define smp_processor_id()	0
+#define smp_processor_id()	nfsim_cpu
 #define raw_smp_processor_id()	smp_processor_id()
-#define highest_possible_processor_id()	0
+#define highest_possible_processor_id()	(nfsim_cpus - 1)
 #define PAGE_SHIFT      12
 #define PAGE_SIZE	(1UL << PAGE_SHIFT)
 #define PAGE_MASK	(~(PAGE_SIZE-1))
@@ -320,7 +324,8 @@ typedef struct { volatile int counter; } atomic_t;
 
 #define atomic_read(v)		((v)->counter)
 #define atomic_set(v,i)         (((v)->counter) = (i))
-#define atomic_add(v,i)         (((v)->counter) += (i))
+#define atomic_add(i,v)		__sync_add_and_fetch(&(v)->counter, (i))
+#define atomic_sub(i,v)		__sync_sub_and_fetch(&(v)->counter, (i))
 
 void atomic_inc(atomic_t *v);
 void atomic_dec(atomic_t *v);
@@ -560,6 +565,7 @@ struct net_device_stats {
 
 struct net_device {
 	struct list_head entry;
+	struct net_device *name_next;
 
 	char name[IFNAMSIZ];
 	int ifindex;
@@ -1041,7 +1047,8 @@ struct sockaddr_in {
 /* route.h */
 #define RTO_CONN	0
 
-#define ip_rt_put(rt)
+#define ip_rt_put(rt) \
+	do { if (rt) dst_release(&(rt)->u.dst); } while (0)
 
 /* notifier.h */
 struct notifier_block
@@ -1195,6 +1202,8 @@ struct dst_entry
 
 	struct net_device       *dev;
 
+	/* Routing cache entries can go once nobody holds them. */
+	atomic_t		__refcnt;
 	unsigned long		lastuse;
 	unsigned long		expires;
 
@@ -1221,8 +1230,10 @@ u32 dst_pmtu(struct dst_entry *dst);
 /* 2.6.12 changes dst_pmtu to dst_mtu... */
 #define dst_mtu dst_pmtu
 
-#define dst_release(x)
-#define dst_hold(x)
+#define dst_release(x) \
+	do { struct dst_entry *__d = (x); \
+	     if (__d) atomic_dec(&__d->__refcnt); } while (0)
+#define dst_hold(x) atomic_inc(&(x)->__refcnt)
 
 int dst_output(struct sk_buff *skb);
 int dst_input(struct sk_buff *skb);
@@ -1532,12 +1543,29 @@ static struct module __this __attribute__((unused)) = { .name = __stringify(KBUI
 #define THIS_MODULE (&__this)
 #else
 /* constructor and destructor attributes are useless here: their order isn't
- * defined 8( */
+ * defined 8(  Builtin modules record their name too, so insmod and rmmod
+ * can treat them like loadable ones. */
+struct builtin_initcall {
+	const char *name;
+	initcall_t fn;
+};
+struct builtin_exitcall {
+	const char *name;
+	exitcall_t fn;
+};
+#ifdef KBUILD_MODNAME
+static struct module __this __attribute__((unused)) = { .name = __stringify(KBUILD_MODNAME) };
+#define THIS_MODULE (&__this)
+#define __builtin_modname __stringify(KBUILD_MODNAME)
+#else
+/* Part of nfsim itself: always there. */
+#define THIS_MODULE NULL
+#define __builtin_modname NULL
+#endif
 #define module_init(fn) \
-	static initcall_t __attribute__((unused, section("module_init"))) __module_init = (fn)
+	static struct builtin_initcall __attribute__((used, section("module_init"))) __module_init = { __builtin_modname, (fn) }
 #define module_exit(fn) \
-	static exitcall_t __attribute__((unused, section("module_exit"))) __module_exit = (fn)
-#define THIS_MODULE NULL
+	static struct builtin_exitcall __attribute__((used, section("module_exit"))) __module_exit = { __builtin_modname, (fn) }
 #endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,5,0)
@@ -1545,7 +1573,7 @@ static struct module __this __attribute__((unused)) = { .name = __stringify(KBUI
 #define MOD_DEC_USE_COUNT __MOD_DEC_USE_COUNT(THIS_MODULE)
 void __MOD_DEC_USE_COUNT(struct module *mod);
 void __MOD_INC_USE_COUNT(struct module *mod);
-#define smp_num_cpus NR_CPUS
+#define smp_num_cpus nfsim_cpus
 #endif
 
 #include <core.h>
@@ -1553,12 +1581,12 @@ void __MOD_INC_USE_COUNT(struct module *mod);
 #include <proc_stuff.h>
 
 /* percpu.h */
-#define DEFINE_PER_CPU(type, name)	 __typeof__(type) per_cpu__##name
+#define DEFINE_PER_CPU(type, name)	 __typeof__(type) per_cpu__##name[NR_CPUS]
 
-#define per_cpu(var, cpu)		(*((void)cpu, &per_cpu__##var))
-#define __get_cpu_var(var)		per_cpu__##var
+#define per_cpu(var, cpu)		(per_cpu__##var[(cpu)])
+#define __get_cpu_var(var)		per_cpu__##var[smp_processor_id()]
 
-#define DECLARE_PER_CPU(type, name)	extern __typeof__(type) per_cpu__##name
+#define DECLARE_PER_CPU(type, name)	extern __typeof__(type) per_cpu__##name[NR_CPUS]
 
 #define EXPORT_PER_CPU_SYMBOL(var) EXPORT_SYMBOL(per_cpu__##var)
 #define EXPORT_PER_CPU_SYMBOL_GPL(var) EXPORT_SYMBOL_GPL(per_cpu__##var)
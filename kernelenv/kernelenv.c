@@ -23,6 +23,10 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "utils.h"
 #include "tui.h"
 #include "field.h"
+#include "metrics.h"
+#include "trace.h"
+#include "symbol.h"
+#include "smp.h"
 
 /* Root of talloc trees for different allocators */
 void *__skb_ctx, *__vmalloc_ctx, *__kmalloc_ctx, *__kmalloc_atomic_ctx, *__kmem_cache_ctx, *__lock_ctx, *__timer_ctx;
@@ -187,6 +191,7 @@ struct sk_buff *alloc_skb(unsigned int size, int priority)
 
 void kfree_skb(struct sk_buff *skb)
 {
+	trace_packet(TRACE_FREE, skb->seq, skb, NULL, NULL, NULL, 0, 0, 0);
 #ifdef CONFIG_NETFILTER
 	nf_conntrack_put(skb->nfct);
 #endif
@@ -289,8 +294,9 @@ void copy_skb_header(struct sk_buff *new, const struct sk_buff *old)
 	nf_conntrack_get(new->nfct);
 	
 
-	/* dst_clone() ? */
 	__copy(dst);
+	if (new->dst)
+		dst_hold(new->dst);
 
 	new->h.raw  = old->h.raw  + offset;
 	new->nh.raw = old->nh.raw + offset;
@@ -671,6 +677,7 @@ void __generic_write_lock(spinlock_t *lock, const char *location)
 		        location, lock->location);
 	lock->lock = -1;
 	lock->location = talloc_strdup(__lock_ctx, location);
+	smp_lock_taken(lock, location, true);
 }
 
 void __generic_write_unlock(spinlock_t *lock, const char *location)
@@ -692,6 +699,7 @@ void __generic_read_lock(spinlock_t *lock, const char *location)
 	lock->lock++;
 	talloc_free(lock->location);
 	lock->location = talloc_strdup(__lock_ctx, location);
+	smp_lock_taken(lock, location, false);
 }
 
 void __generic_read_unlock(spinlock_t *lock, const char *location)
@@ -840,6 +848,7 @@ uint32_t __div64_32(uint64_t *n, uint32_t base)
 /* timer */
 LIST_HEAD(__timers);
 LIST_HEAD(__running_timers);
+static unsigned long timers_added, timers_deleted, timers_run;
 
 void __init_timer(struct timer_list * timer, struct module *owner,
 	const char *function)
@@ -859,6 +868,7 @@ void __add_timer(struct timer_list *timer, const char *location)
 	}
 	list_add_tail(&timer->entry, &t->entry);
 	timer->use = talloc_strdup(__timer_ctx, location);
+	timers_added++;
 }
 
 int __del_timer(struct timer_list *timer, const char *location)
@@ -876,6 +886,7 @@ int __del_timer(struct timer_list *timer, const char *location)
 	list_del(&timer->entry);
 	talloc_free(timer->use);
 	timer->use = NULL;
+	timers_deleted++;
 
 	return 1;
 }
@@ -887,6 +898,7 @@ bool do_running_timers(void)
 	list_for_each_entry_safe(t, next, &__running_timers, entry) {
 		list_del(&t->entry);
 		talloc_free(t->use);
+		timers_run++;
 		t->function(t->data);
 		ret = true;
 	}
@@ -939,16 +951,42 @@ void increment_time(unsigned int inc)
 		t = list_entry(i, struct timer_list, entry);
 		if (time_before(jiffies, t->expires))
 			break;
-		nfsim_log(LOG_UI, "running timer to %s:%s()", t->owner->name,
-			t->ownerfunction, t->function);
+		nfsim_log(LOG_UI, "running timer to %s:%s() %s", t->owner->name,
+			t->ownerfunction, symbolize(t->function));
 		i = i->next;
 		list_del(&t->entry);
 		talloc_free(t->use);
 		t->use = NULL;
+		timers_run++;
 		t->function(t->data);
 	}
 }
 
+static void collect_timers_pending(struct metric_sink *sink)
+{
+	struct timer_list *t;
+	unsigned long pending = 0;
+
+	list_for_each_entry(t, &__timers, entry)
+		pending++;
+	metric_value(sink, pending, NULL);
+}
+
+static struct metric timer_metrics[] = {
+	{ .name = "nfsim_timers_added_total", .type = "counter",
+	  .help = "Timers added by add_timer and mod_timer.",
+	  .value = &timers_added },
+	{ .name = "nfsim_timers_deleted_total", .type = "counter",
+	  .help = "Pending timers removed by del_timer.",
+	  .value = &timers_deleted },
+	{ .name = "nfsim_timers_run_total", .type = "counter",
+	  .help = "Timer functions run.",
+	  .value = &timers_run },
+	{ .name = "nfsim_timers_pending", .type = "gauge",
+	  .help = "Timers waiting to expire.",
+	  .collect = collect_timers_pending },
+};
+
 /* notifier */
 /*static rwlock_t notifier_lock = RW_LOCK_UNLOCKED;*/
 
@@ -1243,6 +1281,64 @@ int request_module(const char * name, ...)
 	return 0;
 }
 
+/* Memory still held by the kernel code, by allocator. */
+static void collect_memory(struct metric_sink *sink, bool bytes)
+{
+	const struct { const char *pool; void **ctx; } pools[] = {
+		{ "skb", &__skb_ctx },
+		{ "kmalloc", &__kmalloc_ctx },
+		{ "kmalloc_atomic", &__kmalloc_atomic_ctx },
+		{ "vmalloc", &__vmalloc_ctx },
+		{ "kmem_cache", &__kmem_cache_ctx },
+		{ "timer", &__timer_ctx },
+	};
+	unsigned int i;
+
+	/* Don't count the (one byte) context itself. */
+	for (i = 0; i < ARRAY_SIZE(pools); i++)
+		metric_value(sink, (bytes ? talloc_total_size(*pools[i].ctx)
+				    : talloc_total_blocks(*pools[i].ctx)) - 1,
+			     "pool=\"%s\"", pools[i].pool);
+}
+
+static void collect_memory_bytes(struct metric_sink *sink)
+{
+	collect_memory(sink, true);
+}
+
+static void collect_memory_blocks(struct metric_sink *sink)
+{
+	collect_memory(sink, false);
+}
+
+static void collect_skbs_allocated(struct metric_sink *sink)
+{
+	metric_value(sink, nfsim_seq, NULL);
+}
+
+static struct metric memory_metrics[] = {
+	{ .name = "nfsim_kernel_memory_bytes", .type = "gauge",
+	  .help = "Bytes allocated by kernel code and not yet freed.",
+	  .collect = collect_memory_bytes },
+	{ .name = "nfsim_kernel_memory_blocks", .type = "gauge",
+	  .help = "Allocations by kernel code not yet freed.",
+	  .collect = collect_memory_blocks },
+	{ .name = "nfsim_skbs_allocated_total", .type = "counter",
+	  .help = "Socket buffers allocated.",
+	  .collect = collect_skbs_allocated },
+};
+
+static void kernelenv_metrics_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(memory_metrics); i++)
+		metric_register(&memory_metrics[i]);
+	for (i = 0; i < ARRAY_SIZE(timer_metrics); i++)
+		metric_register(&timer_metrics[i]);
+}
+init_call(kernelenv_metrics_init);
+
 void kernelenv_init(void)
 {
 	__vmalloc_ctx = talloc_named_const(nfsim_tallocs, 1, "vmallocs");
@@ -1262,17 +1358,17 @@ int IS_ERR(const void *ptr)
 
 void atomic_inc(atomic_t *v)
 {
-	v->counter++;
+	__sync_add_and_fetch(&v->counter, 1);
 }
 
 void atomic_dec(atomic_t *v)
 {
-	v->counter--;
+	__sync_sub_and_fetch(&v->counter, 1);
 }
 
 int atomic_dec_and_test(atomic_t *v)
 {
-	return (--(v->counter) == 0);
+	return __sync_sub_and_fetch(&v->counter, 1) == 0;
 }
 
 /* lib/string.c */
@@ -0,0 +1,503 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Throughput benchmark: push lots of generated packets through the
+ * stack, and see how long the hooks take. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <core.h>
+#include <tui.h>
+#include <log.h>
+#include <utils.h>
+#include <symbol.h>
+#include <linux/netfilter_ipv4.h>
+#include "gen_ip.h"
+
+struct proto_weight {
+	int proto;
+	unsigned int weight;
+};
+
+struct bench_params {
+	unsigned long count;
+	unsigned int flows;
+	struct proto_weight protos[3];
+	unsigned int num_protos, total_weight;
+	unsigned int *sizes;
+	unsigned int num_sizes;
+	u_int32_t saddr, daddr;
+	u_int16_t dport;
+	struct net_device *dev;
+	bool hooks;
+	const char *json;
+};
+
+struct hook_stat {
+	const struct nf_hook_ops *ops;
+	unsigned int hooknum;
+	unsigned long calls;
+	uint64_t ns;
+};
+
+static struct hook_stat *hook_stats;
+static unsigned int num_hook_stats;
+
+static void bench_hook_timer(const struct nf_hook_ops *ops,
+			     unsigned int hooknum, uint64_t ns)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_hook_stats; i++) {
+		if (hook_stats[i].ops == ops) {
+			hook_stats[i].calls++;
+			hook_stats[i].ns += ns;
+			return;
+		}
+	}
+}
+
+/* Set up hook statistics now, so we don't allocate while timing. */
+static void init_hook_stats(void *ctx)
+{
+	struct nf_hook_ops *ops;
+	unsigned int h;
+
+	num_hook_stats = 0;
+	for (h = 0; h < NF_MAX_HOOKS; h++)
+		list_for_each_entry(ops, &nf_hooks[PF_INET][h], list)
+			num_hook_stats++;
+
+	hook_stats = talloc_zero_array(ctx, struct hook_stat, num_hook_stats);
+	num_hook_stats = 0;
+	for (h = 0; h < NF_MAX_HOOKS; h++) {
+		list_for_each_entry(ops, &nf_hooks[PF_INET][h], list) {
+			hook_stats[num_hook_stats].ops = ops;
+			hook_stats[num_hook_stats].hooknum = h;
+			num_hook_stats++;
+		}
+	}
+}
+
+static const char *hook_owner(const struct hook_stat *stat)
+{
+	return stat->ops->owner ? stat->ops->owner->name : "nfsim";
+}
+
+static bool parse_protos(struct bench_params *p, char *arg)
+{
+	char *tok;
+
+	p->num_protos = p->total_weight = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		char *colon = strchr(tok, ':');
+		int weight = 1;
+
+		if (colon) {
+			*colon = '\0';
+			weight = string_to_number(colon + 1, 1, 1000);
+			if (weight < 0) {
+				nfsim_log(LOG_ALWAYS, "Bad weight `%s'",
+					  colon + 1);
+				return false;
+			}
+		}
+		if (p->num_protos == ARRAY_SIZE(p->protos)) {
+			nfsim_log(LOG_ALWAYS, "Too many protocols");
+			return false;
+		}
+		if (strcasecmp(tok, "tcp") == 0)
+			p->protos[p->num_protos].proto = IPPROTO_TCP;
+		else if (strcasecmp(tok, "udp") == 0)
+			p->protos[p->num_protos].proto = IPPROTO_UDP;
+		else if (strcasecmp(tok, "icmp") == 0)
+			p->protos[p->num_protos].proto = IPPROTO_ICMP;
+		else {
+			nfsim_log(LOG_ALWAYS, "Unknown protocol `%s'", tok);
+			return false;
+		}
+		p->protos[p->num_protos++].weight = weight;
+		p->total_weight += weight;
+	}
+	return p->num_protos != 0;
+}
+
+static bool parse_sizes(struct bench_params *p, void *ctx, char *arg)
+{
+	char *tok;
+
+	p->num_sizes = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		int size = string_to_number(tok, 0, 1400);
+
+		if (size < 0) {
+			nfsim_log(LOG_ALWAYS, "Bad size `%s' (0 to 1400)", tok);
+			return false;
+		}
+		p->sizes = talloc_realloc(ctx, p->sizes, unsigned int,
+					  p->num_sizes + 1);
+		p->sizes[p->num_sizes++] = size;
+	}
+	return p->num_sizes != 0;
+}
+
+static bool parse_addr(u_int32_t *addr, const char *str)
+{
+	const struct in_addr *in = dotted_to_addr(str);
+
+	if (!in) {
+		nfsim_log(LOG_ALWAYS, "Bad address `%s'", str);
+		return false;
+	}
+	*addr = in->s_addr;
+	return true;
+}
+
+static bool parse_params(struct bench_params *p, void *ctx,
+			 int argc, char **argv)
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "COUNT=", 6) == 0) {
+			p->count = strtoul(argv[i] + 6, NULL, 0);
+			if (!p->count)
+				return false;
+		} else if (strncmp(argv[i], "FLOWS=", 6) == 0) {
+			int flows = string_to_number(argv[i] + 6, 1, INT_MAX);
+			if (flows < 0)
+				return false;
+			p->flows = flows;
+		} else if (strncmp(argv[i], "PROTO=", 6) == 0) {
+			if (!parse_protos(p, argv[i] + 6))
+				return false;
+		} else if (strncmp(argv[i], "SIZE=", 5) == 0) {
+			if (!parse_sizes(p, ctx, argv[i] + 5))
+				return false;
+		} else if (strncmp(argv[i], "SRC=", 4) == 0) {
+			if (!parse_addr(&p->saddr, argv[i] + 4))
+				return false;
+		} else if (strncmp(argv[i], "DST=", 4) == 0) {
+			if (!parse_addr(&p->daddr, argv[i] + 4))
+				return false;
+		} else if (strncmp(argv[i], "DPORT=", 6) == 0) {
+			int dport = string_to_number(argv[i] + 6, 1, 65535);
+			if (dport < 0)
+				return false;
+			p->dport = dport;
+		} else if (strncmp(argv[i], "IF=", 3) == 0) {
+			p->dev = interface_by_name(argv[i] + 3);
+			if (!p->dev) {
+				nfsim_log(LOG_ALWAYS, "No interface '%s'",
+					  argv[i] + 3);
+				return false;
+			}
+		} else if (streq(argv[i], "NOHOOKS")) {
+			p->hooks = false;
+		} else if (streq(argv[i], "JSON")) {
+			p->json = "-";
+		} else if (strncmp(argv[i], "JSON=", 5) == 0) {
+			p->json = argv[i] + 5;
+		} else {
+			nfsim_log(LOG_ALWAYS, "Unknown argument `%s'", argv[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Which protocol does this flow use?  Spread by weight. */
+static int flow_proto(const struct bench_params *p, unsigned int flow)
+{
+	unsigned int i, w = flow % p->total_weight;
+
+	for (i = 0; w >= p->protos[i].weight; i++)
+		w -= p->protos[i].weight;
+	return p->protos[i].proto;
+}
+
+/* Fill in packet number n: returns IP length. */
+static unsigned int fill_packet(struct packet *packet,
+				const struct bench_params *p,
+				unsigned long n, u_int32_t *next_seq)
+{
+	unsigned int flow = n % p->flows;
+	struct packet_desc desc = { .datalen = p->sizes[n % p->num_sizes] };
+
+	desc.protocol = flow_proto(p, flow);
+	desc.saddr = htonl(ntohl(p->saddr) + flow / 60000);
+	desc.daddr = p->daddr;
+	desc.sport = 1024 + flow % 60000;
+	desc.dport = p->dport;
+
+	switch (desc.protocol) {
+	case IPPROTO_TCP:
+		desc.window = 65535;
+		/* First packet of each flow opens it. */
+		if (n < p->flows) {
+			desc.syn = true;
+			desc.seq = flow;
+			next_seq[flow] = flow + 1;
+		} else {
+			desc.ack = true;
+			desc.seq = next_seq[flow];
+			next_seq[flow] += desc.datalen;
+		}
+		break;
+	case IPPROTO_ICMP:
+		desc.sport = flow;
+		desc.dport = n / p->flows;
+		break;
+	}
+	return build_packet(packet, &desc);
+}
+
+/* Same layout as gen_ip's send_packet. */
+static struct sk_buff *packet_skb(const struct packet *packet,
+				  unsigned int iplen, struct net_device *dev)
+{
+	struct sk_buff *skb;
+	int len;
+
+	len = offsetof(struct packet, iph) + packet->iph.ihl*4;
+	skb = nfsim_nonlinear_skb(packet, len, (void *)packet + len,
+				  offsetof(struct packet, iph) + iplen - len);
+	skb->mac.ethernet = (void *)skb->data + offsetof(struct packet, ehdr);
+	skb->nh.iph       = (void *)skb->data + offsetof(struct packet, iph);
+	skb->protocol = skb->mac.ethernet->h_proto;
+	skb->h.raw = NULL;
+	skb->dev = dev;
+	return skb;
+}
+
+static void report_text(const struct bench_params *p, uint64_t ns,
+			unsigned long allocs)
+{
+	unsigned int i;
+
+	nfsim_log(LOG_ALWAYS, "bench: %lu packets, %u flows in %.6f seconds",
+		  p->count, p->flows, ns / 1e9);
+	nfsim_log(LOG_ALWAYS,
+		  "bench: %.0f packets/sec, %.1f ns/packet, %.2f allocs/packet",
+		  p->count / (ns / 1e9), (double)ns / p->count,
+		  (double)allocs / p->count);
+
+	for (i = 0; i < num_hook_stats; i++) {
+		const struct hook_stat *s = &hook_stats[i];
+
+		if (!s->calls)
+			continue;
+		nfsim_log(LOG_ALWAYS,
+			  "bench: %s %s %s %i: %lu calls, %.1f ns/call,"
+			  " %.1f ns/packet",
+			  nf_hooknames[PF_INET][s->hooknum], hook_owner(s),
+			  symbolize(s->ops->hook), s->ops->priority, s->calls,
+			  (double)s->ns / s->calls, (double)s->ns / p->count);
+	}
+}
+
+static bool report_json(const struct bench_params *p, uint64_t ns,
+			unsigned long allocs)
+{
+	unsigned int i;
+	char *json;
+	const char *sep = "";
+
+	json = talloc_asprintf(NULL, "{\"packets\": %lu, \"flows\": %u,"
+			       " \"seconds\": %.6f, \"packets_per_sec\": %.0f,"
+			       " \"ns_per_packet\": %.1f,"
+			       " \"allocs_per_packet\": %.2f, \"hooks\": [",
+			       p->count, p->flows, ns / 1e9,
+			       p->count / (ns / 1e9), (double)ns / p->count,
+			       (double)allocs / p->count);
+	for (i = 0; i < num_hook_stats; i++) {
+		const struct hook_stat *s = &hook_stats[i];
+
+		if (!s->calls)
+			continue;
+		json = talloc_asprintf_append(json, "%s{\"hook\": \"%s\","
+					      " \"owner\": \"%s\","
+					      " \"function\": \"%s\","
+					      " \"priority\": %i,"
+					      " \"calls\": %lu,"
+					      " \"ns_per_call\": %.1f,"
+					      " \"ns_per_packet\": %.1f}",
+					      sep,
+					      nf_hooknames[PF_INET][s->hooknum],
+					      hook_owner(s),
+					      symbolize(s->ops->hook),
+					      s->ops->priority,
+					      s->calls,
+					      (double)s->ns / s->calls,
+					      (double)s->ns / p->count);
+		sep = ", ";
+	}
+	json = talloc_asprintf_append(json, "]}");
+
+	if (streq(p->json, "-"))
+		nfsim_log(LOG_ALWAYS, "%s", json);
+	else {
+		FILE *f = fopen(p->json, "w");
+
+		if (!f) {
+			nfsim_log(LOG_ALWAYS, "Opening %s: %s",
+				  p->json, strerror(errno));
+			talloc_free(json);
+			return false;
+		}
+		fprintf(f, "%s\n", json);
+		fclose(f);
+	}
+	talloc_free(json);
+	return true;
+}
+
+static void bench_help(int argc, char **argv)
+{
+#include "bench-help:bench"
+/*** XML Help:
+    <section id="c:bench">
+     <title><command>bench</command></title>
+     <para>Measure how fast packets go through the hooks</para>
+     <cmdsynopsis>
+      <command>bench</command>
+      <arg choice="opt">COUNT=<replaceable>packets</replaceable></arg>
+      <arg choice="opt">FLOWS=<replaceable>flows</replaceable></arg>
+      <arg choice="opt">PROTO=<replaceable>proto</replaceable>[:<replaceable>weight</replaceable>],...</arg>
+      <arg choice="opt">SIZE=<replaceable>bytes</replaceable>,...</arg>
+      <arg choice="opt">SRC=<replaceable>address</replaceable></arg>
+      <arg choice="opt">DST=<replaceable>address</replaceable></arg>
+      <arg choice="opt">DPORT=<replaceable>port</replaceable></arg>
+      <arg choice="opt">IF=<replaceable>interface</replaceable></arg>
+      <arg choice="opt">NOHOOKS</arg>
+      <arg choice="opt">JSON<arg choice="opt">=<replaceable>file</replaceable></arg></arg>
+     </cmdsynopsis>
+     <para><command>bench</command> generates
+     <replaceable>packets</replaceable> packets (default 10000) and
+     sends each one through the stack, received on
+     <replaceable>interface</replaceable> or, if none is given, as if
+     from the local host, like <command>gen_ip</command>.  Logging
+     and failure injection are turned off while it runs, so
+     <command>expect</command> will not see these packets.</para>
+
+     <para>Packets are spread over <replaceable>flows</replaceable>
+     flows (default 1), each with its own source port (and source
+     address, past 60000 flows).  Each flow uses one of the protocols
+     given (TCP, UDP or ICMP, default UDP), chosen in proportion to
+     their weights, eg. <arg>PROTO=tcp:8,udp:2</arg>.  The first TCP
+     packet of a flow is a SYN, the rest are ACKs.  Payload sizes are
+     used in turn from the <arg>SIZE=</arg> list (default 64).  The
+     defaults for source, destination and destination port are
+     192.168.0.2, 192.168.1.2 and 80.</para>
+
+     <para>Only the time spent in the stack is counted, not
+     generating packets.  Reported are packets per second, nanoseconds
+     and allocations per packet, and the calls and time of each hook
+     function.  Timing each hook adds a little to the total: use
+     <arg>NOHOOKS</arg> to leave it out.  <arg>JSON</arg> prints
+     the results as JSON instead, or writes them to
+     <replaceable>file</replaceable>.</para>
+    </section>
+*/
+}
+
+static bool bench(int argc, char **argv)
+{
+	struct bench_params p;
+	struct packet *packet;
+	u_int32_t *next_seq;
+	unsigned long n, allocs = 0;
+	uint64_t ns = 0;
+	void *ctx = talloc_named_const(NULL, 1, "bench");
+	bool ret = true;
+
+	p = ((struct bench_params) { .count = 10000, .flows = 1,
+				     .dport = 80, .hooks = true });
+	p.protos[0] = ((struct proto_weight) { IPPROTO_UDP, 1 });
+	p.num_protos = p.total_weight = 1;
+	p.sizes = talloc_array(ctx, unsigned int, 1);
+	p.sizes[0] = 64;
+	p.num_sizes = 1;
+	parse_addr(&p.saddr, "192.168.0.2");
+	parse_addr(&p.daddr, "192.168.1.2");
+
+	if (!parse_params(&p, ctx, argc, argv)) {
+		bench_help(0, NULL);
+		talloc_free(ctx);
+		return false;
+	}
+
+	packet = talloc(ctx, struct packet);
+	next_seq = talloc_zero_array(ctx, u_int32_t, p.flows);
+	if (p.hooks) {
+		init_hook_stats(ctx);
+		hook_timer = bench_hook_timer;
+	}
+
+	suppress_logging++;
+	suppress_failtest++;
+	for (n = 0; n < p.count; n++) {
+		struct sk_buff *skb;
+		unsigned long start_allocs;
+		uint64_t start;
+
+		skb = packet_skb(packet, fill_packet(packet, &p, n, next_seq),
+				 p.dev);
+		start_allocs = talloc_total_allocs();
+		start = time_ns();
+		if (p.dev)
+			nf_rcv(skb);
+		else
+			nf_rcv_local(skb);
+		ns += time_ns() - start;
+		allocs += talloc_total_allocs() - start_allocs;
+	}
+	suppress_failtest--;
+	suppress_logging--;
+	hook_timer = NULL;
+
+	/* Clock too coarse?  Don't divide by zero. */
+	if (!ns)
+		ns = 1;
+
+	if (!p.hooks)
+		num_hook_stats = 0;
+
+	if (p.json)
+		ret = report_json(&p, ns, allocs);
+	else
+		report_text(&p, ns, allocs);
+
+	hook_stats = NULL;
+	num_hook_stats = 0;
+	talloc_free(ctx);
+	return ret;
+}
+
+static void init(void)
+{
+	tui_register_command("bench", bench, bench_help);
+}
+
+init_call(init);
@@ -171,20 +171,19 @@ copy_printable(char *dst, const char *str)
 	return dst;
 }
 
-int gen_ip_data_length(unsigned int datanum, char *data[])
+int gen_ip_data(char *buf, unsigned int datanum, char *data[])
 {
-	char buf[1024], *p;
-	unsigned int i, len = 0;
+	char *p = buf;
+	unsigned int i;
 
 	for (i = 0; i < datanum; i++) {
-		p = copy_printable(buf, data[i]);
+		if (i > 0)
+			*(p++) = ' ';
+		p = copy_printable(p, data[i]);
 		if (!p)
 			return -1;
-		len += p - buf;
-		if (i > 0)
-			len++;
 	}
-	return len;
+	return p - buf;
 }
 
 static int parse_header(struct packet *packet,
@@ -349,7 +348,7 @@ parse_udp(struct packet *packet, int datalen, char *args[], char **dump_flags)
 	return udplen;
 }
 
-static int
+int
 parse_flags(const char *string, struct tcphdr *tcph)
 {
 	memset(tcph, 0, sizeof(*tcph));
@@ -551,6 +550,110 @@ parse_mac(const char *str, u_int8_t *mac)
 	return 1;
 }
 
+unsigned int build_packet(struct packet *packet,
+			  const struct packet_desc *desc)
+{
+	unsigned int len;
+	u_int16_t *check = NULL;
+	struct {
+		u_int32_t srcip, dstip;
+		u_int8_t mbz, protocol;
+		u_int16_t proto_len;
+	} pseudo_header;
+
+	memset(packet, 0, offsetof(struct packet, u));
+	packet->iph.version = 4;
+	packet->iph.ihl = 5;
+	packet->iph.ttl = 255;
+	packet->iph.protocol = desc->protocol;
+	packet->iph.saddr = desc->saddr;
+	packet->iph.daddr = desc->daddr;
+
+	switch (desc->protocol) {
+	case IPPROTO_TCP:
+		len = sizeof(packet->u.tcph) + desc->datalen;
+		memset(&packet->u, 0, len);
+		packet->u.tcph.source = htons(desc->sport);
+		packet->u.tcph.dest = htons(desc->dport);
+		packet->u.tcph.doff = sizeof(packet->u.tcph) / 4;
+		packet->u.tcph.syn = desc->syn;
+		packet->u.tcph.ack = desc->ack;
+		packet->u.tcph.fin = desc->fin;
+		packet->u.tcph.rst = desc->rst;
+		packet->u.tcph.seq = htonl(desc->seq);
+		packet->u.tcph.ack_seq = htonl(desc->ack_seq);
+		packet->u.tcph.window = htons(desc->window);
+		check = &packet->u.tcph.check;
+		break;
+	case IPPROTO_UDP:
+		len = sizeof(packet->u.udph) + desc->datalen;
+		memset(&packet->u, 0, len);
+		packet->u.udph.source = htons(desc->sport);
+		packet->u.udph.dest = htons(desc->dport);
+		packet->u.udph.len = htons(len);
+		check = &packet->u.udph.check;
+		break;
+	default:
+		len = sizeof(packet->u.icmph) + desc->datalen;
+		memset(&packet->u, 0, len);
+		packet->u.icmph.type = desc->reply ? ICMP_ECHOREPLY : ICMP_ECHO;
+		packet->u.icmph.un.echo.id = htons(desc->sport);
+		packet->u.icmph.un.echo.sequence = htons(desc->dport);
+		break;
+	}
+
+	if (desc->data)
+		memcpy((char *)&packet->u + len - desc->datalen, desc->data,
+		       desc->datalen);
+
+	if (!check) {
+		packet->u.icmph.checksum
+			= csum_fold(csum_partial(&packet->u, len, 0));
+	} else {
+		pseudo_header = ((typeof(pseudo_header))
+			{ packet->iph.saddr, packet->iph.daddr, 0,
+			  packet->iph.protocol, htons(len) });
+		*check = csum_fold(csum_partial(&packet->u, len,
+						csum_partial(&pseudo_header,
+							     sizeof(pseudo_header),
+							     0)));
+	}
+
+	packet->iph.tot_len = htons(sizeof(packet->iph) + len);
+	packet->iph.check = ~csum_partial(&packet->iph, sizeof(packet->iph),0);
+	packet->ehdr.h_proto = htons(ETH_P_IP);
+	return sizeof(packet->iph) + len;
+}
+
+bool packet_in_shard(const struct packet *packet)
+{
+	const struct iphdr *iph = &packet->iph;
+	const void *l4 = (const void *)iph + iph->ihl * 4;
+	u_int16_t sport = 0, dport = 0;
+
+	/* Fragments only have the addresses, so use them for all of them. */
+	if (iph->frag_off & htons(IP_MF|IP_OFFSET))
+		return shard_flow(iph->saddr, iph->daddr, iph->protocol, 0, 0);
+
+	switch (iph->protocol) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		/* Ports are the first thing in either header. */
+		sport = ntohs(((const struct udphdr *)l4)->source);
+		dport = ntohs(((const struct udphdr *)l4)->dest);
+		break;
+	case IPPROTO_ICMP: {
+		const struct icmphdr *icmph = l4;
+
+		/* Requests and replies share the id. */
+		if (icmph->type == ICMP_ECHO || icmph->type == ICMP_ECHOREPLY)
+			sport = ntohs(icmph->un.echo.id);
+		break;
+	}
+	}
+	return shard_flow(iph->saddr, iph->daddr, iph->protocol, sport, dport);
+}
+
 bool send_packet(const struct packet *packet, const char *interface,
 		 char *dump_flags)
 {
@@ -865,6 +968,12 @@ static bool gen_ip(int argc, char *argv[])
 		return false;
 	}
 
+	/* Another shard sends it. */
+	if (!packet_in_shard(&packet)) {
+		talloc_free(dump_flags);
+		return true;
+	}
+
 	return send_packet(&packet, interface, dump_flags);
 }
 
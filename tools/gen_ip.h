@@ -20,16 +20,40 @@ struct packet {
 bool parse_packet(struct packet *packet, int argc, char *argv[],
 		  char **dump_flags);
 
+/* A simple packet, for the traffic generators and tcpsession. */
+struct packet_desc {
+	u_int32_t saddr, daddr;		/* Network order. */
+	u_int8_t protocol;		/* TCP, UDP or ICMP (echo). */
+	u_int16_t sport, dport;		/* ICMP: id and sequence. */
+	bool syn, ack, fin, rst, reply;	/* TCP flags; ICMP: echo reply. */
+	u_int32_t seq, ack_seq;
+	u_int16_t window;
+	unsigned int datalen;
+	const void *data;		/* NULL for a zeroed payload. */
+};
+
+/* Fill in packet (with checksums) from desc: returns IP length. */
+unsigned int build_packet(struct packet *packet,
+			  const struct packet_desc *desc);
+
+/* Is packet's flow sent by this shard (see --shards)?  The generators
+ * skip the others' packets, as if they had been delivered. */
+bool packet_in_shard(const struct packet *packet);
+
 /* Send filled in packet. */
 bool send_packet(const struct packet *packet, const char *interface,
 		 char *dump_flags);
 
+/* Set TCP flags from string like SYN/ACK (zeroes rest of header): 0 = OK. */
+int parse_flags(const char *string, struct tcphdr *tcph);
+
 /* Convert string to number in this range: -1 for fail. */
 unsigned int string_to_number(const char *s, unsigned int min, unsigned int max);
 
 /* Convert string of form w.x.y.z to an address.  NULL on fail. */
 struct in_addr *dotted_to_addr(const char *dotted);
 
-/* How many bytes will this take up?  Used by tcpsession */
-int gen_ip_data_length(unsigned int datanum, char *data[]);
+/* Payload from DATA arguments (needs total strlen + datanum bytes):
+ * returns length, or -1 on bad escape.  Used by tcpsession */
+int gen_ip_data(char *buf, unsigned int datanum, char *data[]);
 #endif /* _NFSIM_GEN_IP_H */
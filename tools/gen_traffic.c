@@ -0,0 +1,684 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Generate traffic from many concurrent flows, with time passing. */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include <core.h>
+#include <tui.h>
+#include <log.h>
+#include <utils.h>
+#include "gen_ip.h"
+
+/* Zipf tables bigger than this are too slow to build. */
+#define MAX_ZIPF_RANGE (1 << 20)
+
+/* Payloads are zeroes, and never fragmented. */
+#define MAX_PAYLOAD 1400
+
+struct distribution {
+	u_int32_t base, range;
+	/* NULL for uniform, otherwise cumulative probabilities. */
+	double *cdf;
+};
+
+enum size_dist { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+
+struct traffic {
+	u_int64_t rng;
+	unsigned int max_flows, total_flows;
+	double rate, gap, mean_packets;
+	struct distribution src, dst, dport;
+	unsigned int weights[3], total_weight;
+	enum size_dist size_dist;
+	unsigned int size_min, size_max;
+	const char *client_if, *server_if;
+	bool replies;
+
+	/* Flows waiting to send, earliest first. */
+	struct flow **heap;
+	unsigned int num_active;
+	unsigned long packets;
+};
+
+enum flow_state {
+	SEND_SYN, SEND_SYNACK, SEND_ACK, SEND_DATA,
+	SEND_FIN, SEND_FINACK, SEND_LASTACK, FLOW_DONE
+};
+
+struct flow {
+	double when;
+	enum flow_state state;
+	u_int8_t protocol;
+	u_int32_t client, server;
+	u_int16_t sport, dport;
+	u_int32_t client_seq, server_seq;
+	unsigned int data_left, echo_seq;
+	/* Another shard sends this flow's packets. */
+	bool elsewhere;
+};
+
+static const u_int8_t protos[3] = { IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP };
+
+/* xorshift64*: we want the same traffic for the same seed everywhere. */
+static u_int64_t random64(struct traffic *t)
+{
+	t->rng ^= t->rng >> 12;
+	t->rng ^= t->rng << 25;
+	t->rng ^= t->rng >> 27;
+	return t->rng * 2685821657736338717ULL;
+}
+
+/* In [0, 1). */
+static double random_unit(struct traffic *t)
+{
+	return (random64(t) >> 11) / 9007199254740992.0;
+}
+
+static double random_exp(struct traffic *t, double mean)
+{
+	return -mean * log(1.0 - random_unit(t));
+}
+
+static u_int32_t pick(struct traffic *t, const struct distribution *d)
+{
+	unsigned int lo = 0, hi = d->range - 1;
+	double r;
+
+	if (!d->cdf)
+		return d->base + random64(t) % d->range;
+
+	r = random_unit(t);
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (d->cdf[mid] <= r)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return d->base + lo;
+}
+
+/* "uniform" or "zipf[:exponent]": value number i has weight 1/(i+1)^s. */
+static bool parse_distribution(void *ctx, struct distribution *d,
+			       const char *str)
+{
+	double s = 1.0, total = 0;
+	unsigned int i;
+
+	if (streq(str, "uniform")) {
+		d->cdf = NULL;
+		return true;
+	}
+	if (!strstarts(str, "zipf")) {
+		nfsim_log(LOG_ALWAYS, "Unknown distribution `%s'", str);
+		return false;
+	}
+	if (str[4] == ':') {
+		s = atof(str + 5);
+		if (s <= 0) {
+			nfsim_log(LOG_ALWAYS, "Bad zipf exponent `%s'", str+5);
+			return false;
+		}
+	} else if (str[4]) {
+		nfsim_log(LOG_ALWAYS, "Unknown distribution `%s'", str);
+		return false;
+	}
+	if (d->range > MAX_ZIPF_RANGE) {
+		nfsim_log(LOG_ALWAYS, "Range too large for zipf (max %u)",
+			  MAX_ZIPF_RANGE);
+		return false;
+	}
+
+	d->cdf = talloc_array(ctx, double, d->range);
+	for (i = 0; i < d->range; i++) {
+		total += 1.0 / pow(i + 1, s);
+		d->cdf[i] = total;
+	}
+	for (i = 0; i < d->range; i++)
+		d->cdf[i] /= total;
+	return true;
+}
+
+/* a.b.c.d/bits */
+static bool parse_network(struct distribution *d, const char *str)
+{
+	char *slash = strchr(str, '/');
+	const struct in_addr *addr;
+	int bits = 32;
+
+	if (slash) {
+		char *dotted = talloc_strndup(NULL, str, slash - str);
+		addr = dotted_to_addr(dotted);
+		talloc_free(dotted);
+		bits = string_to_number(slash + 1, 8, 32);
+	} else
+		addr = dotted_to_addr(str);
+	if (!addr || bits < 0) {
+		nfsim_log(LOG_ALWAYS, "Bad network `%s'", str);
+		return false;
+	}
+	d->range = 1U << (32 - bits);
+	d->base = ntohl(addr->s_addr) & ~(d->range - 1);
+	/* Avoid the network and broadcast addresses. */
+	if (d->range > 2) {
+		d->base++;
+		d->range -= 2;
+	}
+	return true;
+}
+
+/* port or low-high */
+static bool parse_ports(struct distribution *d, const char *str)
+{
+	char *dash = strchr(str, '-');
+	int lo, hi;
+
+	lo = hi = string_to_number(str, 1, 65535);
+	if (dash) {
+		char *first = talloc_strndup(NULL, str, dash - str);
+		lo = string_to_number(first, 1, 65535);
+		hi = string_to_number(dash + 1, 1, 65535);
+		talloc_free(first);
+	}
+	if (lo < 0 || hi < lo) {
+		nfsim_log(LOG_ALWAYS, "Bad ports `%s'", str);
+		return false;
+	}
+	d->base = lo;
+	d->range = hi - lo + 1;
+	return true;
+}
+
+/* n, low-high (uniform) or exp:mean */
+static bool parse_size(struct traffic *t, const char *str)
+{
+	char *dash = strchr(str, '-');
+	int lo, hi;
+
+	if (strstarts(str, "exp:")) {
+		lo = string_to_number(str + 4, 1, MAX_PAYLOAD);
+		if (lo < 0)
+			goto bad;
+		t->size_dist = SIZE_EXP;
+		t->size_min = lo;
+		return true;
+	}
+	if (dash) {
+		char *first = talloc_strndup(NULL, str, dash - str);
+		lo = string_to_number(first, 0, MAX_PAYLOAD);
+		hi = string_to_number(dash + 1, 0, MAX_PAYLOAD);
+		talloc_free(first);
+		if (lo < 0 || hi < lo)
+			goto bad;
+		t->size_dist = SIZE_UNIFORM;
+		t->size_min = lo;
+		t->size_max = hi;
+		return true;
+	}
+	lo = string_to_number(str, 0, MAX_PAYLOAD);
+	if (lo < 0)
+		goto bad;
+	t->size_dist = SIZE_FIXED;
+	t->size_min = lo;
+	return true;
+bad:
+	nfsim_log(LOG_ALWAYS, "Bad size `%s' (0 to %u)", str, MAX_PAYLOAD);
+	return false;
+}
+
+static bool parse_protos(struct traffic *t, char *arg)
+{
+	char *tok;
+
+	memset(t->weights, 0, sizeof(t->weights));
+	t->total_weight = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		char *colon = strchr(tok, ':');
+		int weight = 1;
+		unsigned int i;
+
+		if (colon) {
+			*colon = '\0';
+			weight = string_to_number(colon + 1, 1, 1000);
+			if (weight < 0) {
+				nfsim_log(LOG_ALWAYS, "Bad weight `%s'",
+					  colon + 1);
+				return false;
+			}
+		}
+		if (strcasecmp(tok, "tcp") == 0)
+			i = 0;
+		else if (strcasecmp(tok, "udp") == 0)
+			i = 1;
+		else if (strcasecmp(tok, "icmp") == 0)
+			i = 2;
+		else {
+			nfsim_log(LOG_ALWAYS, "Unknown protocol `%s'", tok);
+			return false;
+		}
+		t->weights[i] += weight;
+		t->total_weight += weight;
+	}
+	return t->total_weight != 0;
+}
+
+static bool parse_args(struct traffic *t, void *ctx, int argc, char **argv)
+{
+	const char *srcdist = "uniform", *dstdist = "uniform";
+	const char *portdist = "uniform";
+	int i, n;
+
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+
+		if (strstarts(arg, "SEED=")) {
+			t->rng = strtoull(arg + 5, NULL, 0);
+		} else if (strstarts(arg, "FLOWS=")) {
+			if ((n = string_to_number(arg + 6, 1, INT_MAX)) < 0)
+				goto bad;
+			t->max_flows = n;
+		} else if (strstarts(arg, "TOTAL=")) {
+			if ((n = string_to_number(arg + 6, 1, INT_MAX)) < 0)
+				goto bad;
+			t->total_flows = n;
+		} else if (strstarts(arg, "RATE=")) {
+			t->rate = atof(arg + 5);
+			if (t->rate < 0)
+				goto bad;
+		} else if (strstarts(arg, "GAP=")) {
+			t->gap = atof(arg + 4) / 1000;
+			if (t->gap < 0)
+				goto bad;
+		} else if (strstarts(arg, "PACKETS=")) {
+			t->mean_packets = atof(arg + 8);
+			if (t->mean_packets < 1)
+				goto bad;
+		} else if (strstarts(arg, "PROTO=")) {
+			if (!parse_protos(t, arg + 6))
+				return false;
+		} else if (strstarts(arg, "SRC=")) {
+			if (!parse_network(&t->src, arg + 4))
+				return false;
+		} else if (strstarts(arg, "DST=")) {
+			if (!parse_network(&t->dst, arg + 4))
+				return false;
+		} else if (strstarts(arg, "DPORT=")) {
+			if (!parse_ports(&t->dport, arg + 6))
+				return false;
+		} else if (strstarts(arg, "SRCDIST=")) {
+			srcdist = arg + 8;
+		} else if (strstarts(arg, "DSTDIST=")) {
+			dstdist = arg + 8;
+		} else if (strstarts(arg, "PORTDIST=")) {
+			portdist = arg + 9;
+		} else if (strstarts(arg, "SIZE=")) {
+			if (!parse_size(t, arg + 5))
+				return false;
+		} else if (strstarts(arg, "IF=")) {
+			t->client_if = arg + 3;
+		} else if (strstarts(arg, "REPLYIF=")) {
+			t->server_if = arg + 8;
+		} else if (streq(arg, "NOREPLY")) {
+			t->replies = false;
+		} else
+			goto bad;
+	}
+
+	if (!t->total_flows)
+		t->total_flows = t->max_flows;
+	/* xorshift never leaves zero. */
+	if (!t->rng)
+		t->rng = 1;
+
+	return parse_distribution(ctx, &t->src, srcdist)
+		&& parse_distribution(ctx, &t->dst, dstdist)
+		&& parse_distribution(ctx, &t->dport, portdist);
+bad:
+	nfsim_log(LOG_ALWAYS, "Bad argument `%s'", argv[i]);
+	return false;
+}
+
+/* A binary heap of flows by time of next packet. */
+static void heap_push(struct traffic *t, struct flow *f)
+{
+	unsigned int i = t->num_active++;
+
+	while (i > 0 && t->heap[(i - 1) / 2]->when > f->when) {
+		t->heap[i] = t->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	t->heap[i] = f;
+}
+
+static struct flow *heap_pop(struct traffic *t)
+{
+	struct flow *top = t->heap[0], *last = t->heap[--t->num_active];
+	unsigned int i = 0, child;
+
+	while ((child = 2 * i + 1) < t->num_active) {
+		if (child + 1 < t->num_active
+		    && t->heap[child + 1]->when < t->heap[child]->when)
+			child++;
+		if (last->when <= t->heap[child]->when)
+			break;
+		t->heap[i] = t->heap[child];
+		i = child;
+	}
+	t->heap[i] = last;
+	return top;
+}
+
+static unsigned int payload_size(struct traffic *t)
+{
+	unsigned int size;
+
+	switch (t->size_dist) {
+	case SIZE_UNIFORM:
+		return t->size_min
+			+ random64(t) % (t->size_max - t->size_min + 1);
+	case SIZE_EXP:
+		size = random_exp(t, t->size_min);
+		return size > MAX_PAYLOAD ? MAX_PAYLOAD : size;
+	default:
+		return t->size_min;
+	}
+}
+
+static struct flow *new_flow(struct traffic *t, void *ctx, double now)
+{
+	struct flow *f = talloc(ctx, struct flow);
+	unsigned int w = random64(t) % t->total_weight, i;
+
+	for (i = 0; w >= t->weights[i]; i++)
+		w -= t->weights[i];
+
+	f->when = now;
+	f->protocol = protos[i];
+	f->state = f->protocol == IPPROTO_TCP ? SEND_SYN : SEND_DATA;
+	f->client = htonl(pick(t, &t->src));
+	f->server = htonl(pick(t, &t->dst));
+	f->sport = 1024 + random64(t) % (65536 - 1024);
+	f->dport = pick(t, &t->dport);
+	f->client_seq = random64(t);
+	f->server_seq = random64(t);
+	f->echo_seq = 0;
+	/* Geometric, with the mean asked for. */
+	f->data_left = 1 + floor(log(1.0 - random_unit(t))
+				 / log(1.0 - 1.0 / t->mean_packets));
+	if (t->mean_packets == 1)
+		f->data_left = 1;
+	/* Echo replies keep the id: the sequence number isn't the flow's. */
+	f->elsewhere = !shard_flow(f->client, f->server, f->protocol, f->sport,
+				   f->protocol == IPPROTO_ICMP ? 0 : f->dport);
+	return f;
+}
+
+/* Send this flow's next packet, and move it on.  False on failure. */
+static bool flow_send(struct traffic *t, struct flow *f)
+{
+	struct packet packet;
+	struct packet_desc desc = { .protocol = f->protocol,
+				    .window = 65535 };
+	bool from_client = true, last = false;
+
+	switch (f->state) {
+	case SEND_SYN:
+		desc.syn = true;
+		f->state = t->replies ? SEND_SYNACK : SEND_ACK;
+		break;
+	case SEND_SYNACK:
+		from_client = false;
+		desc.syn = desc.ack = true;
+		f->state = SEND_ACK;
+		break;
+	case SEND_ACK:
+		desc.ack = true;
+		f->state = SEND_DATA;
+		break;
+	case SEND_DATA:
+		desc.datalen = payload_size(t);
+		if (f->protocol == IPPROTO_ICMP) {
+			/* Each request is answered. */
+			from_client = !(f->echo_seq & 1) || !t->replies;
+			desc.reply = !from_client;
+			desc.dport = t->replies ? f->echo_seq / 2 : f->echo_seq;
+			f->echo_seq++;
+			last = !from_client || !t->replies;
+		} else {
+			desc.ack = (f->protocol == IPPROTO_TCP);
+			if (t->replies)
+				from_client = random64(t) & 1;
+			last = true;
+		}
+		if (last && --f->data_left == 0)
+			f->state = f->protocol == IPPROTO_TCP
+				? SEND_FIN : FLOW_DONE;
+		break;
+	case SEND_FIN:
+		desc.fin = desc.ack = true;
+		f->state = t->replies ? SEND_FINACK : FLOW_DONE;
+		break;
+	case SEND_FINACK:
+		from_client = false;
+		desc.fin = desc.ack = true;
+		f->state = SEND_LASTACK;
+		break;
+	case SEND_LASTACK:
+		desc.ack = true;
+		f->state = FLOW_DONE;
+		break;
+	case FLOW_DONE:
+		barf("gen_traffic: sending on finished flow");
+	}
+
+	if (from_client) {
+		desc.saddr = f->client;
+		desc.daddr = f->server;
+	} else {
+		desc.saddr = f->server;
+		desc.daddr = f->client;
+	}
+
+	switch (f->protocol) {
+	case IPPROTO_ICMP:
+		desc.sport = f->sport;
+		break;
+	case IPPROTO_TCP: {
+		u_int32_t *seq, *ack;
+
+		seq = from_client ? &f->client_seq : &f->server_seq;
+		ack = from_client ? &f->server_seq : &f->client_seq;
+		desc.seq = *seq;
+		desc.ack_seq = desc.ack ? *ack : 0;
+		*seq += (desc.syn || desc.fin) ? 1 : desc.datalen;
+	}
+		/* fall thru */
+	default:
+		desc.sport = from_client ? f->sport : f->dport;
+		desc.dport = from_client ? f->dport : f->sport;
+	}
+
+	t->packets++;
+	/* Every shard draws the same random numbers, so flows match. */
+	if (f->elsewhere)
+		return true;
+
+	build_packet(&packet, &desc);
+	return send_packet(&packet,
+			   from_client ? t->client_if : t->server_if, NULL);
+}
+
+/* Bring the simulator's clock up to now (timers run as they expire). */
+static void advance_to(unsigned long start, double now)
+{
+	unsigned long target = start + (unsigned long)(now * HZ);
+
+	if (time_after(target, jiffies))
+		increment_time(target - jiffies);
+}
+
+static void gen_traffic_help(int argc, char **argv)
+{
+#include "gen_traffic-help:gen_traffic"
+/*** XML Help:
+    <section id="c:gen_traffic">
+     <title><command>gen_traffic</command></title>
+     <para>Generate packets from many concurrent flows</para>
+     <cmdsynopsis>
+      <command>gen_traffic</command>
+      <arg choice="opt">SEED=<replaceable>number</replaceable></arg>
+      <arg choice="opt">FLOWS=<replaceable>concurrent</replaceable></arg>
+      <arg choice="opt">TOTAL=<replaceable>flows</replaceable></arg>
+      <arg choice="opt">RATE=<replaceable>flows-per-second</replaceable></arg>
+      <arg choice="opt">GAP=<replaceable>milliseconds</replaceable></arg>
+      <arg choice="opt">PACKETS=<replaceable>mean</replaceable></arg>
+      <arg choice="opt">PROTO=<replaceable>proto</replaceable>[:<replaceable>weight</replaceable>],...</arg>
+      <arg choice="opt">SRC=<replaceable>network</replaceable>/<replaceable>bits</replaceable></arg>
+      <arg choice="opt">DST=<replaceable>network</replaceable>/<replaceable>bits</replaceable></arg>
+      <arg choice="opt">DPORT=<replaceable>low</replaceable>-<replaceable>high</replaceable></arg>
+      <arg choice="opt">SRCDIST=<replaceable>distribution</replaceable></arg>
+      <arg choice="opt">DSTDIST=<replaceable>distribution</replaceable></arg>
+      <arg choice="opt">PORTDIST=<replaceable>distribution</replaceable></arg>
+      <arg choice="opt">SIZE=<replaceable>size</replaceable></arg>
+      <arg choice="opt">IF=<replaceable>interface</replaceable></arg>
+      <arg choice="opt">REPLYIF=<replaceable>interface</replaceable></arg>
+      <arg choice="opt">NOREPLY</arg>
+     </cmdsynopsis>
+     <para><command>gen_traffic</command> runs
+     <replaceable>flows</replaceable> flows (default: as many as
+     <replaceable>concurrent</replaceable>, default 100) from start to
+     finish, with at most <replaceable>concurrent</replaceable> open at
+     once, sending their packets interleaved.  New flows start at
+     <replaceable>flows-per-second</replaceable> on average (default 0:
+     as soon as there is room), and each flow's packets are on average
+     <replaceable>milliseconds</replaceable> apart (default 10), both
+     exponentially distributed.  The simulator's clock moves forward as
+     the flows go, so timers expire as they would.  The same
+     <replaceable>number</replaceable> (default 1) always gives the same
+     traffic.</para>
+
+     <para>Each flow picks a protocol by weight (default UDP), a client
+     address from <arg>SRC=</arg> (default 192.168.0.0/24), a server
+     address from <arg>DST=</arg> (default 192.168.1.0/24), a random
+     source port and a destination port from <arg>DPORT=</arg> (default
+     80).  A <replaceable>distribution</replaceable> is
+     <literal>uniform</literal> (default) or
+     <literal>zipf</literal>[:<replaceable>exponent</replaceable>], where
+     the first address or port of the range is the most popular.</para>
+
+     <para>A TCP flow goes SYN, SYN/ACK, ACK, then data, then FIN/ACK,
+     FIN/ACK, ACK.  UDP flows are just data; ICMP flows are echo requests
+     and replies.  The number of data packets is geometrically
+     distributed with the given <replaceable>mean</replaceable> (default
+     4), and each goes either way at random.  The payload
+     <replaceable>size</replaceable> is a number of bytes (default 0), a
+     range <replaceable>low</replaceable>-<replaceable>high</replaceable>
+     picked uniformly, or
+     <literal>exp:</literal><replaceable>mean</replaceable>, up to
+     1400.</para>
+
+     <para>Client packets arrive on <arg>IF=</arg> (default eth0) and
+     server packets on <arg>REPLYIF=</arg> (default eth1), addressed to
+     the original client, so NAT replies will not match.
+     <arg>NOREPLY</arg> only sends the client's packets.  Every packet is
+     logged as for <command>gen_ip</command>; turn off packet logging
+     for large runs.</para>
+    </section>
+*/
+}
+
+static bool gen_traffic(int argc, char **argv)
+{
+	struct traffic t;
+	void *ctx = talloc_named_const(NULL, 1, "gen_traffic");
+	unsigned long start = jiffies;
+	unsigned int started = 0;
+	double now = 0, next_arrival = 0;
+	bool ret = true;
+
+	memset(&t, 0, sizeof(t));
+	t.rng = 1;
+	t.max_flows = 100;
+	t.gap = 0.010;
+	t.mean_packets = 4;
+	t.weights[1] = t.total_weight = 1;
+	t.client_if = "eth0";
+	t.server_if = "eth1";
+	t.replies = true;
+	parse_network(&t.src, "192.168.0.0/24");
+	parse_network(&t.dst, "192.168.1.0/24");
+	t.dport.base = 80;
+	t.dport.range = 1;
+
+	if (!parse_args(&t, ctx, argc, argv)) {
+		gen_traffic_help(0, NULL);
+		talloc_free(ctx);
+		return false;
+	}
+	t.heap = talloc_array(ctx, struct flow *, t.max_flows);
+
+	while (started < t.total_flows || t.num_active) {
+		struct flow *f;
+
+		/* New flow due before anyone else's next packet? */
+		if (started < t.total_flows && t.num_active < t.max_flows
+		    && (!t.num_active || next_arrival <= t.heap[0]->when)) {
+			if (next_arrival > now)
+				now = next_arrival;
+			heap_push(&t, new_flow(&t, ctx, now));
+			started++;
+			next_arrival = now;
+			if (t.rate)
+				next_arrival += random_exp(&t, 1.0 / t.rate);
+			continue;
+		}
+
+		f = heap_pop(&t);
+		now = f->when;
+		advance_to(start, now);
+		if (!flow_send(&t, f)) {
+			ret = false;
+			break;
+		}
+		if (f->state == FLOW_DONE) {
+			talloc_free(f);
+			continue;
+		}
+		f->when = now + random_exp(&t, t.gap);
+		heap_push(&t, f);
+	}
+
+	nfsim_log(LOG_UI, "gen_traffic: %u flows, %lu packets, %.2f seconds",
+		  started, t.packets, now);
+	talloc_free(ctx);
+	return ret;
+}
+
+static void init(void)
+{
+	tui_register_command("gen_traffic", gen_traffic, gen_traffic_help);
+}
+
+init_call(init);
@@ -86,6 +86,7 @@ static bool set_device(struct net_device *dev, int argc, char **argv)
 				return false;
 			}
 			argv++;
+			argc--;
 
 		} else {
 			int mask = atoi(*argv);
@@ -141,10 +142,118 @@ struct net_device *create_device(const char *name, int argc, char **argv)
 	}
 
 	add_route_for_device(indev);
-	list_add_tail(&dev->entry, &interfaces);
+	register_interface(dev);
 	return dev;
 }
 
+/* Expand %d (the number), %a and %b (its high and low bytes) and %%. */
+static char *expand(const void *ctx, const char *template, unsigned int num)
+{
+	char *ret = talloc_strdup(ctx, "");
+
+	for (; *template; template++) {
+		if (*template != '%') {
+			ret = talloc_asprintf_append(ret, "%c", *template);
+			continue;
+		}
+		switch (*++template) {
+		case 'd':
+			ret = talloc_asprintf_append(ret, "%u", num);
+			break;
+		case 'a':
+			ret = talloc_asprintf_append(ret, "%u", (num >> 8) & 255);
+			break;
+		case 'b':
+			ret = talloc_asprintf_append(ret, "%u", num & 255);
+			break;
+		case '%':
+			ret = talloc_asprintf_append(ret, "%%");
+			break;
+		default:
+			nfsim_log(LOG_ALWAYS, "bad template '%s'", template-1);
+			talloc_free(ret);
+			return NULL;
+		}
+	}
+	return ret;
+}
+
+/* ifconfig vlan%d 1-4000 10.%a.%b.1 24 [bcast] [up] or ... down */
+static bool ifconfig_range(int argc, char **argv)
+{
+	unsigned int lo, hi, i;
+	int len, nargs;
+	const char *template = argv[1];
+	char *ctx = NULL, *name, *args[4];
+	struct net_device *dev;
+	struct in_ifaddr *ifaddr;
+	bool down, ret = false;
+
+	if (sscanf(argv[2], "%u-%u%n", &lo, &hi, &len) != 2
+	    || argv[2][len] || lo > hi) {
+		nfsim_log(LOG_ALWAYS, "invalid range '%s'", argv[2]);
+		return false;
+	}
+
+	argc -= 3;
+	argv += 3;
+	down = (argc == 1 && streq(argv[0], "down"));
+	if (argc && streq(argv[argc-1], "up"))
+		argc--;
+	if (!down && (argc < 2 || argc > 4)) {
+		nfsim_log(LOG_ALWAYS, "not enough arguments to bring up devices");
+		return false;
+	}
+
+	for (i = lo; i <= hi; i++) {
+		/* Strings for this device. */
+		talloc_free(ctx);
+		ctx = talloc_named_const(NULL, 1, "ifconfig_range");
+		name = expand(ctx, template, i);
+		if (!name)
+			goto out;
+		if (strlen(name) >= IFNAMSIZ) {
+			nfsim_log(LOG_ALWAYS, "device name '%s' too long", name);
+			goto out;
+		}
+		dev = interface_by_name(name);
+
+		if (down) {
+			if (!dev) {
+				u_log("No such device '%s'", name);
+				goto out;
+			}
+			ifaddr = ((struct in_device *)dev->ip_ptr)->ifa_list;
+			__call_inetaddr_notifier(NETDEV_DOWN, ifaddr);
+			talloc_free(dev);
+			continue;
+		}
+
+		if (dev) {
+			nfsim_log(LOG_ALWAYS, "device '%s' already exists", name);
+			goto out;
+		}
+		for (nargs = 0; nargs < argc; nargs++) {
+			args[nargs] = expand(ctx, argv[nargs], i);
+			if (!args[nargs])
+				goto out;
+		}
+		dev = create_device(name, nargs, args);
+		if (!dev)
+			goto out;
+
+		/* Default broadcast address. */
+		ifaddr = ((struct in_device *)dev->ip_ptr)->ifa_list;
+		if (argc == 2 || (argc == 3 && streq(argv[1], "mask")))
+			ifaddr->ifa_broadcast = ifaddr->ifa_local
+				| ~ifaddr->ifa_mask;
+	}
+	ret = true;
+out:
+	talloc_free(ctx);
+	return ret;
+}
+
 static bool ifconfig(int argc, char **argv)
 {
 	struct net_device *dev;
@@ -156,6 +265,9 @@ static bool ifconfig(int argc, char **argv)
 		return true;
 	}
 
+	if (argc >= 4 && strchr(argv[1], '%'))
+		return ifconfig_range(argc, argv);
+
 	/* first arg is the device name */
 	dev = interface_by_name(argv[1]);
 
@@ -190,7 +302,6 @@ static bool ifconfig(int argc, char **argv)
 	__call_inetaddr_notifier(NETDEV_DOWN, indev->ifa_list);
 
 	if (argc == 3 && !strncmp(argv[2], "down", 4)) {
-		list_del(&dev->entry);
 		talloc_free(dev);
 		return true;
 	}
@@ -269,6 +380,16 @@ static void ifconfig_help(int argc, char **argv)
      </cmdsynopsis>
     </para>
 
+    <para>Many interfaces can be brought up (or down) at once by giving
+     a name containing <literal>%d</literal> and a range of numbers:
+     <screen>ifconfig vlan%d 1-4000 10.%a.%b.1 24 up</screen>
+     In the name and addresses, <literal>%d</literal> is replaced by the
+     number, and <literal>%a</literal> and <literal>%b</literal> by its
+     high and low bytes.  The broadcast address and <arg>up</arg> are
+     optional in this form.
+     <screen>ifconfig vlan%d 1-4000 down</screen>
+    </para>
+
     <para>To reconfigure an interface, use the syntax
      <cmdsynopsis>
       <command>ifconfig</command>
@@ -23,6 +23,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <log.h>
 #include <kernelenv.h>
 #include <utils.h>
+#include <symbol.h>
 
 extern struct list_head __timers;
 extern struct list_head nf_sockopts;
@@ -35,10 +36,11 @@ static bool hooks(int argc, char **argv)
 	for (i = 0; i < NPROTO; i++)
 		for (j = 0; j < NF_MAX_HOOKS; j++)
 			list_for_each_entry(hook, &nf_hooks[i][j], list)
-				nfsim_log(LOG_ALWAYS, "hook(%d, %-18s) to %s",
+				nfsim_log(LOG_ALWAYS, "hook(%d, %-18s) to %s %s",
 					i, nf_hooknames[i][j],
 					hook->owner ?
-						hook->owner->name : "nfsim");
+						hook->owner->name : "nfsim",
+					symbolize(hook->hook));
 
 	return true;
 }
@@ -64,9 +66,10 @@ static bool rcaches(int argc, char **argv)
 	for (r = rcache; r; r = r->u.rt_next)
 		nfsim_log(LOG_ALWAYS,
 			"dst: %u.%u.%u.%u, src: %u.%u.%u.%u, "
-			"iif: %d, gw: %u.%u.%u.%u",
+			"iif: %d, gw: %u.%u.%u.%u, refcnt: %d",
 			NIPQUAD(r->rt_dst), NIPQUAD(r->rt_src),
-			r->rt_iif, NIPQUAD(r->rt_gateway));
+			r->rt_iif, NIPQUAD(r->rt_gateway),
+			atomic_read(&r->u.dst.__refcnt));
 	return true;
 }
 
@@ -75,8 +78,9 @@ static bool timers(int argc, char **argv)
 	struct timer_list *t;
 
 	list_for_each_entry(t, &__timers, entry)
-		nfsim_log(LOG_ALWAYS, "At %9d: %s:%s()", t->expires,
-			t->owner->name, t->ownerfunction);
+		nfsim_log(LOG_ALWAYS, "At %9d: %s:%s() runs %s", t->expires,
+			t->owner->name, t->ownerfunction,
+			symbolize(t->function));
 
 	return true;
 
@@ -100,7 +104,8 @@ static void info_help(int argc, char **argv)
       <varlistentry>
        <term>hooks</term>
        <listitem>
-        <para>displays the currently registered netfilter hooks</para>
+        <para>displays the currently registered netfilter hooks, with
+	 the module and function for each</para>
        </listitem>
       </varlistentry>
       <varlistentry>
@@ -113,7 +118,8 @@ static void info_help(int argc, char **argv)
        <term>timers</term>
        <listitem>
         <para>shows the current kernel timers - when each is set to expire, as
-	 well as the function where the timer was registered.</para>
+	 well as the function where the timer was registered, and the
+	 function it will run.</para>
        </listitem>
       </varlistentry>
       <varlistentry>
@@ -25,6 +25,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <log.h>
 #include <utils.h>
 #include <list.h>
+#include <symbol.h>
 #include <dlfcn.h>
 #include <sys/types.h>
 #include <dirent.h>
@@ -42,6 +43,30 @@ struct nfsim_module
 static LIST_HEAD(modules);
 char *module_path;
 
+/* Modules linked in, in link order (see module_init() in kernelenv.h). */
+extern struct builtin_initcall __start_module_init[], __stop_module_init[];
+extern struct builtin_exitcall __start_module_exit[], __stop_module_exit[];
+
+static struct builtin_initcall *find_builtin(const char *name)
+{
+	struct builtin_initcall *p;
+
+	for (p = __start_module_init; p < __stop_module_init; p++)
+		if (p->name && streq(p->name, name))
+			return p;
+	return NULL;
+}
+
+static exitcall_t find_builtin_exit(const char *name)
+{
+	struct builtin_exitcall *p;
+
+	for (p = __start_module_exit; p < __stop_module_exit; p++)
+		if (p->name && streq(p->name, name))
+			return p->fn;
+	return NULL;
+}
+
 static struct nfsim_module *find_module(const char *name)
 {
 	struct nfsim_module *i;
@@ -159,14 +184,23 @@ static void insmod_help(int argc, char **argv)
 
      <para><command>insmod</command> loads a module, or all modules.
     The caller must ensure that any other module this one expects are
-    already loaded.</para> </section>
+    already loaded.</para>
+
+     <para>If nfsim was configured with
+    <option>--static-modules</option>, modules are linked into nfsim
+    rather than loaded from files, but <command>insmod</command> and
+    <command>rmmod</command> still initialize and remove them.</para>
+    </section>
 */
 }
 
 static int destroy_mod(void *_mod)
 {
 	struct nfsim_module *mod = _mod;
-	dlclose(mod->handle);
+	if (mod->handle) {
+		dlclose(mod->handle);
+		symbol_flush();
+	}
 	list_del(&mod->list);
 	return 0;
 }
@@ -176,42 +210,89 @@ static int no_init(void)
 	return 0;
 }
 
-/* Returns module. */
+/* Returns module.  Builtin ones are already there: just not "loaded". */
 static struct nfsim_module *load_mod(const char *name, bool report)
 {
 	struct nfsim_module *mod;
+	struct builtin_initcall *builtin;
 	char *path;
 
 	mod = talloc(NULL, struct nfsim_module);
-	path = talloc_asprintf(mod, "%s/%s.so", module_path, name);
 
-	mod->handle = dlopen(path, RTLD_NOW|RTLD_GLOBAL);
-	if (!mod->handle) {
-		talloc_free(mod);
-		if (report)
-			nfsim_log(LOG_UI, "%s", dlerror());
-		return NULL;
+	builtin = find_builtin(name);
+	if (builtin) {
+		mod->handle = NULL;
+		mod->init = builtin->fn;
+		mod->fini = find_builtin_exit(name);
+	} else {
+		path = talloc_asprintf(mod, "%s/%s.so", module_path, name);
+		mod->handle = dlopen(path, RTLD_NOW|RTLD_GLOBAL);
+		if (!mod->handle) {
+			talloc_free(mod);
+			if (report)
+				nfsim_log(LOG_UI, "%s", dlerror());
+			return NULL;
+		}
+		mod->init = dlsym(mod->handle, "__module_init");
+		if (!mod->init)
+			mod->init = no_init;
+		mod->fini = dlsym(mod->handle, "__module_exit");
 	}
 
 	mod->name = talloc_strdup(mod, name);
 	mod->use = 0;
-	mod->init = dlsym(mod->handle, "__module_init");
-	if (!mod->init)
-		mod->init = no_init;
-	mod->fini = dlsym(mod->handle, "__module_exit");
 	list_add(&mod->list, &modules);
 	talloc_set_destructor(mod, destroy_mod);
 	return mod;
 }
 
+static bool have_builtin_modules(void)
+{
+	struct builtin_initcall *p;
+
+	for (p = __start_module_init; p < __stop_module_init; p++)
+		if (p->name)
+			return true;
+	return false;
+}
+
+/* Builtin modules go first, in link order, so dependencies are there. */
+static bool load_builtin_modules(void)
+{
+	struct builtin_initcall *p;
+	struct nfsim_module *mod;
+	int ret;
+
+	for (p = __start_module_init; p < __stop_module_init; p++) {
+		if (!p->name || find_module(p->name))
+			continue;
+
+		mod = load_mod(p->name, true);
+		ret = mod->init();
+		if (ret != 0) {
+			talloc_free(mod);
+			nfsim_log(LOG_UI, "Module %s init failed: %i",
+				  p->name, ret);
+			return false;
+		}
+	}
+	return true;
+}
+
 bool load_all_modules(void)
 {
        DIR *dir;
        struct dirent *d;
        unsigned int num_succeeded, num_tried;
 
+       if (!load_builtin_modules())
+	       return false;
+
        dir = opendir(module_path);
        if (!dir) {
+	       /* Everything built in?  Then there need not be a directory. */
+	       if (errno == ENOENT && have_builtin_modules())
+		       return true;
 	       nfsim_log(LOG_UI,
 			 "Could not opendir %s: %s",
 			 module_path, strerror(errno));
@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <tui.h>
 #include <log.h>
 #include <kernelenv.h>
+#include <trace.h>
 
 static bool queue(int argc, char **argv)
 {
@@ -59,6 +60,8 @@ static bool queue(int argc, char **argv)
 			"number '%d'", packetno);
 		return false;
 inject:
+		trace_packet(TRACE_REINJECT, i->skb->seq, i->skb, i->skb->dev,
+			     NULL, NULL, 0, verdict, i->id);
 		nf_reinject(i->skb, i->info, verdict);
 		list_del(&i->list);
 		return true;
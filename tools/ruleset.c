@@ -0,0 +1,1255 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Load iptables-save output straight into ip_tables, without running
+ * iptables-restore.  Only the commonest matches and targets are
+ * understood: anything else is refused, and should go through
+ * iptables-restore. */
+
+#include <tui.h>
+#include <log.h>
+#include <message.h>
+#include <ipv4/ipv4.h>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include "utils.h"
+
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <linux/netfilter_ipv4/ipt_state.h>
+#include <linux/netfilter_ipv4/ipt_mark.h>
+#include <linux/netfilter_ipv4/ipt_MARK.h>
+#include <linux/netfilter_ipv4/ipt_REJECT.h>
+#include <linux/netfilter_ipv4/ipt_LOG.h>
+
+/* As iptables-restore. */
+#define RULESET_MAX_ARGS 255
+
+struct parse_state {
+	const char *file;
+	unsigned int line;
+	int argc, arg;
+	char *argv[RULESET_MAX_ARGS];
+	/* An option parser has already complained. */
+	bool failed;
+};
+
+struct rule {
+	struct list_head list;
+	struct ipt_entry *entry;
+	/* Jump to a user chain, filled in when offsets are known. */
+	char *jump;
+};
+
+struct chain {
+	struct list_head list;
+	char *name;
+	int hook;		/* -1 for user-defined chains */
+	int policy;		/* builtins only */
+	struct ipt_counters counters;
+	struct list_head rules;
+	/* Offset of first rule (or policy/return if none). */
+	unsigned int offset;
+};
+
+struct table {
+	struct ipt_getinfo info;
+	struct list_head chains;
+	bool counters;
+};
+
+static bool parse_fail(struct parse_state *ps, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static bool parse_fail(struct parse_state *ps, const char *fmt, ...)
+{
+	va_list arglist;
+	char *str;
+
+	va_start(arglist, fmt);
+	str = talloc_vasprintf(NULL, fmt, arglist);
+	va_end(arglist);
+
+	nfsim_log(LOG_UI, "ruleset: %s:%u: %s", ps->file, ps->line, str);
+	talloc_free(str);
+	return false;
+}
+
+/* Next argument of an option: handles old-style "--opt ! value". */
+static const char *option_arg(struct parse_state *ps, bool *invert)
+{
+	if (ps->arg < ps->argc && streq(ps->argv[ps->arg], "!")) {
+		*invert = !*invert;
+		ps->arg++;
+	}
+	if (ps->arg == ps->argc)
+		return NULL;
+	return ps->argv[ps->arg++];
+}
+
+static bool parse_number(const char *str, unsigned long max,
+			 unsigned long *num)
+{
+	char *end;
+
+	*num = strtoul(str, &end, 0);
+	return *str && !*end && *num <= max;
+}
+
+/* Ports are a number or a range, low:high (either end can be missing). */
+static bool parse_ports(const char *str, u_int16_t ports[2])
+{
+	unsigned long low = 0, high = 0xFFFF;
+	const char *colon = strchr(str, ':');
+	char *lowstr;
+	bool ok;
+
+	if (!colon) {
+		if (!parse_number(str, 0xFFFF, &low))
+			return false;
+		ports[0] = ports[1] = low;
+		return true;
+	}
+
+	lowstr = talloc_strndup(NULL, str, colon - str);
+	ok = (!*lowstr || parse_number(lowstr, 0xFFFF, &low))
+		&& (!colon[1] || parse_number(colon + 1, 0xFFFF, &high));
+	talloc_free(lowstr);
+	ports[0] = low;
+	ports[1] = high;
+	return ok && low <= high;
+}
+
+static bool parse_flag_list(const char *str, const char *const names[],
+			    const unsigned int values[], unsigned int num,
+			    unsigned int *result)
+{
+	char *copy = talloc_strdup(NULL, str), *p, *save;
+	unsigned int i;
+
+	*result = 0;
+	for (p = strtok_r(copy, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < num; i++)
+			if (strcasecmp(p, names[i]) == 0)
+				break;
+		if (i == num) {
+			talloc_free(copy);
+			return false;
+		}
+		*result |= values[i];
+	}
+	talloc_free(copy);
+	return true;
+}
+
+/* Each match or target we know: returns false if opt isn't ours (args
+ * untouched) or on error (ps->failed set). */
+struct extension_type {
+	const char *name;
+	unsigned int size;
+	void (*init)(void *data);
+	bool (*parse)(struct parse_state *ps, const char *opt, bool invert,
+		      void *data);
+};
+
+static bool bad_arg(struct parse_state *ps, const char *opt, const char *arg)
+{
+	parse_fail(ps, "bad argument '%s' to %s", arg ?: "", opt);
+	ps->failed = true;
+	return false;
+}
+
+static void tcpudp_init(void *data)
+{
+	/* Both start with spts, dpts. */
+	struct ipt_udp *udp = data;
+
+	udp->spts[1] = udp->dpts[1] = 0xFFFF;
+}
+
+static const char *const tcp_flag_names[]
+= { "FIN", "SYN", "RST", "PSH", "ACK", "URG", "ALL", "NONE" };
+static const unsigned int tcp_flag_values[]
+= { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x3F, 0x00 };
+
+static bool tcp_parse(struct parse_state *ps, const char *opt, bool invert,
+		      void *data)
+{
+	struct ipt_tcp *tcp = data;
+	const char *arg;
+	unsigned int mask, cmp;
+	unsigned long num;
+
+	if (streq(opt, "--sport") || streq(opt, "--source-port")) {
+		arg = option_arg(ps, &invert);
+		if (!arg || !parse_ports(arg, tcp->spts))
+			return bad_arg(ps, opt, arg);
+		if (invert)
+			tcp->invflags |= IPT_TCP_INV_SRCPT;
+	} else if (streq(opt, "--dport") || streq(opt, "--destination-port")) {
+		arg = option_arg(ps, &invert);
+		if (!arg || !parse_ports(arg, tcp->dpts))
+			return bad_arg(ps, opt, arg);
+		if (invert)
+			tcp->invflags |= IPT_TCP_INV_DSTPT;
+	} else if (streq(opt, "--tcp-flags")) {
+		arg = option_arg(ps, &invert);
+		if (!arg || !parse_flag_list(arg, tcp_flag_names,
+					     tcp_flag_values,
+					     ARRAY_SIZE(tcp_flag_names), &mask))
+			return bad_arg(ps, opt, arg);
+		arg = option_arg(ps, &invert);
+		if (!arg || !parse_flag_list(arg, tcp_flag_names,
+					     tcp_flag_values,
+					     ARRAY_SIZE(tcp_flag_names), &cmp))
+			return bad_arg(ps, opt, arg);
+		tcp->flg_mask = mask;
+		tcp->flg_cmp = cmp;
+		if (invert)
+			tcp->invflags |= IPT_TCP_INV_FLAGS;
+	} else if (streq(opt, "--syn")) {
+		tcp->flg_mask = 0x01|0x02|0x04|0x10;
+		tcp->flg_cmp = 0x02;
+		if (invert)
+			tcp->invflags |= IPT_TCP_INV_FLAGS;
+	} else if (streq(opt, "--tcp-option")) {
+		arg = option_arg(ps, &invert);
+		if (!arg || !parse_number(arg, 255, &num))
+			return bad_arg(ps, opt, arg);
+		tcp->option = num;
+		if (invert)
+			tcp->invflags |= IPT_TCP_INV_OPTION;
+	} else
+		return false;
+	return true;
+}
+
+static bool udp_parse(struct parse_state *ps, const char *opt, bool invert,
+		      void *data)
+{
+	struct ipt_udp *udp = data;
+	const char *arg;
+
+	if (streq(opt, "--sport") || streq(opt, "--source-port")) {
+		arg = option_arg(ps, &invert);
+		if (!arg || !parse_ports(arg, udp->spts))
+			return bad_arg(ps, opt, arg);
+		if (invert)
+			udp->invflags |= IPT_UDP_INV_SRCPT;
+	} else if (streq(opt, "--dport") || streq(opt, "--destination-port")) {
+		arg = option_arg(ps, &invert);
+		if (!arg || !parse_ports(arg, udp->dpts))
+			return bad_arg(ps, opt, arg);
+		if (invert)
+			udp->invflags |= IPT_UDP_INV_DSTPT;
+	} else
+		return false;
+	return true;
+}
+
+static void icmp_init(void *data)
+{
+	struct ipt_icmp *icmp = data;
+
+	/* Any type. */
+	icmp->type = 0xFF;
+	icmp->code[1] = 0xFF;
+}
+
+static const struct {
+	const char *name;
+	u_int8_t type, code_min, code_max;
+} icmp_types[] = {
+	{ "any", 0xFF, 0, 0xFF },
+	{ "echo-reply", 0, 0, 0xFF },
+	{ "destination-unreachable", 3, 0, 0xFF },
+	{ "network-unreachable", 3, 0, 0 },
+	{ "host-unreachable", 3, 1, 1 },
+	{ "protocol-unreachable", 3, 2, 2 },
+	{ "port-unreachable", 3, 3, 3 },
+	{ "fragmentation-needed", 3, 4, 4 },
+	{ "source-quench", 4, 0, 0xFF },
+	{ "redirect", 5, 0, 0xFF },
+	{ "echo-request", 8, 0, 0xFF },
+	{ "time-exceeded", 11, 0, 0xFF },
+	{ "parameter-problem", 12, 0, 0xFF },
+	{ "timestamp-request", 13, 0, 0xFF },
+	{ "timestamp-reply", 14, 0, 0xFF },
+};
+
+static bool icmp_parse(struct parse_state *ps, const char *opt, bool invert,
+		       void *data)
+{
+	struct ipt_icmp *icmp = data;
+	unsigned long type, code;
+	const char *arg, *slash;
+	unsigned int i;
+
+	if (!streq(opt, "--icmp-type"))
+		return false;
+
+	arg = option_arg(ps, &invert);
+	if (!arg)
+		return bad_arg(ps, opt, arg);
+
+	for (i = 0; i < ARRAY_SIZE(icmp_types); i++) {
+		if (strcasecmp(arg, icmp_types[i].name) == 0) {
+			icmp->type = icmp_types[i].type;
+			icmp->code[0] = icmp_types[i].code_min;
+			icmp->code[1] = icmp_types[i].code_max;
+			goto out;
+		}
+	}
+
+	slash = strchr(arg, '/');
+	if (slash) {
+		char *typestr = talloc_strndup(NULL, arg, slash - arg);
+		bool ok = parse_number(typestr, 255, &type)
+			&& parse_number(slash + 1, 255, &code);
+
+		talloc_free(typestr);
+		if (!ok)
+			return bad_arg(ps, opt, arg);
+		icmp->code[0] = icmp->code[1] = code;
+	} else {
+		if (!parse_number(arg, 255, &type))
+			return bad_arg(ps, opt, arg);
+		icmp->code[0] = 0;
+		icmp->code[1] = 0xFF;
+	}
+	icmp->type = type;
+out:
+	if (invert)
+		icmp->invflags |= IPT_ICMP_INV;
+	return true;
+}
+
+/* IPT_STATE_BIT() of each ctinfo: the macro itself needs conntrack. */
+static const char *const state_names[]
+= { "INVALID", "ESTABLISHED", "RELATED", "NEW", "UNTRACKED" };
+static const unsigned int state_values[]
+= { IPT_STATE_INVALID, 1 << 1, 1 << 2, 1 << 3, 1 << 7 };
+
+static bool state_parse(struct parse_state *ps, const char *opt, bool invert,
+			void *data)
+{
+	struct ipt_state_info *state = data;
+	const char *arg;
+
+	if (!streq(opt, "--state"))
+		return false;
+
+	arg = option_arg(ps, &invert);
+	if (!arg || !parse_flag_list(arg, state_names, state_values,
+				     ARRAY_SIZE(state_names),
+				     &state->statemask))
+		return bad_arg(ps, opt, arg);
+	if (invert)
+		state->statemask = ~state->statemask;
+	return true;
+}
+
+/* value[/mask] */
+static bool parse_mark(const char *arg, unsigned long *mark,
+		       unsigned long *mask)
+{
+	const char *slash = strchr(arg, '/');
+	char *markstr;
+	bool ok;
+
+	if (!slash) {
+		*mask = 0xFFFFFFFF;
+		return parse_number(arg, 0xFFFFFFFF, mark);
+	}
+	markstr = talloc_strndup(NULL, arg, slash - arg);
+	ok = parse_number(markstr, 0xFFFFFFFF, mark)
+		&& parse_number(slash + 1, 0xFFFFFFFF, mask);
+	talloc_free(markstr);
+	return ok;
+}
+
+static bool mark_parse(struct parse_state *ps, const char *opt, bool invert,
+		       void *data)
+{
+	struct ipt_mark_info *mark = data;
+	const char *arg;
+
+	if (!streq(opt, "--mark"))
+		return false;
+
+	arg = option_arg(ps, &invert);
+	if (!arg || !parse_mark(arg, &mark->mark, &mark->mask))
+		return bad_arg(ps, opt, arg);
+	mark->invert = invert;
+	return true;
+}
+
+static bool MARK_parse(struct parse_state *ps, const char *opt, bool invert,
+		       void *data)
+{
+	struct ipt_mark_target_info *mark = data;
+	const char *arg;
+
+	if (!streq(opt, "--set-mark"))
+		return false;
+
+	arg = option_arg(ps, &invert);
+	if (!arg || !parse_number(arg, 0xFFFFFFFF, &mark->mark))
+		return bad_arg(ps, opt, arg);
+	return true;
+}
+
+static void REJECT_init(void *data)
+{
+	struct ipt_reject_info *reject = data;
+
+	reject->with = IPT_ICMP_PORT_UNREACHABLE;
+}
+
+static const struct {
+	const char *name;
+	enum ipt_reject_with with;
+} reject_types[] = {
+	{ "icmp-net-unreachable", IPT_ICMP_NET_UNREACHABLE },
+	{ "icmp-host-unreachable", IPT_ICMP_HOST_UNREACHABLE },
+	{ "icmp-proto-unreachable", IPT_ICMP_PROT_UNREACHABLE },
+	{ "icmp-port-unreachable", IPT_ICMP_PORT_UNREACHABLE },
+	{ "icmp-net-prohibited", IPT_ICMP_NET_PROHIBITED },
+	{ "icmp-host-prohibited", IPT_ICMP_HOST_PROHIBITED },
+	{ "tcp-reset", IPT_TCP_RESET },
+};
+
+static bool REJECT_parse(struct parse_state *ps, const char *opt, bool invert,
+			 void *data)
+{
+	struct ipt_reject_info *reject = data;
+	const char *arg;
+	unsigned int i;
+
+	if (!streq(opt, "--reject-with"))
+		return false;
+
+	arg = option_arg(ps, &invert);
+	for (i = 0; arg && i < ARRAY_SIZE(reject_types); i++) {
+		if (streq(arg, reject_types[i].name)) {
+			reject->with = reject_types[i].with;
+			return true;
+		}
+	}
+	return bad_arg(ps, opt, arg);
+}
+
+static void LOG_init(void *data)
+{
+	struct ipt_log_info *log = data;
+
+	/* LOG_WARNING, as iptables. */
+	log->level = 4;
+}
+
+static bool LOG_parse(struct parse_state *ps, const char *opt, bool invert,
+		      void *data)
+{
+	struct ipt_log_info *log = data;
+	unsigned long level;
+	const char *arg;
+
+	if (streq(opt, "--log-level")) {
+		arg = option_arg(ps, &invert);
+		if (!arg || !parse_number(arg, 7, &level))
+			return bad_arg(ps, opt, arg);
+		log->level = level;
+	} else if (streq(opt, "--log-prefix")) {
+		arg = option_arg(ps, &invert);
+		if (!arg || strlen(arg) >= sizeof(log->prefix))
+			return bad_arg(ps, opt, arg);
+		strcpy(log->prefix, arg);
+	} else if (streq(opt, "--log-tcp-sequence"))
+		log->logflags |= IPT_LOG_TCPSEQ;
+	else if (streq(opt, "--log-tcp-options"))
+		log->logflags |= IPT_LOG_TCPOPT;
+	else if (streq(opt, "--log-ip-options"))
+		log->logflags |= IPT_LOG_IPOPT;
+	else if (streq(opt, "--log-uid"))
+		log->logflags |= IPT_LOG_UID;
+	else
+		return false;
+	return true;
+}
+
+static const struct extension_type matches[] = {
+	{ "tcp", sizeof(struct ipt_tcp), tcpudp_init, tcp_parse },
+	{ "udp", sizeof(struct ipt_udp), tcpudp_init, udp_parse },
+	{ "icmp", sizeof(struct ipt_icmp), icmp_init, icmp_parse },
+	{ "state", sizeof(struct ipt_state_info), NULL, state_parse },
+	{ "mark", sizeof(struct ipt_mark_info), NULL, mark_parse },
+};
+
+static const struct extension_type targets[] = {
+	{ "MARK", sizeof(struct ipt_mark_target_info), NULL, MARK_parse },
+	{ "REJECT", sizeof(struct ipt_reject_info), REJECT_init, REJECT_parse },
+	{ "LOG", sizeof(struct ipt_log_info), LOG_init, LOG_parse },
+	/* No options, no data. */
+	{ "NOTRACK", 0, NULL, NULL },
+};
+
+/* NULL if we don't know how to build it. */
+static const struct extension_type *
+find_type(const struct extension_type *types, unsigned int num,
+	  const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		if (streq(types[i].name, name))
+			return &types[i];
+	return NULL;
+}
+
+/* We only build revision 0 of each match and target (the layout in
+ * these headers), so there's no revision to choose: just check the
+ * kernel has that one. */
+static bool check_revision(struct parse_state *ps, const char *name,
+			   bool target)
+{
+#ifdef IPT_SO_GET_REVISION_MATCH
+	struct ipt_get_revision rev;
+	int len = sizeof(rev), ret;
+
+	memset(&rev, 0, sizeof(rev));
+	strncpy(rev.name, name, sizeof(rev.name) - 1);
+	rev.revision = 0;
+	ret = nf_getsockopt(NULL, PF_INET,
+			    target ? IPT_SO_GET_REVISION_TARGET
+			    : IPT_SO_GET_REVISION_MATCH,
+			    (char *)&rev, &len);
+	if (ret == -ENOENT)
+		return parse_fail(ps, "no %s '%s' (module not loaded?)",
+				  target ? "target" : "match", name);
+	/* Before revisions, everything was revision 0. */
+	if (ret < 0 && ret != -ENOPROTOOPT)
+		return parse_fail(ps, "%s '%s' revision 0 not supported",
+				  target ? "target" : "match", name);
+#endif
+	return true;
+}
+
+/* A match or target under construction. */
+struct element {
+	const struct extension_type *type;
+	unsigned char *blob;
+	unsigned int size;
+};
+
+static void *new_element(struct element *elem, const void *ctx,
+			 const struct extension_type *type, const char *name)
+{
+	/* Match and target headers have the same layout. */
+	struct ipt_entry_match *m;
+
+	elem->type = type;
+	elem->size = IPT_ALIGN(sizeof(struct ipt_entry_match))
+		+ IPT_ALIGN(type->size);
+	elem->blob = talloc_zero_size(ctx, elem->size);
+	m = (struct ipt_entry_match *)elem->blob;
+	m->u.user.match_size = elem->size;
+	strncpy(m->u.user.name, name, sizeof(m->u.user.name) - 1);
+	if (type->init)
+		type->init(m->data);
+	return m->data;
+}
+
+static void *element_data(struct element *elem)
+{
+	return ((struct ipt_entry_match *)elem->blob)->data;
+}
+
+static bool parse_address(const char *arg, struct in_addr *addr,
+			  struct in_addr *mask)
+{
+	char *copy = talloc_strdup(NULL, arg), *slash;
+	unsigned long bits;
+	bool ok = true;
+
+	slash = strchr(copy, '/');
+	if (slash) {
+		*slash = '\0';
+		if (strchr(slash + 1, '.'))
+			ok = inet_atou32(slash + 1, &mask->s_addr);
+		else if ((ok = parse_number(slash + 1, 32, &bits)))
+			mask->s_addr = bits ? htonl(~0U << (32 - bits)) : 0;
+	} else
+		mask->s_addr = 0xFFFFFFFF;
+
+	ok = ok && inet_atou32(copy, &addr->s_addr);
+	addr->s_addr &= mask->s_addr;
+	talloc_free(copy);
+	return ok;
+}
+
+static bool parse_interface(const char *arg, char name[IFNAMSIZ],
+			    unsigned char mask[IFNAMSIZ])
+{
+	unsigned int len = strlen(arg);
+
+	if (len == 0 || len >= IFNAMSIZ)
+		return false;
+
+	strcpy(name, arg);
+	/* eth+ matches any eth interface, eth0 must match the nul too. */
+	if (arg[len-1] == '+')
+		memset(mask, 0xFF, len - 1);
+	else
+		memset(mask, 0xFF, len + 1);
+	return true;
+}
+
+static bool parse_proto(const char *arg, u_int16_t *proto)
+{
+	unsigned long num;
+
+	if (strcasecmp(arg, "tcp") == 0)
+		*proto = IPPROTO_TCP;
+	else if (strcasecmp(arg, "udp") == 0)
+		*proto = IPPROTO_UDP;
+	else if (strcasecmp(arg, "icmp") == 0)
+		*proto = IPPROTO_ICMP;
+	else if (strcasecmp(arg, "all") == 0)
+		*proto = 0;
+	else if (parse_number(arg, 255, &num))
+		*proto = num;
+	else
+		return false;
+	return true;
+}
+
+static const char *proto_match(u_int16_t proto)
+{
+	switch (proto) {
+	case IPPROTO_TCP: return "tcp";
+	case IPPROTO_UDP: return "udp";
+	case IPPROTO_ICMP: return "icmp";
+	}
+	return NULL;
+}
+
+static int standard_verdict(const char *name)
+{
+	if (streq(name, "ACCEPT"))
+		return -NF_ACCEPT - 1;
+	if (streq(name, "DROP"))
+		return -NF_DROP - 1;
+	if (streq(name, "QUEUE"))
+		return -NF_QUEUE - 1;
+	if (streq(name, "RETURN"))
+		return IPT_RETURN;
+	return 0;
+}
+
+static struct chain *find_chain(struct table *t, const char *name)
+{
+	struct chain *c;
+
+	list_for_each_entry(c, &t->chains, list)
+		if (streq(c->name, name))
+			return c;
+	return NULL;
+}
+
+static struct ipt_entry *standard_entry(const void *ctx, int verdict)
+{
+	unsigned int size = IPT_ALIGN(sizeof(struct ipt_entry))
+		+ IPT_ALIGN(sizeof(struct ipt_standard_target));
+	struct ipt_entry *e = talloc_zero_size(ctx, size);
+	struct ipt_standard_target *t = (void *)e->elems;
+
+	e->target_offset = IPT_ALIGN(sizeof(struct ipt_entry));
+	e->next_offset = size;
+	t->target.u.user.target_size = IPT_ALIGN(sizeof(*t));
+	t->verdict = verdict;
+	return e;
+}
+
+/* User chains start with an ERROR entry naming them; tables end with one. */
+static struct ipt_entry *error_entry(const void *ctx, const char *name)
+{
+	unsigned int tsize = IPT_ALIGN(sizeof(struct ipt_entry_target))
+		+ IPT_ALIGN(IPT_FUNCTION_MAXNAMELEN);
+	unsigned int size = IPT_ALIGN(sizeof(struct ipt_entry)) + tsize;
+	struct ipt_entry *e = talloc_zero_size(ctx, size);
+	struct ipt_entry_target *t = (void *)e->elems;
+
+	e->target_offset = IPT_ALIGN(sizeof(struct ipt_entry));
+	e->next_offset = size;
+	t->u.user.target_size = tsize;
+	strcpy(t->u.user.name, IPT_ERROR_TARGET);
+	strncpy((char *)t->data, name, IPT_FUNCTION_MAXNAMELEN - 1);
+	return e;
+}
+
+static bool parse_counters(const char *str, struct ipt_counters *c)
+{
+	unsigned long long pcnt, bcnt;
+	char end;
+
+	if (sscanf(str, "[%llu:%llu%c", &pcnt, &bcnt, &end) != 3 || end != ']')
+		return false;
+	c->pcnt = pcnt;
+	c->bcnt = bcnt;
+	return true;
+}
+
+/* Parse the arguments of a -A line into a rule. */
+static bool parse_rule(struct parse_state *ps, struct table *t)
+{
+	struct element match[RULESET_MAX_ARGS], target;
+	const struct extension_type *type;
+	unsigned int nmatch = 0, i, size, off;
+	struct ipt_entry e, *entry;
+	struct chain *chain;
+	struct rule *rule;
+	bool invert = false;
+	int verdict = 0;
+	char *jump = NULL;
+	const char *arg;
+
+	memset(&e, 0, sizeof(e));
+	target.blob = NULL;
+
+	if (ps->arg < ps->argc && parse_counters(ps->argv[ps->arg],
+						 &e.counters)) {
+		t->counters = true;
+		ps->arg++;
+	}
+
+	if (ps->arg == ps->argc || !streq(ps->argv[ps->arg], "-A"))
+		return parse_fail(ps, "expected -A");
+	ps->arg++;
+	if (ps->arg == ps->argc
+	    || !(chain = find_chain(t, ps->argv[ps->arg])))
+		return parse_fail(ps, "unknown chain '%s'",
+				  ps->arg < ps->argc ? ps->argv[ps->arg] : "");
+	ps->arg++;
+
+	while (ps->arg < ps->argc) {
+		const char *opt = ps->argv[ps->arg++];
+
+		if (streq(opt, "!")) {
+			invert = !invert;
+			continue;
+		}
+
+		if (streq(opt, "-s") || streq(opt, "--source")) {
+			arg = option_arg(ps, &invert);
+			if (!arg || !parse_address(arg, &e.ip.src, &e.ip.smsk))
+				return parse_fail(ps, "bad source '%s'", arg);
+			if (invert)
+				e.ip.invflags |= IPT_INV_SRCIP;
+		} else if (streq(opt, "-d") || streq(opt, "--destination")) {
+			arg = option_arg(ps, &invert);
+			if (!arg || !parse_address(arg, &e.ip.dst, &e.ip.dmsk))
+				return parse_fail(ps, "bad destination '%s'",
+						  arg);
+			if (invert)
+				e.ip.invflags |= IPT_INV_DSTIP;
+		} else if (streq(opt, "-i") || streq(opt, "--in-interface")) {
+			arg = option_arg(ps, &invert);
+			if (!arg || !parse_interface(arg, e.ip.iniface,
+						     e.ip.iniface_mask))
+				return parse_fail(ps, "bad interface '%s'",
+						  arg);
+			if (invert)
+				e.ip.invflags |= IPT_INV_VIA_IN;
+		} else if (streq(opt, "-o") || streq(opt, "--out-interface")) {
+			arg = option_arg(ps, &invert);
+			if (!arg || !parse_interface(arg, e.ip.outiface,
+						     e.ip.outiface_mask))
+				return parse_fail(ps, "bad interface '%s'",
+						  arg);
+			if (invert)
+				e.ip.invflags |= IPT_INV_VIA_OUT;
+		} else if (streq(opt, "-p") || streq(opt, "--protocol")) {
+			arg = option_arg(ps, &invert);
+			if (!arg || !parse_proto(arg, &e.ip.proto))
+				return parse_fail(ps, "bad protocol '%s'", arg);
+			if (invert)
+				e.ip.invflags |= IPT_INV_PROTO;
+		} else if (streq(opt, "-f") || streq(opt, "--fragment")) {
+			e.ip.flags |= IPT_F_FRAG;
+			if (invert)
+				e.ip.invflags |= IPT_INV_FRAG;
+		} else if (streq(opt, "-m") || streq(opt, "--match")) {
+			if (!(arg = option_arg(ps, &invert)))
+				return parse_fail(ps, "-m needs a match name");
+			type = find_type(matches, ARRAY_SIZE(matches), arg);
+			if (!type)
+				return parse_fail(ps, "unknown match '%s'"
+						  " (use iptables-restore)",
+						  arg);
+			if (!check_revision(ps, arg, false))
+				return false;
+			new_element(&match[nmatch++], ps, type, arg);
+		} else if (streq(opt, "-j") || streq(opt, "--jump")) {
+			if (!(arg = option_arg(ps, &invert)))
+				return parse_fail(ps, "-j needs a target");
+			if (target.blob || verdict || jump)
+				return parse_fail(ps, "more than one target");
+			if ((verdict = standard_verdict(arg)) != 0)
+				continue;
+			if (find_chain(t, arg)) {
+				if (find_chain(t, arg)->hook != -1)
+					return parse_fail(ps, "can't jump to "
+							  "builtin chain %s",
+							  arg);
+				jump = talloc_strdup(ps, arg);
+				continue;
+			}
+			type = find_type(targets, ARRAY_SIZE(targets), arg);
+			if (!type)
+				return parse_fail(ps, "unknown target '%s'"
+						  " (use iptables-restore)",
+						  arg);
+			if (!check_revision(ps, arg, true))
+				return false;
+			new_element(&target, ps, type, arg);
+		} else if (streq(opt, "-c") || streq(opt, "--set-counters")) {
+			unsigned long long pcnt, bcnt;
+
+			if (ps->arg + 2 > ps->argc
+			    || sscanf(ps->argv[ps->arg], "%llu", &pcnt) != 1
+			    || sscanf(ps->argv[ps->arg+1], "%llu", &bcnt) != 1)
+				return parse_fail(ps, "bad counters");
+			e.counters.pcnt = pcnt;
+			e.counters.bcnt = bcnt;
+			t->counters = true;
+			ps->arg += 2;
+		} else {
+			/* Options for the target, or the latest match. */
+			bool done = false;
+			const char *pm;
+
+			if (target.blob && target.type->parse)
+				done = target.type->parse(ps, opt, invert,
+						element_data(&target));
+			for (i = nmatch; !done && !ps->failed && i > 0; i--)
+				if (match[i-1].type->parse)
+					done = match[i-1].type->parse(ps, opt,
+						invert, element_data(&match[i-1]));
+
+			/* -p tcp --dport 22 implies -m tcp. */
+			if (!done && !ps->failed
+			    && (pm = proto_match(e.ip.proto))
+			    && !(e.ip.invflags & IPT_INV_PROTO)) {
+				type = find_type(matches, ARRAY_SIZE(matches),
+						 pm);
+				for (i = 0; i < nmatch; i++)
+					if (match[i].type == type)
+						break;
+				if (i == nmatch) {
+					if (!check_revision(ps, pm, false))
+						return false;
+					new_element(&match[nmatch++], ps, type,
+						    pm);
+					done = type->parse(ps, opt, invert,
+						element_data(&match[i]));
+				}
+			}
+			if (ps->failed)
+				return false;
+			if (!done)
+				return parse_fail(ps, "unknown option '%s'"
+						  " (use iptables-restore)",
+						  opt);
+		}
+		invert = false;
+	}
+
+	/* No target: just count. */
+	if (!target.blob && !jump && !verdict)
+		verdict = IPT_CONTINUE;
+
+	size = IPT_ALIGN(sizeof(struct ipt_entry));
+	for (i = 0; i < nmatch; i++)
+		size += match[i].size;
+	if (target.blob)
+		size += target.size;
+	else
+		size += IPT_ALIGN(sizeof(struct ipt_standard_target));
+
+	rule = talloc(chain, struct rule);
+	rule->jump = talloc_steal(rule, jump);
+	entry = rule->entry = talloc_zero_size(rule, size);
+	*entry = e;
+
+	off = IPT_ALIGN(sizeof(struct ipt_entry));
+	for (i = 0; i < nmatch; i++) {
+		memcpy((char *)entry + off, match[i].blob, match[i].size);
+		off += match[i].size;
+	}
+	entry->target_offset = off;
+	entry->next_offset = size;
+	if (target.blob)
+		memcpy((char *)entry + off, target.blob, target.size);
+	else {
+		struct ipt_standard_target *st = (void *)entry + off;
+
+		st->target.u.user.target_size
+			= IPT_ALIGN(sizeof(struct ipt_standard_target));
+		st->verdict = verdict;
+	}
+
+	list_add_tail(&rule->list, &chain->rules);
+	return true;
+}
+
+static const char *const hook_names[NF_IP_NUMHOOKS] = {
+	[NF_IP_PRE_ROUTING] = "PREROUTING",
+	[NF_IP_LOCAL_IN] = "INPUT",
+	[NF_IP_FORWARD] = "FORWARD",
+	[NF_IP_LOCAL_OUT] = "OUTPUT",
+	[NF_IP_POST_ROUTING] = "POSTROUTING",
+};
+
+static bool start_table(struct parse_state *ps, struct table *t,
+			const char *name)
+{
+	int len = sizeof(t->info), ret, h;
+
+	memset(&t->info, 0, sizeof(t->info));
+	INIT_LIST_HEAD(&t->chains);
+	t->counters = false;
+
+	if (strlen(name) >= sizeof(t->info.name))
+		return parse_fail(ps, "bad table name '%s'", name);
+	strcpy(t->info.name, name);
+
+	ret = nf_getsockopt(NULL, PF_INET, IPT_SO_GET_INFO,
+			    (char *)&t->info, &len);
+	if (ret < 0)
+		return parse_fail(ps, "can't get table '%s': %s (module "
+				  "not loaded?)", name, strerror(-ret));
+
+	/* Builtin chains, in hook order, accepting unless told otherwise. */
+	for (h = 0; h < NF_IP_NUMHOOKS; h++) {
+		struct chain *c;
+
+		if (!(t->info.valid_hooks & (1 << h)))
+			continue;
+		c = talloc_zero(ps, struct chain);
+		c->name = talloc_strdup(c, hook_names[h]);
+		c->hook = h;
+		c->policy = -NF_ACCEPT - 1;
+		INIT_LIST_HEAD(&c->rules);
+		list_add_tail(&c->list, &t->chains);
+	}
+	return true;
+}
+
+/* :name policy [packets:bytes] */
+static bool parse_chain(struct parse_state *ps, struct table *t)
+{
+	const char *name = ps->argv[0] + 1;
+	struct chain *c;
+
+	if (ps->argc < 2 || !*name)
+		return parse_fail(ps, "bad chain line");
+
+	c = find_chain(t, name);
+	if (c && c->hook == -1)
+		return parse_fail(ps, "chain '%s' declared twice", name);
+
+	if (!c) {
+		if (!streq(ps->argv[1], "-"))
+			return parse_fail(ps, "policy for user chain '%s'",
+					  name);
+		if (strlen(name) >= IPT_FUNCTION_MAXNAMELEN)
+			return parse_fail(ps, "chain name '%s' too long", name);
+		c = talloc_zero(ps, struct chain);
+		c->name = talloc_strdup(c, name);
+		c->hook = -1;
+		INIT_LIST_HEAD(&c->rules);
+		list_add_tail(&c->list, &t->chains);
+	} else {
+		c->policy = standard_verdict(ps->argv[1]);
+		if (c->policy != -NF_ACCEPT - 1 && c->policy != -NF_DROP - 1)
+			return parse_fail(ps, "bad policy '%s'", ps->argv[1]);
+	}
+
+	if (ps->argc > 2) {
+		if (!parse_counters(ps->argv[2], &c->counters))
+			return parse_fail(ps, "bad counters '%s'",
+					  ps->argv[2]);
+		t->counters = true;
+	}
+	return true;
+}
+
+/* Lay the chains out into a blob, and hand it to the kernel. */
+static bool commit_table(struct parse_state *ps, struct table *t)
+{
+	struct ipt_replace *repl;
+	struct ipt_counters_info *counters;
+	struct ipt_entry *e, **entries;
+	unsigned int num = 0, size = 0, off, i, max;
+	struct chain *c;
+	struct rule *r;
+	int ret;
+
+	/* Count entries and work out where each chain starts. */
+	list_for_each_entry(c, &t->chains, list) {
+		if (c->hook == -1) {
+			size += error_entry(ps, c->name)->next_offset;
+			num++;
+		}
+		c->offset = size;
+		list_for_each_entry(r, &c->rules, list) {
+			size += r->entry->next_offset;
+			num++;
+		}
+		size += standard_entry(ps, 0)->next_offset;
+		num++;
+	}
+	size += error_entry(ps, IPT_ERROR_TARGET)->next_offset;
+	num++;
+
+	repl = talloc_zero_size(ps, sizeof(*repl) + size);
+	entries = talloc_array(ps, struct ipt_entry *, num);
+	strcpy(repl->name, t->info.name);
+	repl->valid_hooks = t->info.valid_hooks;
+	repl->num_entries = num;
+	repl->size = size;
+	repl->num_counters = t->info.num_entries;
+	repl->counters = talloc_zero_array(ps, struct ipt_counters,
+					   t->info.num_entries);
+
+	off = 0;
+	num = 0;
+	list_for_each_entry(c, &t->chains, list) {
+		if (c->hook == -1) {
+			e = error_entry(ps, c->name);
+			memcpy((char *)repl->entries + off, e, e->next_offset);
+			entries[num++] = (void *)repl->entries + off;
+			off += e->next_offset;
+		} else
+			repl->hook_entry[c->hook] = off;
+
+		list_for_each_entry(r, &c->rules, list) {
+			e = (void *)repl->entries + off;
+			memcpy(e, r->entry, r->entry->next_offset);
+			if (r->jump) {
+				struct ipt_standard_target *st;
+
+				st = (void *)e + e->target_offset;
+				st->verdict = find_chain(t, r->jump)->offset;
+			}
+			entries[num++] = e;
+			off += e->next_offset;
+		}
+
+		e = standard_entry(ps, c->hook == -1 ? IPT_RETURN : c->policy);
+		e->counters = c->counters;
+		if (c->hook != -1)
+			repl->underflow[c->hook] = off;
+		memcpy((char *)repl->entries + off, e, e->next_offset);
+		entries[num++] = (void *)repl->entries + off;
+		off += e->next_offset;
+	}
+	e = error_entry(ps, IPT_ERROR_TARGET);
+	memcpy((char *)repl->entries + off, e, e->next_offset);
+	entries[num++] = (void *)repl->entries + off;
+
+	ret = nf_setsockopt(NULL, PF_INET, IPT_SO_SET_REPLACE, (char *)repl,
+			    sizeof(*repl) + size);
+	if (ret < 0)
+		return parse_fail(ps, "replacing table '%s' failed: %s",
+				  t->info.name, strerror(-ret));
+
+	if (!t->counters)
+		return true;
+
+	/* The kernel zeroes counters on replace: add ours back. */
+	max = num;
+	counters = talloc_zero_size(ps, sizeof(*counters)
+				    + max * sizeof(struct ipt_counters));
+	strcpy(counters->name, t->info.name);
+	counters->num_counters = max;
+	for (i = 0; i < max; i++)
+		counters->counters[i] = entries[i]->counters;
+
+	ret = nf_setsockopt(NULL, PF_INET, IPT_SO_SET_ADD_COUNTERS,
+			    (char *)counters, sizeof(*counters)
+			    + max * sizeof(struct ipt_counters));
+	if (ret < 0)
+		return parse_fail(ps, "setting counters for '%s' failed: %s",
+				  t->info.name, strerror(-ret));
+	return true;
+}
+
+/* Split a line into words, with iptables-save's "quoted strings". */
+static bool split_line(struct parse_state *ps, char *line)
+{
+	char *p = line, *w;
+
+	ps->argc = ps->arg = 0;
+	for (;;) {
+		while (isspace(*p))
+			p++;
+		if (!*p)
+			return true;
+		if (ps->argc == RULESET_MAX_ARGS)
+			return parse_fail(ps, "too many arguments");
+
+		if (*p == '"') {
+			w = ++p;
+			ps->argv[ps->argc++] = w;
+			while (*p && *p != '"') {
+				if (*p == '\\' && p[1])
+					p++;
+				*w++ = *p++;
+			}
+			if (!*p)
+				return parse_fail(ps, "unterminated quote");
+			p++;
+			*w = '\0';
+		} else {
+			ps->argv[ps->argc++] = p;
+			while (*p && !isspace(*p))
+				p++;
+			if (*p)
+				*p++ = '\0';
+		}
+	}
+}
+
+static bool load_ruleset(struct parse_state *ps, char *file,
+			 unsigned long size)
+{
+	struct table table;
+	bool in_table = false;
+	char *line, *end;
+
+	for (line = file; line < file + size; line = end + 1) {
+		end = line + strcspn(line, "\n");
+		*end = '\0';
+		ps->line++;
+
+		if (!split_line(ps, line))
+			return false;
+		if (ps->argc == 0 || ps->argv[0][0] == '#')
+			continue;
+
+		if (ps->argv[0][0] == '*') {
+			if (in_table)
+				return parse_fail(ps, "missing COMMIT");
+			if (!start_table(ps, &table, ps->argv[0] + 1))
+				return false;
+			in_table = true;
+		} else if (!in_table)
+			return parse_fail(ps, "not in a table");
+		else if (streq(ps->argv[0], "COMMIT")) {
+			if (!commit_table(ps, &table))
+				return false;
+			in_table = false;
+		} else if (ps->argv[0][0] == ':') {
+			if (!parse_chain(ps, &table))
+				return false;
+		} else if (!parse_rule(ps, &table))
+			return false;
+	}
+
+	if (in_table)
+		return parse_fail(ps, "missing COMMIT");
+	return true;
+}
+
+static bool ruleset(int argc, char **argv)
+{
+	struct parse_state *ps;
+	unsigned long size;
+	char *file;
+	bool ret;
+	int fd;
+
+	if (argc != 3 || !streq(argv[1], "load")) {
+		nfsim_log(LOG_ALWAYS, "ruleset: usage: ruleset load <file>");
+		return false;
+	}
+
+	fd = open(argv[2], O_RDONLY);
+	if (fd < 0) {
+		nfsim_log(LOG_ALWAYS, "ruleset: can't open %s: %s",
+			  argv[2], strerror(errno));
+		return false;
+	}
+	file = grab_file(fd, &size);
+	close(fd);
+	if (!file) {
+		nfsim_log(LOG_ALWAYS, "ruleset: can't read %s: %s",
+			  argv[2], strerror(errno));
+		return false;
+	}
+	file = talloc_realloc(NULL, file, char, size + 1);
+	file[size] = '\0';
+
+	ps = talloc_zero(file, struct parse_state);
+	ps->file = argv[2];
+
+	set_local_user_copies(true);
+	ret = load_ruleset(ps, file, size);
+	set_local_user_copies(false);
+
+	talloc_free(file);
+	return ret;
+}
+
+static void ruleset_help(int argc, char **argv)
+{
+#include "ruleset-help:ruleset"
+/*** XML Help:
+    <section id="c:ruleset">
+     <title><command>ruleset</command></title>
+     <para>Load iptables rules without running iptables</para>
+     <cmdsynopsis>
+      <command>ruleset load</command>
+      <arg choice="req"><replaceable>file</replaceable></arg>
+     </cmdsynopsis>
+     <para><command>ruleset load</command> reads a file in the format
+      written by <command>iptables-save</command>, and replaces each table
+      in it directly, as <command>iptables-restore</command> would.  This
+      is much faster than running <command>iptables-restore</command>
+      for large rulesets, but only understands the tcp, udp, icmp, state
+      and mark matches and the standard, MARK, REJECT, LOG and NOTRACK
+      targets (revision 0 of each); a file using any other match or
+      target is refused.  Use <command>iptables-restore</command> for
+      anything else, or to test the real iptables binaries.</para>
+     <para>Each table's module must already be loaded.  Builtin chains
+      not mentioned in the file get an ACCEPT policy and no rules.
+      Counters given with <option>-c</option> are restored.</para>
+    </section>
+*/
+}
+
+static void init(void)
+{
+	tui_register_command("ruleset", ruleset, ruleset_help);
+}
+
+init_call(init);
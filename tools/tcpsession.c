@@ -25,6 +25,12 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <utils.h>
 #include "gen_ip.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
 static void tcpsession_help(int argc, char **argv)
 {
 #include "tcpsession-help:tcpsession"
@@ -35,6 +41,8 @@ static void tcpsession_help(int argc, char **argv)
      <cmdsynopsis>
       <command>tcpsession</command>
       <arg choice="req">OPEN</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
+      <arg choice="opt">WIN=<replaceable>window</replaceable></arg>
       <arg choice="req">src</arg>
       <arg choice="req">dest</arg>
       <arg choice="req">srcpt</arg>
@@ -43,6 +51,8 @@ static void tcpsession_help(int argc, char **argv)
      <cmdsynopsis>
       <command>tcpsession</command>
       <arg choice="req">OPEN</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
+      <arg choice="opt">WIN=<replaceable>window</replaceable></arg>
       <arg choice="req">src</arg>
       <arg choice="req">dest</arg>
       <arg choice="req">srcpt</arg>
@@ -55,44 +65,89 @@ static void tcpsession_help(int argc, char **argv)
      <cmdsynopsis>
       <command>tcpsession</command>
       <arg choice="req">DATA</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
       <arg choice="req">direction</arg>
       <arg choice="req"><replaceable>args</replaceable></arg>
      </cmdsynopsis>
+     <cmdsynopsis>
+      <command>tcpsession</command>
+      <arg choice="req">SEND</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
+      <arg choice="req">direction</arg>
+      <group choice="req">
+       <arg>BYTES=<replaceable>number</replaceable></arg>
+       <arg>FILE=<replaceable>filename</replaceable></arg>
+      </group>
+      <arg choice="opt">MSS=<replaceable>number</replaceable></arg>
+      <arg choice="opt">ACKEVERY=<replaceable>number</replaceable></arg>
+     </cmdsynopsis>
      <cmdsynopsis>
       <command>tcpsession</command>
       <arg choice="req">LENCHANGE</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
       <arg choice="req"><replaceable>number</replaceable></arg>
      </cmdsynopsis>
      <cmdsynopsis>
       <command>tcpsession</command>
       <arg choice="req">CLOSE</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
       <arg choice="req">direction</arg>
      </cmdsynopsis>
      <cmdsynopsis>
       <command>tcpsession</command>
       <arg choice="req">RESET</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
       <arg choice="req">direction</arg>
      </cmdsynopsis>
      <cmdsynopsis>
       <command>tcpsession</command>
       <arg choice="req">ABANDON</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>tcpsession</command>
+      <arg choice="req">CHECK</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
+      <arg choice="req">direction</arg>
+      <arg choice="req"><replaceable>bytes</replaceable></arg>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>tcpsession</command>
+      <arg choice="req">STATUS</arg>
+      <arg choice="opt">NAME=<replaceable>name</replaceable></arg>
      </cmdsynopsis>
 
-     <para><command>tcpsession</command> is shorthand for creating a
-     TCP session using multiple gen_ip commands.  The four-argument
-     <arg>OPEN</arg> form creates a simple connection (no NAT
-     expected), the eight-argument form creates a connection which
-     might be NATted.  You can only have one open connection at a
-     time: this is used for all operations.  Sequence numbers will be
-     1001 for the sender, and 2001 for the recipient.  Initial packet
-     comes in eth0, replies come in eth1. </para>
-
-     <para>The <arg>DATA</arg> form sends data on the current
-     connection, in a single packet (and sends an ACK in reply).
-     <arg>direction</arg> is either 'original' or 'reply'.</para>
+     <para><command>tcpsession</command> drives TCP sessions through
+     the simulator, building each segment itself and checking that it
+     comes out the other side: a command fails if any segment it sends
+     is not delivered, or is delivered with the wrong addresses, ports,
+     flags, sequence numbers or length.  Any number of sessions can be
+     open at once: each command takes an optional
+     <arg>NAME=</arg><replaceable>name</replaceable> (straight after the
+     command word) to say which one, otherwise a session called
+     "default" is used.</para>
+
+     <para>The four-argument <arg>OPEN</arg> form creates a simple
+     connection (no NAT expected), the eight-argument form creates a
+     connection which might be NATted.  Sequence numbers will be 1001
+     for the sender, and 2001 for the recipient.  Initial packet comes
+     in eth0, replies come in eth1.  Both ends advertise a window of
+     <arg>WIN</arg> bytes (default 512), and never send more than the
+     other end's window without an acknowledgement.</para>
+
+     <para>The <arg>DATA</arg> form sends data on the connection, in a
+     single packet (and sends an ACK in reply).  <arg>direction</arg>
+     is either 'original' or 'reply'.</para>
+
+     <para>The <arg>SEND</arg> form transfers <arg>BYTES</arg> of
+     generated data, or the contents of <arg>FILE</arg>, in segments
+     of at most <arg>MSS</arg> bytes (default 1460) and within the
+     receiver's window.  The receiver sends an ACK after every
+     <arg>ACKEVERY</arg> segments (default 1), or when the window is
+     full.</para>
 
      <para>The <arg>LENCHANGE</arg> command sets expected change in
-     length of the next packet.  It is used to tell
+     length of the next data packet.  It is used to tell
      <command>tcpsession</command> that the next packet is going to
      expected to be shortened or lengthened.</para>
 
@@ -101,261 +156,594 @@ static void tcpsession_help(int argc, char **argv)
      who initiates the close.</para>
 
      <para>The <arg>ABANDON</arg> argument causes the connection to
-    simply be forgotten, so you can open a new one.</para> </section>
+     simply be forgotten, so you can open a new one.</para>
+
+     <para><arg>CHECK</arg> fails unless exactly <arg>bytes</arg> of
+     data sent in <arg>direction</arg> have been delivered (which can
+     differ from the amount sent if a helper changed it), and
+     <arg>STATUS</arg> shows the sequence numbers and byte counts of
+     the session, or of every session if no <arg>NAME</arg> is
+     given.</para>
+    </section>
 */
 }
 
+#define TCPSESSION_HASH_SIZE	256
+#define DEFAULT_SESSION		"default"
+#define DEFAULT_WINDOW		512
+#define DEFAULT_MSS		1460
+
+/* TCP flags we send and check. */
+#define SEG_SYN	0x02
+#define SEG_RST	0x04
+#define SEG_ACK	0x10
+#define SEG_FIN	0x01
+
 struct tcp_endpoint
 {
-	char *interface;
-	char *src, *dst, *spt, *dpt;
+	const char *interface;
+	u32 src, dst;
+	u16 spt, dpt;
 	u32 seq, ack;
+	/* Our data which the other end has acknowledged, up to here. */
+	u32 acked;
+	u16 window;
+	/* Data bytes we sent, and how much reached the other end. */
+	u64 sent, delivered;
 };
 
 struct tcpsession
 {
+	struct list_head list;
+	struct tcpsession *hash_next;
+	char *name;
 	struct tcp_endpoint original, reply;
 	int lenchange;
+	/* Another shard sends this session's segments. */
+	bool elsewhere;
 };
-static struct tcpsession *curr = NULL;
+static LIST_HEAD(sessions);
+static struct tcpsession *session_hash[TCPSESSION_HASH_SIZE];
 
-static bool tcp_send(struct tcp_endpoint *in, struct tcp_endpoint *out,
-		     int datalen, const char *flags, const char *win,
-		     int datanum, char *data[])
+static unsigned int session_hashfn(const char *name)
 {
-	char *ctx = talloc(NULL, char);
-	char *argv[1024];
-	int argc;
-
-	argc = 0;
-	argv[argc++] = talloc_strdup(ctx, "expect");
-	argv[argc++] = talloc_strdup(ctx, "gen_ip");
-	argv[argc++] = talloc_asprintf(ctx, "send:%s", out->interface);
-	argv[argc++] = talloc_asprintf(ctx, "{IPv4 %s %s %i 6 %s %s %s"
-				       " SEQ=%u ACK=%u*}",
-				       out->dst, out->src,
-				       datalen + curr->lenchange,
-				       out->dpt, out->spt, flags,
-				       out->ack, out->seq);
-	argv[argc] = NULL;
-
-	/* Don't have it abort, do that at top level. */
-	if (!tui_do_command(argc, argv, false))
-		goto fail;
+	return jhash((void *)name, strlen(name), 0)
+		& (TCPSESSION_HASH_SIZE - 1);
+}
+
+static struct tcpsession *find_session(const char *name)
+{
+	struct tcpsession *s;
+
+	for (s = session_hash[session_hashfn(name)]; s; s = s->hash_next)
+		if (streq(s->name, name))
+			return s;
+	return NULL;
+}
 
-	argc = 0;
-	argv[argc++] = talloc_strdup(ctx, "gen_ip");
-	argv[argc++] = talloc_asprintf(ctx, "IF=%s", in->interface);
-	argv[argc++] = talloc_strdup(ctx, in->src);
-	argv[argc++] = talloc_strdup(ctx, in->dst);
-	argv[argc++] = talloc_asprintf(ctx, "%i", datalen);
-	argv[argc++] = talloc_strdup(ctx, "6");
-	argv[argc++] = talloc_strdup(ctx, in->spt);
-	argv[argc++] = talloc_strdup(ctx, in->dpt);
-	argv[argc++] = talloc_strdup(ctx, flags);
-	argv[argc++] = talloc_asprintf(ctx, "SEQ=%u", in->seq);
-	argv[argc++] = talloc_asprintf(ctx, "ACK=%u", in->ack);
-	if (win)
-		argv[argc++] = talloc_strdup(ctx, win);
-	if (datanum) {
-		unsigned int i;
-		argv[argc++] = talloc_strdup(ctx, "DATA");
-		for (i = 0; i < datanum; i++)
-			argv[argc++] = talloc_strdup(ctx, data[i]);
+static void free_session(struct tcpsession *s)
+{
+	struct tcpsession **p;
+
+	for (p = &session_hash[session_hashfn(s->name)]; *p != s;
+	     p = &(*p)->hash_next);
+	*p = s->hash_next;
+	list_del(&s->list);
+	talloc_free(s);
+}
+
+/* What came out while we were sending a segment. */
+struct seen_segment
+{
+	const struct net_device *dev;
+	u32 saddr, daddr;
+	u16 sport, dport;
+	u32 seq, ack;
+	u8 flags;
+	unsigned int datalen;
+};
+static struct seen_segment seen[16];
+static unsigned int num_seen;
+static void (*next_observer)(struct sk_buff *skb,
+			     const struct net_device *dev);
+
+static void observe(struct sk_buff *skb, const struct net_device *dev)
+{
+	struct iphdr iph;
+	struct tcphdr tcph;
+	struct seen_segment *seg;
+
+	if (next_observer)
+		next_observer(skb, dev);
+
+	if (num_seen == ARRAY_SIZE(seen)
+	    || skb_copy_bits(skb, 0, &iph, sizeof(iph)) != 0
+	    || iph.protocol != IPPROTO_TCP
+	    || skb_copy_bits(skb, iph.ihl * 4, &tcph, sizeof(tcph)) != 0)
+		return;
+
+	seg = &seen[num_seen++];
+	seg->dev = dev;
+	seg->saddr = iph.saddr;
+	seg->daddr = iph.daddr;
+	seg->sport = ntohs(tcph.source);
+	seg->dport = ntohs(tcph.dest);
+	seg->seq = ntohl(tcph.seq);
+	seg->ack = ntohl(tcph.ack_seq);
+	seg->flags = ((u8 *)&tcph)[13] & (SEG_SYN|SEG_RST|SEG_ACK|SEG_FIN);
+	seg->datalen = ntohs(iph.tot_len) - iph.ihl * 4 - tcph.doff * 4;
+}
+
+static const char *describe_flags(u8 flags)
+{
+	static char buf[sizeof("/SYN/RST/ACK/FIN")];
+
+	sprintf(buf, "%s%s%s%s",
+		flags & SEG_SYN ? "/SYN" : "", flags & SEG_RST ? "/RST" : "",
+		flags & SEG_ACK ? "/ACK" : "", flags & SEG_FIN ? "/FIN" : "");
+	return buf[0] ? buf + 1 : "NONE";
+}
+
+/* Send a segment from in, and check out gets it. */
+static bool tcp_send(struct tcpsession *s,
+		     struct tcp_endpoint *in, struct tcp_endpoint *out,
+		     u8 flags, const void *data, unsigned int datalen,
+		     bool dump_data)
+{
+	static struct packet packet;
+	struct packet_desc desc = { .protocol = IPPROTO_TCP,
+				    .saddr = in->src, .daddr = in->dst,
+				    .sport = in->spt, .dport = in->dpt,
+				    .syn = !!(flags & SEG_SYN),
+				    .ack = !!(flags & SEG_ACK),
+				    .fin = !!(flags & SEG_FIN),
+				    .rst = !!(flags & SEG_RST),
+				    .seq = in->seq, .ack_seq = in->ack,
+				    .window = in->window,
+				    .datalen = datalen, .data = data };
+	unsigned int i, expect_len = datalen;
+	bool ok;
+
+	if (datalen)
+		expect_len += s->lenchange;
+
+	if (s->elsewhere) {
+		in->delivered += expect_len;
+		return true;
 	}
-	argv[argc] = NULL;
 
-	if (!tui_do_command(argc, argv, false))
-		goto fail;
+	build_packet(&packet, &desc);
+	next_observer = send_observer;
+	send_observer = observe;
+	num_seen = 0;
+	ok = send_packet(&packet, in->interface,
+			 dump_data ? talloc_strdup(NULL, "data") : NULL);
+	send_observer = next_observer;
+	if (!ok)
+		return false;
 
-	talloc_free(ctx);
-	return true;
-fail:
-	talloc_free(ctx);
+	for (i = 0; i < num_seen; i++) {
+		if (seen[i].dev
+		    && streq(seen[i].dev->name, out->interface)
+		    && seen[i].saddr == out->dst && seen[i].daddr == out->src
+		    && seen[i].sport == out->dpt && seen[i].dport == out->spt
+		    && seen[i].seq == out->ack && seen[i].ack == out->seq
+		    && seen[i].flags == flags
+		    && seen[i].datalen == expect_len) {
+			in->delivered += seen[i].datalen;
+			return true;
+		}
+	}
+
+	nfsim_log(LOG_ALWAYS, "tcpsession %s: expected %u.%u.%u.%u:%u ->"
+		  " %u.%u.%u.%u:%u %s SEQ=%u ACK=%u length %u on %s"
+		  " (%u other TCP packets sent)", s->name,
+		  NIPQUAD(out->dst), out->dpt, NIPQUAD(out->src), out->spt,
+		  describe_flags(flags), out->ack, out->seq, expect_len,
+		  out->interface, num_seen);
 	return false;
 }
 
-static bool open_session(const char *src, const char *dst,
-			 const char *spt, const char *dpt,
-			 const char *reply_src, const char *reply_dst,
-			 const char *reply_spt, const char *reply_dpt)
+/* out acknowledges everything in has sent. */
+static bool send_ack(struct tcpsession *s,
+		     struct tcp_endpoint *in, struct tcp_endpoint *out)
+{
+	if (!tcp_send(s, out, in, SEG_ACK, NULL, 0, false))
+		return false;
+	in->acked = in->seq;
+	return true;
+}
+
+static bool send_segment(struct tcpsession *s,
+			 struct tcp_endpoint *in, struct tcp_endpoint *out,
+			 const void *data, unsigned int len, bool dump_data)
+{
+	if (!tcp_send(s, in, out, SEG_ACK, data, len, dump_data))
+		return false;
+	in->seq += len;
+	in->sent += len;
+	out->ack += len + s->lenchange;
+	s->lenchange = 0;
+	return true;
+}
+
+static bool parse_address(const char *str, u32 *addr)
+{
+	const struct in_addr *a = dotted_to_addr(str);
+
+	if (!a) {
+		nfsim_log(LOG_ALWAYS, "Bad address `%s'", str);
+		return false;
+	}
+	*addr = a->s_addr;
+	return true;
+}
+
+static bool parse_port(const char *str, u16 *port)
+{
+	unsigned int p = string_to_number(str, 0, 65535);
+
+	if (p == -1) {
+		nfsim_log(LOG_ALWAYS, "Bad port `%s'", str);
+		return false;
+	}
+	*port = p;
+	return true;
+}
+
+static bool open_session(const char *name, int argc, char *argv[])
 {
-	curr = talloc(NULL, struct tcpsession);
-
-	curr->original.src = talloc_strdup(curr, src);
-	curr->original.dst = talloc_strdup(curr, dst);
-	curr->original.spt = talloc_strdup(curr, spt);
-	curr->original.dpt = talloc_strdup(curr, dpt);
-	curr->original.interface = talloc_strdup(curr, "eth0");
-	curr->original.seq = 1000;
-	curr->original.ack = 2000;
-
-	curr->reply.src = talloc_strdup(curr, reply_src);
-	curr->reply.dst = talloc_strdup(curr, reply_dst);
-	curr->reply.spt = talloc_strdup(curr, reply_spt);
-	curr->reply.dpt = talloc_strdup(curr, reply_dpt);
-	curr->reply.interface = talloc_strdup(curr, "eth1");
-	curr->reply.seq = 2000;
-	curr->reply.ack = 1000;
-
-	curr->lenchange = 0;
-
-	if (!tcp_send(&curr->original, &curr->reply, 0, "SYN", "WIN=512",
-		      0, NULL))
+	struct tcpsession *s;
+	unsigned int window = DEFAULT_WINDOW;
+	unsigned int h;
+
+	if (find_session(name)) {
+		nfsim_log(LOG_ALWAYS, "Session `%s' already open!", name);
+		return false;
+	}
+
+	if (argc && strstarts(argv[0], "WIN=")) {
+		window = string_to_number(argv[0] + 4, 1, 65535);
+		if (window == -1) {
+			nfsim_log(LOG_ALWAYS, "Bad window `%s'", argv[0]);
+			return false;
+		}
+		argc--;
+		argv++;
+	}
+	if (argc != 4 && argc != 8) {
+		tcpsession_help(0, NULL);
+		return false;
+	}
+
+	s = talloc_zero(NULL, struct tcpsession);
+	s->name = talloc_strdup(s, name);
+	if (!parse_address(argv[0], &s->original.src)
+	    || !parse_address(argv[1], &s->original.dst)
+	    || !parse_port(argv[2], &s->original.spt)
+	    || !parse_port(argv[3], &s->original.dpt))
+		goto fail;
+
+	if (argc == 8) {
+		if (!parse_address(argv[4], &s->reply.src)
+		    || !parse_address(argv[5], &s->reply.dst)
+		    || !parse_port(argv[6], &s->reply.spt)
+		    || !parse_port(argv[7], &s->reply.dpt))
+			goto fail;
+	} else {
+		s->reply.src = s->original.dst;
+		s->reply.dst = s->original.src;
+		s->reply.spt = s->original.dpt;
+		s->reply.dpt = s->original.spt;
+	}
+
+	s->original.interface = "eth0";
+	s->original.seq = s->original.acked = 1000;
+	s->original.ack = 2000;
+	s->original.window = window;
+
+	s->reply.interface = "eth1";
+	s->reply.seq = s->reply.acked = 2000;
+	s->reply.ack = 1000;
+	s->reply.window = window;
+
+	/* The whole session goes to one shard, even if NAT changes it. */
+	s->elsewhere = !shard_flow(s->original.src, s->original.dst,
+				   IPPROTO_TCP, s->original.spt,
+				   s->original.dpt);
+
+	if (!tcp_send(s, &s->original, &s->reply, SEG_SYN, NULL, 0, false))
 		goto fail;
-	curr->original.seq++;
-	curr->reply.ack++;
-	if (!tcp_send(&curr->reply, &curr->original, 0, "SYN/ACK", "WIN=512",
-		      0, NULL))
+	s->original.seq++;
+	s->reply.ack++;
+	if (!tcp_send(s, &s->reply, &s->original, SEG_SYN|SEG_ACK,
+		      NULL, 0, false))
 		goto fail;
-	curr->reply.seq++;
-	curr->original.ack++;
-	if (!tcp_send(&curr->original, &curr->reply, 0, "ACK", "WIN=512",
-		      0, NULL))
+	s->reply.seq++;
+	s->original.ack++;
+	if (!tcp_send(s, &s->original, &s->reply, SEG_ACK, NULL, 0, false))
 		goto fail;
+	s->original.acked = s->original.seq;
+	s->reply.acked = s->reply.seq;
+
+	h = session_hashfn(s->name);
+	s->hash_next = session_hash[h];
+	session_hash[h] = s;
+	list_add_tail(&s->list, &sessions);
 	return true;
 fail:
-	talloc_free(curr);
-	curr = NULL;
+	talloc_free(s);
 	return false;
 }
 
-static bool send_data(struct tcp_endpoint *in, struct tcp_endpoint *out,
+static bool send_data(struct tcpsession *s,
+		      struct tcp_endpoint *in, struct tcp_endpoint *out,
 		      int datanum, char *data[])
 {
-	int len = gen_ip_data_length(datanum, data);
-
-	if (!tcp_send(in, out, len, "ACK", NULL,
-		      datanum, data))
+	unsigned int i, size = datanum;
+	char *buf;
+	int len;
+	bool ok;
+
+	for (i = 0; i < datanum; i++)
+		size += strlen(data[i]);
+	buf = talloc_size(NULL, size);
+	len = gen_ip_data(buf, datanum, data);
+	if (len < 0) {
+		nfsim_log(LOG_ALWAYS, "Bad data");
+		talloc_free(buf);
 		return false;
-	in->seq += len;
-	out->ack += len + curr->lenchange;
-	curr->lenchange = 0;
+	}
 
 	/* Send ACK. */
-	return tcp_send(out, in, 0, "ACK", "WIN=512", 0, NULL);
+	ok = send_segment(s, in, out, buf, len, true) && send_ack(s, in, out);
+	talloc_free(buf);
+	return ok;
 }
 
-static bool close_session(struct tcp_endpoint *in, struct tcp_endpoint *out)
+/* Generated data is the alphabet, over and over. */
+static void fill_data(char *buf, u64 offset, unsigned int len)
 {
-	if (!tcp_send(in, out, 0, "FIN/ACK", NULL, 0, NULL))
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = 'a' + (offset + i) % 26;
+}
+
+static bool send_bulk(struct tcpsession *s,
+		      struct tcp_endpoint *in, struct tcp_endpoint *out,
+		      const char *data, unsigned long len,
+		      unsigned int mss, unsigned int ackevery)
+{
+	static char buf[65536];
+	unsigned long done = 0;
+	unsigned int unacked = 0;
+
+	while (done < len) {
+		unsigned int inflight = in->seq - in->acked;
+		unsigned int seglen;
+
+		/* Window full?  Receiver has to catch up. */
+		if (inflight >= out->window) {
+			if (!send_ack(s, in, out))
+				return false;
+			unacked = 0;
+			continue;
+		}
+
+		seglen = min(mss, out->window - inflight);
+		if (seglen > len - done)
+			seglen = len - done;
+		if (!data)
+			fill_data(buf, in->sent, seglen);
+		if (!send_segment(s, in, out, data ? data + done : buf,
+				  seglen, false))
+			return false;
+		done += seglen;
+
+		if (++unacked == ackevery) {
+			if (!send_ack(s, in, out))
+				return false;
+			unacked = 0;
+		}
+	}
+	return unacked == 0 || send_ack(s, in, out);
+}
+
+static bool send_session(struct tcpsession *s,
+			 struct tcp_endpoint *in, struct tcp_endpoint *out,
+			 int argc, char *argv[])
+{
+	unsigned int mss = DEFAULT_MSS, ackevery = 1;
+	unsigned long len = 0;
+	char *file = NULL;
+	bool have_len = false, ok;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (strstarts(argv[i], "BYTES=")) {
+			len = strtoul(argv[i] + 6, NULL, 0);
+			have_len = true;
+		} else if (strstarts(argv[i], "FILE=")) {
+			int fd = open(argv[i] + 5, O_RDONLY);
+			if (fd < 0) {
+				nfsim_log(LOG_ALWAYS, "Can't open %s: %s",
+					  argv[i] + 5, strerror(errno));
+				talloc_free(file);
+				return false;
+			}
+			talloc_free(file);
+			file = grab_file(fd, &len);
+			close(fd);
+			if (!file) {
+				nfsim_log(LOG_ALWAYS, "Can't read %s: %s",
+					  argv[i] + 5, strerror(errno));
+				return false;
+			}
+			have_len = true;
+		} else if (strstarts(argv[i], "MSS=")) {
+			mss = string_to_number(argv[i] + 4, 1, 65495);
+			if (mss == -1)
+				goto usage;
+		} else if (strstarts(argv[i], "ACKEVERY=")) {
+			ackevery = string_to_number(argv[i] + 9, 1, 65535);
+			if (ackevery == -1)
+				goto usage;
+		} else
+			goto usage;
+	}
+	if (!have_len)
+		goto usage;
+
+	ok = send_bulk(s, in, out, file, len, mss, ackevery);
+	if (file)
+		release_file(file, len);
+	return ok;
+
+usage:
+	if (file)
+		release_file(file, len);
+	tcpsession_help(0, NULL);
+	return false;
+}
+
+static bool close_session(struct tcpsession *s,
+			  struct tcp_endpoint *in, struct tcp_endpoint *out)
+{
+	if (!tcp_send(s, in, out, SEG_FIN|SEG_ACK, NULL, 0, false))
 		return false;
 	in->seq++;
 	out->ack++;
-	if (!tcp_send(out, in, 0, "FIN/ACK", NULL, 0, NULL))
+	if (!tcp_send(s, out, in, SEG_FIN|SEG_ACK, NULL, 0, false))
 		return false;
 	out->seq++;
 	in->ack++;
-	if (!tcp_send(in, out, 0, "ACK", NULL, 0, NULL))
+	if (!tcp_send(s, in, out, SEG_ACK, NULL, 0, false))
 		return false;
-	talloc_free(curr);
-	curr = NULL;
+	free_session(s);
 	return true;
 }
 
-static bool reset_session(struct tcp_endpoint *in, struct tcp_endpoint *out)
+static bool reset_session(struct tcpsession *s,
+			  struct tcp_endpoint *in, struct tcp_endpoint *out)
 {
-	if (!tcp_send(in, out, 0, "RST", NULL, 0, NULL))
+	if (!tcp_send(s, in, out, SEG_RST, NULL, 0, false))
 		return false;
-	talloc_free(curr);
-	curr = NULL;
+	free_session(s);
 	return true;
 }
 
-static bool tcpsession(int argc, char *argv[])
+static bool check_session(struct tcpsession *s, struct tcp_endpoint *in,
+			  const char *bytes)
 {
-	if (argc < 2) {
-		tcpsession_help(argc, argv);
+	if (in->delivered != strtoull(bytes, NULL, 0)) {
+		nfsim_log(LOG_ALWAYS, "tcpsession %s: %llu bytes delivered,"
+			  " not %s", s->name,
+			  (unsigned long long)in->delivered, bytes);
 		return false;
 	}
-	if (streq(argv[1], "OPEN")) {
-		if (curr) {
-			nfsim_log(LOG_ALWAYS, "Session already open!");
-			return false;
-		}
-		if (argc == 6)
-			return open_session(argv[2],argv[3],argv[4],argv[5],
-					    argv[3],argv[2],argv[5],argv[4]);
-		if (argc == 10)
-			return open_session(argv[2],argv[3],argv[4],argv[5],
-					    argv[6],argv[7],argv[8],argv[9]);
-		tcpsession_help(argc, argv);
-		return false;
+	return true;
+}
+
+static void show_endpoint(const char *dir, const struct tcp_endpoint *e)
+{
+	nfsim_log(LOG_ALWAYS, " %s: %u.%u.%u.%u:%u -> %u.%u.%u.%u:%u"
+		  " SEQ=%u ACK=%u WIN=%u sent %llu delivered %llu", dir,
+		  NIPQUAD(e->src), e->spt, NIPQUAD(e->dst), e->dpt,
+		  e->seq, e->ack, e->window, (unsigned long long)e->sent,
+		  (unsigned long long)e->delivered);
+}
+
+static void show_session(const struct tcpsession *s)
+{
+	nfsim_log(LOG_ALWAYS, "%s:", s->name);
+	show_endpoint("original", &s->original);
+	show_endpoint("reply", &s->reply);
+}
+
+static bool direction(struct tcpsession *s, const char *dir,
+		      struct tcp_endpoint **in, struct tcp_endpoint **out)
+{
+	if (streq(dir, "original")) {
+		*in = &s->original;
+		*out = &s->reply;
+		return true;
 	}
-	if (streq(argv[1], "DATA")) {
-		if (!curr) {
-			nfsim_log(LOG_ALWAYS, "Session not open!");
-			return false;
-		}
-		if (argc < 3) {
-			tcpsession_help(argc, argv);
-			return false;
-		}
-		if (streq(argv[2], "original"))
-			return send_data(&curr->original, &curr->reply,
-					 argc-3, argv+3);
-		if (streq(argv[2], "reply"))
-			return send_data(&curr->reply, &curr->original,
-					 argc-3, argv+3);
+	if (streq(dir, "reply")) {
+		*in = &s->reply;
+		*out = &s->original;
+		return true;
+	}
+	return false;
+}
+
+static bool tcpsession(int argc, char *argv[])
+{
+	const char *cmd, *name = NULL;
+	struct tcpsession *s;
+	struct tcp_endpoint *in, *out;
+
+	if (argc < 2) {
 		tcpsession_help(argc, argv);
 		return false;
 	}
-	if (streq(argv[1], "LENCHANGE")) {
-		int change;
-		if (argc != 3) {
-			tcpsession_help(argc, argv);
-			return false;
-		}
-		change = atoi(argv[2]);
-		if (!change) {
-			tcpsession_help(argc, argv);
-			return false;
-		}
-		curr->lenchange = change;
+	cmd = argv[1];
+	argc -= 2;
+	argv += 2;
+	if (argc && strstarts(argv[0], "NAME=")) {
+		name = argv[0] + 5;
+		argc--;
+		argv++;
+	}
+
+	if (streq(cmd, "OPEN"))
+		return open_session(name ? name : DEFAULT_SESSION, argc, argv);
+
+	if (streq(cmd, "STATUS") && !name && argc == 0) {
+		list_for_each_entry(s, &sessions, list)
+			show_session(s);
 		return true;
 	}
-	if (streq(argv[1], "CLOSE")) {
-		if (!curr) {
-			nfsim_log(LOG_ALWAYS, "Session not open!");
-			return false;
-		}
-		if (argc != 3) {
-			tcpsession_help(argc, argv);
-			return false;
-		}
-		if (streq(argv[2], "original"))
-			return close_session(&curr->original, &curr->reply);
-		if (streq(argv[2], "reply"))
-			return close_session(&curr->reply, &curr->original);
+
+	s = find_session(name ? name : DEFAULT_SESSION);
+	if (!s) {
+		nfsim_log(LOG_ALWAYS, "Session `%s' not open!",
+			  name ? name : DEFAULT_SESSION);
+		return false;
 	}
-	if (streq(argv[1], "RESET")) {
-		if (!curr) {
-			nfsim_log(LOG_ALWAYS, "Session not open!");
-			return false;
-		}
-		if (argc != 3) {
-			tcpsession_help(argc, argv);
-			return false;
+
+	if (streq(cmd, "DATA")) {
+		if (argc >= 1 && direction(s, argv[0], &in, &out))
+			return send_data(s, in, out, argc-1, argv+1);
+	} else if (streq(cmd, "SEND")) {
+		if (argc >= 1 && direction(s, argv[0], &in, &out))
+			return send_session(s, in, out, argc-1, argv+1);
+	} else if (streq(cmd, "LENCHANGE")) {
+		if (argc == 1 && atoi(argv[0])) {
+			s->lenchange = atoi(argv[0]);
+			return true;
 		}
-		if (streq(argv[2], "original"))
-			return reset_session(&curr->original, &curr->reply);
-		if (streq(argv[2], "reply"))
-			return reset_session(&curr->reply, &curr->original);
-	}
-	if (streq(argv[1], "ABANDON")) {
-		if (!curr) {
-			nfsim_log(LOG_ALWAYS, "Session not open!");
-			return false;
+	} else if (streq(cmd, "CLOSE")) {
+		if (argc == 1 && direction(s, argv[0], &in, &out))
+			return close_session(s, in, out);
+	} else if (streq(cmd, "RESET")) {
+		if (argc == 1 && direction(s, argv[0], &in, &out))
+			return reset_session(s, in, out);
+	} else if (streq(cmd, "ABANDON")) {
+		if (argc == 0) {
+			free_session(s);
+			return true;
 		}
-		if (argc != 2) {
-			tcpsession_help(argc, argv);
-			return false;
+	} else if (streq(cmd, "CHECK")) {
+		if (argc == 2 && direction(s, argv[0], &in, &out))
+			return check_session(s, in, argv[1]);
+	} else if (streq(cmd, "STATUS")) {
+		if (argc == 0) {
+			show_session(s);
+			return true;
 		}
-		talloc_free(curr);
-		curr = NULL;
-		return true;
 	}
-	tcpsession_help(argc, argv);
+	tcpsession_help(0, NULL);
 	return false;
 }
 
@@ -365,4 +753,3 @@ static void init(void)
 }
 
 init_call(init);
-
@@ -0,0 +1,382 @@
+/*
+
+Copyright (c) 2003,2004 Jeremy Kerr & Rusty Russell
+
+This file is part of nfsim.
+
+nfsim is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+nfsim is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with nfsim; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Packet templates: parse a gen_ip packet once, then send variants of it,
+ * patching fields and checksums in place. */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <core.h>
+#include <tui.h>
+#include <log.h>
+#include <utils.h>
+#include "gen_ip.h"
+
+struct template {
+	struct list_head list;
+	char *name;
+	char *definition;
+	char *interface;
+	char *dump_flags;
+	struct packet packet;
+};
+static LIST_HEAD(templates);
+
+static struct template *find_template(const char *name)
+{
+	struct template *t;
+
+	list_for_each_entry(t, &templates, list)
+		if (streq(t->name, name))
+			return t;
+	return NULL;
+}
+
+/* RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m') */
+static void csum_replace(u_int16_t *check, u_int16_t old, u_int16_t new)
+{
+	u_int32_t sum;
+
+	sum = (u_int16_t)~*check + (u_int16_t)~old + new;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	*check = ~sum;
+}
+
+/* Overwrite len bytes at field, fixing up the checksums (either of which
+ * can be NULL).  Offsets from the IP header give us 16-bit alignment. */
+static void patch(struct packet *packet, void *field, const void *new,
+		  unsigned int len, u_int16_t *check1, u_int16_t *check2)
+{
+	unsigned int off = (char *)field - (char *)&packet->iph;
+	unsigned int start = off & ~1, end = (off + len + 1) & ~1, i;
+	u_int16_t old[(end - start) / 2], now[(end - start) / 2];
+
+	memcpy(old, (char *)&packet->iph + start, end - start);
+	memcpy(field, new, len);
+	memcpy(now, (char *)&packet->iph + start, end - start);
+
+	for (i = 0; i < (end - start) / 2; i++) {
+		if (check1)
+			csum_replace(check1, old[i], now[i]);
+		if (check2)
+			csum_replace(check2, old[i], now[i]);
+	}
+}
+
+/* TCP or UDP checksum, which covers the addresses too.  NULL for none,
+ * including fragments after the first: that's just payload. */
+static u_int16_t *l4_check(struct packet *packet)
+{
+	if (packet->iph.frag_off & htons(IP_OFFSET))
+		return NULL;
+
+	switch (packet->iph.protocol) {
+	case IPPROTO_TCP:
+		return &packet->u.tcph.check;
+	case IPPROTO_UDP:
+		/* Zero means no checksum. */
+		return packet->u.udph.check ? &packet->u.udph.check : NULL;
+	}
+	return NULL;
+}
+
+static bool number_field(const char *name, const char *val,
+			 unsigned int max, unsigned int *num)
+{
+	unsigned long n;
+	char *end;
+
+	/* Not string_to_number: -1 is a valid 32-bit sequence number. */
+	errno = 0;
+	n = strtoul(val, &end, 0);
+	if (errno || end == val || *end || *val == '-' || n > max) {
+		nfsim_log(LOG_ALWAYS, "Bad %s `%s'", name, val);
+		return false;
+	}
+	*num = n;
+	return true;
+}
+
+/* Fragments after the first have no transport header to patch. */
+static bool has_l4_header(const struct packet *packet, u_int8_t proto)
+{
+	return packet->iph.protocol == proto
+		&& !(packet->iph.frag_off & htons(IP_OFFSET));
+}
+
+static bool wrong_protocol(const char *name)
+{
+	nfsim_log(LOG_ALWAYS, "%s does not apply to this packet", name);
+	return false;
+}
+
+/* Patch one NAME=value field into packet. */
+static bool patch_field(struct packet *packet, const char *arg)
+{
+	const char *val = strchr(arg, '=') + 1;
+	u_int16_t *l4 = l4_check(packet);
+	unsigned int num;
+	u_int8_t byte;
+	u_int16_t word;
+	u_int32_t dword;
+
+	if (strstarts(arg, "SRC=") || strstarts(arg, "DST=")) {
+		const struct in_addr *addr = dotted_to_addr(val);
+
+		if (!addr) {
+			nfsim_log(LOG_ALWAYS, "Bad address `%s'", val);
+			return false;
+		}
+		patch(packet, arg[0] == 'S' ? &packet->iph.saddr
+		      : &packet->iph.daddr, &addr->s_addr, 4,
+		      &packet->iph.check, l4);
+	} else if (strstarts(arg, "TTL=") || strstarts(arg, "TOS=")) {
+		if (!number_field(arg, val, 255, &num))
+			return false;
+		byte = num;
+		patch(packet, arg[1] == 'T' ? &packet->iph.ttl
+		      : &packet->iph.tos, &byte, 1, &packet->iph.check, NULL);
+	} else if (strstarts(arg, "ID=")) {
+		if (!number_field(arg, val, 65535, &num))
+			return false;
+		word = htons(num);
+		patch(packet, &packet->iph.id, &word, 2,
+		      &packet->iph.check, NULL);
+	} else if (strstarts(arg, "SPT=") || strstarts(arg, "DPT=")) {
+		if (!has_l4_header(packet, IPPROTO_TCP)
+		    && !has_l4_header(packet, IPPROTO_UDP))
+			return wrong_protocol(arg);
+		if (!number_field(arg, val, 65535, &num))
+			return false;
+		word = htons(num);
+		/* Ports are in the same place for TCP and UDP. */
+		patch(packet, arg[0] == 'S' ? &packet->u.udph.source
+		      : &packet->u.udph.dest, &word, 2, l4, NULL);
+	} else if (strstarts(arg, "SEQ=") || strstarts(arg, "ACK=")) {
+		if (!has_l4_header(packet, IPPROTO_TCP))
+			return wrong_protocol(arg);
+		if (!number_field(arg, val, UINT_MAX, &num))
+			return false;
+		dword = htonl(num);
+		patch(packet, arg[0] == 'S' ? &packet->u.tcph.seq
+		      : &packet->u.tcph.ack_seq, &dword, 4, l4, NULL);
+	} else if (strstarts(arg, "WIN=")) {
+		if (!has_l4_header(packet, IPPROTO_TCP))
+			return wrong_protocol(arg);
+		if (!number_field(arg, val, 65535, &num))
+			return false;
+		word = htons(num);
+		patch(packet, &packet->u.tcph.window, &word, 2, l4, NULL);
+	} else if (strstarts(arg, "FLAGS=")) {
+		struct tcphdr flags;
+
+		if (!has_l4_header(packet, IPPROTO_TCP))
+			return wrong_protocol(arg);
+		if (parse_flags(val, &flags))
+			return false;
+		/* Flags share a word with the data offset: keep that. */
+		flags.doff = packet->u.tcph.doff;
+		patch(packet, (char *)&packet->u.tcph + 12,
+		      (char *)&flags + 12, 2, l4, NULL);
+	} else if (strstarts(arg, "ICMPID=") || strstarts(arg, "ICMPSEQ=")) {
+		if (!has_l4_header(packet, IPPROTO_ICMP))
+			return wrong_protocol(arg);
+		if (!number_field(arg, val, 65535, &num))
+			return false;
+		word = htons(num);
+		patch(packet, arg[4] == 'I' ? &packet->u.icmph.un.echo.id
+		      : &packet->u.icmph.un.echo.sequence, &word, 2,
+		      &packet->u.icmph.checksum, NULL);
+	} else {
+		nfsim_log(LOG_ALWAYS, "Unknown field `%s'", arg);
+		return false;
+	}
+
+	/* A UDP checksum of 0 means none: the same sum is 0xffff. */
+	if (l4 && packet->iph.protocol == IPPROTO_UDP && *l4 == 0)
+		*l4 = 0xffff;
+	return true;
+}
+
+static bool template_define(int argc, char **argv)
+{
+	struct template *t, *old;
+	char *interface = NULL, *definition, *name = argv[0];
+	int i;
+
+	/* argv[0] is the name, then as for gen_ip. */
+	definition = talloc_strdup(NULL, "");
+	for (i = 1; i < argc; i++)
+		definition = talloc_asprintf_append(definition, "%s%s",
+						    i > 1 ? " " : "", argv[i]);
+
+	if (argc > 5 && strstarts(argv[1], "IF=")) {
+		interface = argv[1] + 3;
+		argc--;
+		argv++;
+	}
+
+	t = talloc_zero(NULL, struct template);
+	t->definition = talloc_steal(t, definition);
+	if (!parse_packet(&t->packet, argc, argv, &t->dump_flags)) {
+		talloc_free(t->dump_flags);
+		talloc_free(t);
+		return false;
+	}
+	talloc_steal(t, t->dump_flags);
+	t->interface = interface ? talloc_strdup(t, interface) : NULL;
+
+	old = find_template(name);
+	if (old) {
+		list_del(&old->list);
+		talloc_free(old);
+	}
+	t->name = talloc_strdup(t, name);
+	list_add_tail(&t->list, &templates);
+	return true;
+}
+
+static bool template_send(struct template *t, int argc, char **argv)
+{
+	struct packet packet;
+	const char *interface = t->interface;
+	int i;
+
+	/* Only copy as much as is used. */
+	memcpy(&packet, &t->packet,
+	       offsetof(struct packet, iph) + ntohs(t->packet.iph.tot_len));
+
+	for (i = 0; i < argc; i++) {
+		if (strstarts(argv[i], "IF=")) {
+			interface = argv[i] + 3;
+			continue;
+		}
+		if (!strchr(argv[i], '=')) {
+			nfsim_log(LOG_ALWAYS, "Expected FIELD=value, not `%s'",
+				  argv[i]);
+			return false;
+		}
+		if (!patch_field(&packet, argv[i]))
+			return false;
+	}
+	/* Another shard sends it. */
+	if (!packet_in_shard(&packet))
+		return true;
+	/* The skb takes the flags, and frees them with it. */
+	return send_packet(&packet, interface,
+			   t->dump_flags ? talloc_strdup(NULL, t->dump_flags)
+			   : NULL);
+}
+
+static void template_help(int argc, char **argv)
+{
+#include "template-help:template"
+/*** XML Help:
+    <section id="c:template">
+     <title><command>template</command></title>
+     <para>Send many variations of one packet quickly</para>
+     <cmdsynopsis>
+      <command>template</command>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>template define</command>
+      <arg choice="req"><replaceable>name</replaceable></arg>
+      <arg choice="req"><replaceable>gen_ip-arguments</replaceable></arg>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>template send</command>
+      <arg choice="req"><replaceable>name</replaceable></arg>
+      <arg choice="opt" rep="repeat"><replaceable>FIELD</replaceable>=<replaceable>value</replaceable></arg>
+     </cmdsynopsis>
+     <cmdsynopsis>
+      <command>template delete</command>
+      <arg choice="req"><replaceable>name</replaceable></arg>
+     </cmdsynopsis>
+     <para><command>template define</command> builds a packet from the
+      same arguments as <command>gen_ip</command> (including
+      <arg>IF=</arg>) and keeps it, replacing any template of the same
+      name.  <command>template send</command> sends a copy of it as
+      <command>gen_ip</command> would, first changing the fields given.
+      The fields are <arg>IF</arg> (where to send it), <arg>SRC</arg>,
+      <arg>DST</arg>, <arg>TTL</arg>, <arg>TOS</arg> and <arg>ID</arg>
+      for any packet, <arg>SPT</arg> and <arg>DPT</arg> for TCP and UDP,
+      <arg>SEQ</arg>, <arg>ACK</arg>, <arg>WIN</arg> and
+      <arg>FLAGS</arg> (as for <command>gen_ip</command>, eg. SYN/ACK)
+      for TCP, and <arg>ICMPID</arg> and <arg>ICMPSEQ</arg> for ICMP
+      echo packets.</para>
+     <para>The checksums are adjusted for just the fields changed (RFC
+      1624), rather than parsing the whole packet again, so this is much
+      faster than <command>gen_ip</command> for sending many packets in a
+      loop.  With no arguments, <command>template</command> lists the
+      templates.</para>
+    </section>
+*/
+}
+
+static bool template(int argc, char **argv)
+{
+	struct template *t;
+
+	if (argc == 1) {
+		list_for_each_entry(t, &templates, list)
+			nfsim_log(LOG_ALWAYS, "%s: %s", t->name, t->definition);
+		return true;
+	}
+
+	if (argc >= 3 && streq(argv[1], "define")) {
+		if (template_define(argc - 2, argv + 2))
+			return true;
+		template_help(0, NULL);
+		return false;
+	}
+
+	if (argc < 3 || (!streq(argv[1], "send") && !streq(argv[1], "delete"))) {
+		template_help(0, NULL);
+		return false;
+	}
+
+	t = find_template(argv[2]);
+	if (!t) {
+		nfsim_log(LOG_ALWAYS, "No template `%s'", argv[2]);
+		return false;
+	}
+
+	if (streq(argv[1], "send"))
+		return template_send(t, argc - 3, argv + 3);
+
+	if (argc != 3) {
+		template_help(0, NULL);
+		return false;
+	}
+	list_del(&t->list);
+	talloc_free(t);
+	return true;
+}
+
+static void init(void)
+{
+	tui_register_command("template", template, template_help);
+}
+
+init_call(init);